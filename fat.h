@@ -129,6 +129,9 @@ struct fat32FSInfo_struct {
 
 #define LAST_LONG_ENTRY 0x40
 
+#define EXTFLAGS_ACTIVE_FAT 0x000F
+#define EXTFLAGS_NO_MIRROR  0x0080
+
 typedef struct fatBS_struct fatBS;
 typedef struct fatBS16_struct fatBS16;
 typedef struct fatBS32_struct fatBS32;
@@ -0,0 +1,500 @@
+#include <pthread.h>
+#include "fat_check.h"
+#include "fat_helpers.h"
+#include "fat_index.h"
+#include "fat_names.h"
+
+const char * checkIssueNames[CHK_NONE] = {"cross-linked", "lost chain", "chain too short", "chain too long", "bad chain",
+	"FAT copy mismatch", "long name checksum", "free count"};
+
+struct FS_CheckWork_struct {
+	FS_Cluster dir;
+	char * path;
+	struct FS_CheckWork_struct * next;
+};
+
+struct FS_CheckState_struct {
+	FS_Instance * fsi;
+	FS_FATEntry * FAT;
+	uint32_t * owned;
+	uint32_t bytesPerCluster;
+	FS_CheckReport * report;
+	struct FS_CheckWork_struct * queue;
+	uint32_t pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+typedef struct FS_CheckWork_struct FS_CheckWork;
+typedef struct FS_CheckState_struct FS_CheckState;
+
+uint8_t claimCluster(FS_CheckState * state, FS_Cluster cluster) {
+	uint32_t mask = 1U << (cluster % 32);
+	return !(__sync_fetch_and_or(&(state->owned[cluster / 32]), mask) & mask);
+}
+
+uint8_t isClusterOwned(FS_CheckState * state, FS_Cluster cluster) {
+	return (state->owned[cluster / 32] >> (cluster % 32)) & 1;
+}
+
+FS_CheckProblem * addProblem(FS_CheckState * state, fs_check_issue issue, char * path) {
+	FS_CheckProblem * problem = calloc(1, sizeof(FS_CheckProblem));
+	if (NULL == problem)
+		return NULL;
+	problem->issue = issue;
+	problem->path = (NULL != path) ? strdup(path) : NULL;
+	pthread_mutex_lock(&(state->lock));
+	problem->next = state->report->problems;
+	state->report->problems = problem;
+	state->report->issueCounts[issue]++;
+	pthread_mutex_unlock(&(state->lock));
+	return problem;
+}
+
+void fillProblemEntry(FS_CheckProblem * problem, FS_Entry * ent) {
+	if (NULL == problem)
+		return;
+	problem->entry = *(ent->entry);
+	problem->entryOffset = ent->info->entryOffset;
+	problem->lfnOffset = ent->info->lfnOffset;
+	problem->lfnEntries = ent->info->numEntries - 1;
+	problem->isDirectory = maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY);
+}
+
+/* Walks a chain claiming every cluster in the ownership bitmap. Returns the
+ * issue which stopped the walk early, or CHK_NONE if the chain was whole. */
+fs_check_issue walkChain(FS_CheckState * state, FS_Cluster cluster, uint32_t * length, FS_Cluster * lastGood) {
+	FS_Instance * fsi = state->fsi;
+	*length = 0;
+	*lastGood = 0;
+	while (1) {
+		if (!isDataCluster(cluster, fsi) || (0 == state->FAT[cluster]) || isFATEntryBad(state->FAT[cluster], fsi))
+			return CHK_BADCHAIN;
+		if (!claimCluster(state, cluster))
+			return CHK_CROSSLINKED;
+		(*length)++;
+		*lastGood = cluster;
+		if (isFATEntryEOF(state->FAT[cluster], fsi))
+			return CHK_NONE;
+		cluster = state->FAT[cluster];
+	}
+}
+
+void queueDir(FS_CheckState * state, FS_Cluster dir, char * path) {
+	FS_CheckWork * work = malloc(sizeof(FS_CheckWork));
+	if (NULL == work)
+		return;
+	work->dir = dir;
+	work->path = strdup(path);
+	pthread_mutex_lock(&(state->lock));
+	work->next = state->queue;
+	state->queue = work;
+	state->pending++;
+	pthread_cond_signal(&(state->cond));
+	pthread_mutex_unlock(&(state->lock));
+}
+
+void checkEntry(FS_CheckState * state, char * dirPath, FS_Entry * ent) {
+	char * filename = getFilenameForEntry(ent->entry);
+	char * path = joinPath(dirPath, (NULL != filename) ? filename : "?");
+	free(filename);
+	if (NULL == path)
+		return;
+	if (NULL != ent->filename) {
+		fatEntry onDisk = *(ent->entry);
+		if (0xE5 == onDisk.DIR_Name[0])
+			onDisk.DIR_Name[0] = 0x05;
+		if (getLongNameChecksum(&onDisk) != ent->info->lfnChecksum)
+			fillProblemEntry(addProblem(state, CHK_LFNCHECKSUM, path), ent);
+	}
+	FS_Cluster first = getClusterForEntry(ent->entry);
+	uint32_t length = 0;
+	FS_Cluster lastGood = 0;
+	fs_check_issue issue = CHK_NONE;
+	if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY)) {
+		__sync_fetch_and_add(&(state->report->dirsChecked), 1);
+		issue = walkChain(state, first, &length, &lastGood);
+		if (0 < length)
+			queueDir(state, first, path);
+	} else {
+		__sync_fetch_and_add(&(state->report->filesChecked), 1);
+		uint32_t expected = (ent->entry->DIR_FileSize + (state->bytesPerCluster - 1)) / state->bytesPerCluster;
+		if (0 != first)
+			issue = walkChain(state, first, &length, &lastGood);
+		if ((CHK_NONE == issue) && (length < expected))
+			issue = CHK_CHAINTOOSHORT;
+		else if ((CHK_NONE == issue) && (length > expected))
+			issue = CHK_CHAINTOOLONG;
+	}
+	if (CHK_NONE != issue) {
+		FS_CheckProblem * problem = addProblem(state, issue, path);
+		fillProblemEntry(problem, ent);
+		if (NULL != problem) {
+			problem->cluster = lastGood;
+			problem->chainLength = length;
+		}
+	}
+	free(path);
+}
+
+void * checkWorker(void * arg) {
+	FS_CheckState * state = arg;
+	while (1) {
+		pthread_mutex_lock(&(state->lock));
+		while ((NULL == state->queue) && (0 < state->pending))
+			pthread_cond_wait(&(state->cond), &(state->lock));
+		if (NULL == state->queue) {
+			pthread_mutex_unlock(&(state->lock));
+			break;
+		}
+		FS_CheckWork * work = state->queue;
+		state->queue = work->next;
+		pthread_mutex_unlock(&(state->lock));
+
+		FS_EntryList * el = getDirListingWithFAT(work->dir, state->FAT, state->fsi);
+		while (NULL != el) {
+			FS_Entry * ent = el->node;
+			if (('.' != ent->entry->DIR_Name[0]) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID))
+				checkEntry(state, work->path, ent);
+			FS_EntryList * toFree = el;
+			el = el->next;
+			freeFSEntryListItem(toFree);
+		}
+		free(work->path);
+		free(work);
+
+		pthread_mutex_lock(&(state->lock));
+		if (0 == --state->pending)
+			pthread_cond_broadcast(&(state->cond));
+		pthread_mutex_unlock(&(state->lock));
+	}
+	return NULL;
+}
+
+/*
+ * Reports every chain of in-use clusters that no entry owns. A chain is
+ * reported from its head, the one cluster nothing else links to; clusters
+ * left over after that form loops with no head at all, and each loop is then
+ * reported once from its lowest cluster.
+ */
+void findLostChains(FS_CheckState * state) {
+	FS_Instance * fsi = state->fsi;
+	uint64_t numEntries = fsi->countOfClusters + 2;
+	uint32_t * referenced = calloc((numEntries / 32) + 1, sizeof(uint32_t));
+	uint32_t * visited = calloc((numEntries / 32) + 1, sizeof(uint32_t));
+	if ((NULL == referenced) || (NULL == visited)) {
+		free(referenced);
+		free(visited);
+		return;
+	}
+	for (FS_Cluster i = 2; i < numEntries; i++) {
+		FS_FATEntry next = state->FAT[i];
+		if ((0 != next) && !isFATEntryBad(next, fsi) && !isClusterOwned(state, i)) {
+			state->report->lostClusters++;
+			if (isDataCluster(next, fsi))
+				referenced[next / 32] |= 1U << (next % 32);
+		}
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		for (FS_Cluster i = 2; i < numEntries; i++) {
+			FS_FATEntry next = state->FAT[i];
+			if ((0 == next) || isFATEntryBad(next, fsi) || isClusterOwned(state, i) || ((visited[i / 32] >> (i % 32)) & 1))
+				continue;
+			if ((0 == pass) && ((referenced[i / 32] >> (i % 32)) & 1))
+				continue;																		// not a head, unless the second pass finds it in a loop
+			FS_CheckProblem * problem = addProblem(state, CHK_LOSTCHAIN, NULL);
+			FS_Cluster cluster = i;
+			while (isDataCluster(cluster, fsi) && (0 != state->FAT[cluster]) && !isClusterOwned(state, cluster) && !((visited[cluster / 32] >> (cluster % 32)) & 1)) {
+				visited[cluster / 32] |= 1U << (cluster % 32);
+				if (NULL != problem)
+					problem->chainLength++;
+				cluster = state->FAT[cluster];
+			}
+			if (NULL != problem)
+				problem->cluster = i;
+		}
+	}
+	free(referenced);
+	free(visited);
+}
+
+void compareFATCopies(FS_CheckState * state, uint8_t * primary) {
+	FS_Instance * fsi = state->fsi;
+	uint64_t FATBytes = (uint64_t)fsi->FATsz * fsi->bootsect->BPB_BytsPerSec;
+	if (!fsi->mirrorFATs)
+		return;																					// the other copies are stale by design
+	uint8_t * copy = malloc(FATBytes);
+	if (NULL == copy)
+		return;
+	for (uint8_t i = 0; i < fsi->bootsect->BPB_NumFATs; i++) {
+		if (i == fsi->activeFAT)
+			continue;
+		readDisk(copy, FATBytes, getFATCopyOffset(i, fsi), fsi);
+		if (0 != memcmp(primary, copy, FATBytes)) {
+			FS_CheckProblem * problem = addProblem(state, CHK_FATMISMATCH, NULL);
+			if (NULL != problem)
+				problem->chainLength = i;
+		}
+	}
+	free(copy);
+}
+
+void freeChainFrom(FS_CheckState * state, FS_Cluster cluster) {
+	for (uint64_t i = 0; isDataCluster(cluster, state->fsi) && (0 != state->FAT[cluster]) && (i <= state->fsi->countOfClusters); i++) {
+		FS_Cluster next = state->FAT[cluster];
+		state->FAT[cluster] = 0;
+		state->owned[cluster / 32] &= ~(1U << (cluster % 32));
+		cluster = next;
+	}
+}
+
+void writeProblemEntry(FS_CheckProblem * problem, FS_Instance * fsi) {
+	FS_DirEntryInfo info;
+	FS_Entry ent;
+	info.entryOffset = problem->entryOffset;
+	ent.entry = &(problem->entry);
+	ent.info = &info;
+	ent.filename = NULL;
+	updateDirEntry(&ent, fsi);
+}
+
+uint8_t repairProblem(FS_CheckState * state, FS_CheckProblem * problem) {
+	FS_Instance * fsi = state->fsi;
+	uint64_t chainBytes = (uint64_t)problem->chainLength * state->bytesPerCluster;
+	switch (problem->issue) {
+		case CHK_CROSSLINKED:
+		case CHK_BADCHAIN:
+			if (0 == problem->chainLength) {
+				if (problem->isDirectory)
+					return 0;															// nowhere sensible to point it
+				setClusterForEntry(&(problem->entry), 0);
+				problem->entry.DIR_FileSize = 0;
+			} else {
+				state->FAT[problem->cluster] = getEOFMarker(fsi);
+				if (!problem->isDirectory && (problem->entry.DIR_FileSize > chainBytes))
+					problem->entry.DIR_FileSize = chainBytes;
+			}
+			writeProblemEntry(problem, fsi);
+			return 1;
+		case CHK_CHAINTOOSHORT:
+			problem->entry.DIR_FileSize = chainBytes;
+			writeProblemEntry(problem, fsi);
+			return 1;
+		case CHK_CHAINTOOLONG: {
+			uint32_t expected = (problem->entry.DIR_FileSize + (state->bytesPerCluster - 1)) / state->bytesPerCluster;
+			FS_Cluster cluster = getClusterForEntry(&(problem->entry));
+			if (0 == expected) {
+				setClusterForEntry(&(problem->entry), 0);
+				writeProblemEntry(problem, fsi);
+				freeChainFrom(state, cluster);
+			} else {
+				for (uint32_t i = 1; i < expected; i++)
+					cluster = state->FAT[cluster];
+				FS_Cluster surplus = state->FAT[cluster];
+				state->FAT[cluster] = getEOFMarker(fsi);
+				freeChainFrom(state, surplus);
+			}
+			return 1;
+		}
+		case CHK_LOSTCHAIN:
+			freeChainFrom(state, problem->cluster);
+			return 1;
+		case CHK_LFNCHECKSUM: {
+			if (problem->entryOffset != (problem->lfnOffset + (problem->lfnEntries * sizeof(fatLongName))))
+				return 0;																// run straddles clusters, leave it be
+			fatEntry onDisk = problem->entry;
+			if (0xE5 == onDisk.DIR_Name[0])
+				onDisk.DIR_Name[0] = 0x05;
+			fatLongName ln;
+			invalidateIndex(fsi);
+			dropDirCache(fsi);
+			dropNameIndex(fsi);																	// the repaired long name was indexed under its short name
+			for (uint8_t i = 0; i < problem->lfnEntries; i++) {
+				uint64_t offset = problem->lfnOffset + (i * sizeof(fatLongName));
+				readDisk(&ln, sizeof(fatLongName), offset, fsi);
+				ln.LDIR_Chksum = getLongNameChecksum(&onDisk);
+				writeDisk(&ln, sizeof(fatLongName), offset, fsi);
+			}
+			return 1;
+		}
+		case CHK_FATMISMATCH:
+			return 1;																	// every copy is rewritten from the primary
+		case CHK_FREECOUNT:
+			return 1;
+		case CHK_NONE:
+			break;
+	}
+	return 0;
+}
+
+uint32_t countFreeClusters(FS_FATEntry * FAT, FS_Instance * fsi) {
+	uint32_t freeClusters = 0;
+	for (FS_Cluster i = 2; i < (fsi->countOfClusters + 2); i++)
+		if (0 == FAT[i])
+			freeClusters++;
+	return freeClusters;
+}
+
+FS_CheckReport * check_volume(FS_Instance * fsi, uint8_t repair) {
+	FS_CheckReport * report = calloc(1, sizeof(FS_CheckReport));
+	if (NULL == report)
+		return NULL;
+	FS_CheckState state;
+	state.fsi = fsi;
+	state.report = report;
+	state.queue = NULL;
+	state.pending = 0;
+	state.bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+
+	uint64_t FATBytes = (uint64_t)fsi->FATsz * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * primary = malloc(FATBytes);
+	state.owned = calloc(((fsi->countOfClusters + 2) / 32) + 1, sizeof(uint32_t));
+	if ((NULL == primary) || (NULL == state.owned)) {
+		free(primary);
+		free(state.owned);
+		free(report);
+		return NULL;
+	}
+	syncFATMirrors(fsi);																		// pending mirror writes are not a mismatch
+	readDisk(primary, FATBytes, getFATStart(fsi), fsi);
+	state.FAT = decodeFATTable(primary, fsi);
+	if (NULL == state.FAT) {
+		free(primary);
+		free(state.owned);
+		free(report);
+		return NULL;
+	}
+	pthread_mutex_init(&(state.lock), NULL);
+	pthread_cond_init(&(state.cond), NULL);
+	compareFATCopies(&state, primary);
+	free(primary);
+
+	FS_Cluster root = fs_get_root(fsi);
+	uint32_t rootLength = 1;
+	FS_Cluster lastGood;
+	if (FS_FAT32 == fsi->type) {
+		fs_check_issue issue = walkChain(&state, root, &rootLength, &lastGood);
+		if (CHK_NONE != issue) {
+			FS_CheckProblem * problem = addProblem(&state, issue, "/");
+			if (NULL != problem) {
+				problem->isDirectory = 1;
+				problem->cluster = lastGood;
+				problem->chainLength = rootLength;
+			}
+		}
+	}
+	if (0 < rootLength) {
+		report->dirsChecked++;
+		queueDir(&state, root, "");
+		long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (numThreads < 1)
+			numThreads = 1;
+		if (numThreads > CHECK_MAX_THREADS)
+			numThreads = CHECK_MAX_THREADS;
+		pthread_t threads[CHECK_MAX_THREADS];
+		long started = 0;
+		for (long i = 0; i < numThreads; i++)
+			if (0 == pthread_create(&threads[i], NULL, checkWorker, &state))
+				started++;
+		if (0 == started)
+			checkWorker(&state);
+		for (long i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+	findLostChains(&state);
+
+	uint32_t freeCount = countFreeClusters(state.FAT, fsi);
+	if ((NULL != fsi->fsInfo) && (0xFFFFFFFF != fsi->fsInfo->FSI_Free_Count) && (freeCount != fsi->fsInfo->FSI_Free_Count)) {
+		FS_CheckProblem * problem = addProblem(&state, CHK_FREECOUNT, NULL);
+		if (NULL != problem)
+			problem->chainLength = fsi->fsInfo->FSI_Free_Count;
+	}
+
+	if (repair && (NULL != report->problems)) {
+		for (FS_CheckProblem * problem = report->problems; NULL != problem; problem = problem->next)
+			report->repaired += repairProblem(&state, problem);
+		writeFATTable(state.FAT, fsi);
+		freeCount = countFreeClusters(state.FAT, fsi);
+		if (NULL != fsi->fsInfo) {
+			fsi->fsInfo->FSI_Free_Count = freeCount;
+			writeDisk(fsi->fsInfo, sizeof(fat32FSInfo), (uint64_t)fsi->bootsect32->BPB_FSInfo * fsi->bootsect->BPB_BytsPerSec, fsi);
+		}
+	}
+	report->freeCount = freeCount;
+
+	pthread_mutex_destroy(&(state.lock));
+	pthread_cond_destroy(&(state.cond));
+	free(state.FAT);
+	free(state.owned);
+	return report;
+}
+
+void free_check_report(FS_CheckReport * report) {
+	if (NULL != report) {
+		while (NULL != report->problems) {
+			FS_CheckProblem * toFree = report->problems;
+			report->problems = toFree->next;
+			free(toFree->path);
+			free(toFree);
+		}
+		free(report);
+	}
+}
+
+void print_check(FS_Instance * fsi, uint8_t repair) {
+	FS_CheckReport * report = check_volume(fsi, repair);
+	if (NULL == report) {
+		fprintf(stderr, "Error: Failed to allocate sufficient scratchpad RAM\n");
+		return;
+	}
+	uint64_t numProblems = 0;
+	for (FS_CheckProblem * problem = report->problems; NULL != problem; problem = problem->next) {
+		numProblems++;
+		switch (problem->issue) {
+			case CHK_CROSSLINKED:
+				printf("%s: cross-linked with another chain after %u cluster(s)\n", problem->path, problem->chainLength);
+				break;
+			case CHK_BADCHAIN:
+				printf("%s: chain runs into a free, bad or out-of-range cluster after %u cluster(s)\n", problem->path, problem->chainLength);
+				break;
+			case CHK_CHAINTOOSHORT:
+				printf("%s: chain of %u cluster(s) is too short for %u bytes\n", problem->path, problem->chainLength, problem->entry.DIR_FileSize);
+				break;
+			case CHK_CHAINTOOLONG:
+				printf("%s: chain of %u cluster(s) is too long for %u bytes\n", problem->path, problem->chainLength, problem->entry.DIR_FileSize);
+				break;
+			case CHK_LFNCHECKSUM:
+				printf("%s: long name checksum does not match the short name\n", problem->path);
+				break;
+			case CHK_LOSTCHAIN:
+				printf("Lost chain of %u cluster(s) at cluster %u\n", problem->chainLength, problem->cluster);
+				break;
+			case CHK_FATMISMATCH:
+				printf("FAT copy %u differs from the primary FAT\n", problem->chainLength);
+				break;
+			case CHK_FREECOUNT:
+				printf("FSInfo free cluster count is %u, counted %u\n", problem->chainLength, report->freeCount);
+				break;
+			case CHK_NONE:
+				break;
+		}
+	}
+	printf("Checked %"PRIu64" director(ies) and %"PRIu64" file(s): ", report->dirsChecked, report->filesChecked);
+	if (0 == numProblems)
+		printf("no problems found\n");
+	else
+		printf("%"PRIu64" problem(s) found, %"PRIu64" repaired\n", numProblems, report->repaired);
+	if (0 < numProblems) {
+		const char * separator = "By kind:";
+		for (int i = 0; i < CHK_NONE; i++) {
+			if (0 < report->issueCounts[i]) {
+				printf("%s %"PRIu64" %s", separator, report->issueCounts[i], checkIssueNames[i]);
+				separator = ",";
+			}
+		}
+		printf("\n");
+	}
+	if (0 < report->lostClusters)
+		printf("%"PRIu64" cluster(s) in use by no file or directory\n", report->lostClusters);
+	free_check_report(report);
+}
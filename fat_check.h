@@ -0,0 +1,51 @@
+#ifndef FAT_CHECK_H
+#define FAT_CHECK_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define CHECK_MAX_THREADS 8
+
+typedef enum {
+	CHK_CROSSLINKED,
+	CHK_LOSTCHAIN,
+	CHK_CHAINTOOSHORT,
+	CHK_CHAINTOOLONG,
+	CHK_BADCHAIN,
+	CHK_FATMISMATCH,
+	CHK_LFNCHECKSUM,
+	CHK_FREECOUNT,
+	CHK_NONE																					// not an issue: what walkChain returns for a whole chain
+} fs_check_issue;
+
+struct FS_CheckProblem_struct {
+	fs_check_issue issue;
+	char * path;
+	fatEntry entry;
+	uint64_t entryOffset;
+	uint64_t lfnOffset;
+	uint8_t lfnEntries;
+	FS_Cluster cluster;
+	uint32_t chainLength;
+	uint8_t isDirectory;
+	struct FS_CheckProblem_struct * next;
+};
+
+struct FS_CheckReport_struct {
+	uint64_t dirsChecked;
+	uint64_t filesChecked;
+	uint64_t issueCounts[CHK_NONE];
+	uint64_t lostClusters;																		// in use by the FAT but reachable from no entry
+	uint32_t freeCount;
+	uint64_t repaired;
+	struct FS_CheckProblem_struct * problems;
+};
+
+typedef struct FS_CheckProblem_struct FS_CheckProblem;
+typedef struct FS_CheckReport_struct FS_CheckReport;
+
+FS_CheckReport * check_volume(FS_Instance * fsi, uint8_t repair);
+void free_check_report(FS_CheckReport * report);
+void print_check(FS_Instance * fsi, uint8_t repair);
+
+#endif
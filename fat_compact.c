@@ -0,0 +1,244 @@
+#include "fat_compact.h"
+#include "fat_helpers.h"
+#include "fat_index.h"
+#include "fat_names.h"
+
+struct FS_DirSlots_struct {
+	FS_Cluster * clusters;																		// the directory's chain, empty for the FAT12/16 root
+	uint32_t numClusters;
+	fatEntry * slots;
+	uint64_t numSlots;
+};
+
+typedef struct FS_DirSlots_struct FS_DirSlots;
+
+void freeDirSlots(FS_DirSlots * ds) {
+	free(ds->clusters);
+	free(ds->slots);
+	ds->clusters = NULL;
+	ds->slots = NULL;
+}
+
+/* Reads every slot of a directory, dead or alive, along with its chain */
+uint8_t readDirSlots(FS_Cluster dir, FS_DirSlots * ds, FS_Instance * fsi) {
+	memset(ds, 0, sizeof(FS_DirSlots));
+	uint16_t bps = fsi->bootsect->BPB_BytsPerSec;
+	if (isSpecialRootDir(dir, fsi)) {
+		ds->numSlots = (fsi->rootDirSectors * bps) / sizeof(fatEntry);
+		ds->slots = malloc(fsi->rootDirSectors * bps);
+		if (NULL == ds->slots)
+			return 0;
+		readDisk(ds->slots, fsi->rootDirSectors * bps, fsi->rootDirPos * bps, fsi);
+		return 1;
+	}
+	uint32_t allocClusters = 0;
+	for (FS_Cluster cluster = dir; isDataCluster(cluster, fsi) && (ds->numClusters <= fsi->countOfClusters); cluster = getFATEntryForCluster(cluster, fsi)) {
+		if (ds->numClusters == allocClusters) {
+			allocClusters = (0 == allocClusters) ? 16 : (allocClusters * 2);
+			FS_Cluster * grown = realloc(ds->clusters, allocClusters * sizeof(FS_Cluster));
+			if (NULL == grown) {
+				freeDirSlots(ds);
+				return 0;
+			}
+			ds->clusters = grown;
+		}
+		ds->clusters[ds->numClusters++] = cluster;
+	}
+	uint64_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * bps;
+	ds->numSlots = (ds->numClusters * bytesPerCluster) / sizeof(fatEntry);
+	ds->slots = malloc((0 < ds->numClusters) ? (ds->numClusters * bytesPerCluster) : 1);
+	if (NULL == ds->slots) {
+		freeDirSlots(ds);
+		return 0;
+	}
+	for (uint32_t i = 0; i < ds->numClusters; i++)
+		readDisk(((uint8_t *)ds->slots) + (i * bytesPerCluster), bytesPerCluster, getClusterOffset(ds->clusters[i], fsi), fsi);
+	return 1;
+}
+
+/*
+ * Copies the live entries of in to out in their original order. An end marker
+ * only ends its own block (cluster, or sector of the FAT12/16 root), the same
+ * way getDirListing reads it, so scanning resumes at the next block. A long
+ * name run is kept only when it is complete and the
+ * short entry right after it carries its checksum, so every run that survives
+ * still sits directly in front of its short entry; anything else is dropped as
+ * an orphan.
+ */
+uint64_t packDirSlots(fatEntry * in, uint64_t numIn, uint64_t slotsPerBlock, fatEntry * out, FS_CompactReport * report) {
+	uint64_t numOut = 0;
+	uint32_t runLength = 0;																		// long entries held at out[numOut] onwards
+	uint8_t expected = 0;																		// ordinal the next long entry must have
+	uint8_t checksum = 0;
+	for (uint64_t i = 0; i < numIn; i++) {
+		if (0x00 == in[i].DIR_Name[0]) {
+			report->orphansDropped += runLength;												// no run carries on past a block's end
+			runLength = 0;
+			expected = 0;
+			i = (((i / slotsPerBlock) + 1) * slotsPerBlock) - 1;
+			continue;
+		}
+		report->slotsBefore++;
+		if (0xE5 == in[i].DIR_Name[0]) {
+			report->orphansDropped += runLength;												// a run is only valid unbroken
+			runLength = 0;
+			expected = 0;
+			continue;
+		}
+		if (maskAndTest(in[i].DIR_Attr, ATTR_LONG_NAME)) {
+			fatLongName * ln = (fatLongName *)&(in[i]);
+			uint8_t ord = ln->LDIR_Ord & ~(LAST_LONG_ENTRY);
+			if (maskAndTest(ln->LDIR_Ord, LAST_LONG_ENTRY)) {
+				report->orphansDropped += runLength;
+				runLength = 0;
+				expected = ord;
+				checksum = ln->LDIR_Chksum;
+			}
+			if ((0 == ord) || (ord != expected) || (ln->LDIR_Chksum != checksum)) {
+				report->orphansDropped += runLength + 1;
+				runLength = 0;
+				expected = 0;
+				continue;
+			}
+			out[numOut + runLength++] = in[i];
+			expected--;
+			continue;
+		}
+		if (0 < runLength) {
+			if ((0 == expected) && (checksum == getLongNameChecksum(&(in[i]))))
+				numOut += runLength;
+			else
+				report->orphansDropped += runLength;
+		}
+		runLength = 0;
+		expected = 0;
+		out[numOut++] = in[i];
+	}
+	report->orphansDropped += runLength;
+	return numOut;
+}
+
+/*
+ * Packs one directory and frees the clusters at the end of its chain that no
+ * longer hold anything. Its first cluster never moves, so '..' entries below it
+ * stay valid; entries inside it do move, so no file in it may be open.
+ * Only clusters whose contents changed are written back.
+ */
+uint8_t compactDir(FS_Cluster dir, FS_DirSlots * ds, FS_CompactReport * report, FS_Instance * fsi) {
+	if (!readDirSlots(dir, ds, fsi))
+		return 0;
+	fatEntry * packed = calloc((0 < ds->numSlots) ? ds->numSlots : 1, sizeof(fatEntry));		// zeros past the last entry are the end marker
+	if (NULL == packed) {
+		freeDirSlots(ds);
+		return 0;
+	}
+	uint64_t slotsPerBlock = (isSpecialRootDir(dir, fsi) ? 1 : fsi->bootsect->BPB_SecPerClus) * fsi->bootsect->BPB_BytsPerSec / sizeof(fatEntry);
+	uint64_t numPacked = packDirSlots(ds->slots, ds->numSlots, slotsPerBlock, packed, report);
+	report->slotsAfter += numPacked;
+	report->dirsCompacted++;
+	uint8_t changed = (0 != memcmp(packed, ds->slots, ds->numSlots * sizeof(fatEntry)));
+	if (changed) {
+		invalidateIndex(fsi);
+		dropDirCache(fsi);
+		dropNameIndex(fsi);																		// entries moved, so their offsets no longer identify them
+	}
+	if (isSpecialRootDir(dir, fsi)) {
+		if (changed)
+			writeDisk(packed, ds->numSlots * sizeof(fatEntry), fsi->rootDirPos * fsi->bootsect->BPB_BytsPerSec, fsi);
+	} else if (0 < ds->numClusters) {
+		uint64_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+		uint64_t slotsPerCluster = bytesPerCluster / sizeof(fatEntry);
+		uint32_t keep = (numPacked + (slotsPerCluster - 1)) / slotsPerCluster;
+		if (0 == keep)
+			keep = 1;
+		for (uint32_t i = 0; i < keep; i++)
+			if (0 != memcmp(packed + (i * slotsPerCluster), ds->slots + (i * slotsPerCluster), bytesPerCluster))
+				writeDisk(packed + (i * slotsPerCluster), bytesPerCluster, getClusterOffset(ds->clusters[i], fsi), fsi);
+		if (keep < ds->numClusters) {
+			setFATEntryForCluster(ds->clusters[keep - 1], getEOFMarker(fsi), fsi);
+			freeChain(ds->clusters[keep], fsi);
+			report->clustersFreed += ds->numClusters - keep;
+		}
+	}
+	memcpy(ds->slots, packed, ds->numSlots * sizeof(fatEntry));									// the caller looks for subdirectories in what was kept
+	ds->numSlots = numPacked;
+	free(packed);
+	return 1;
+}
+
+/*
+ * Compacts every directory reachable from the root, breadth first. A bitmap
+ * of directories already queued keeps a damaged tree with a loop in it from
+ * being walked forever.
+ */
+fs_result compactVolume(FS_CompactReport * report, FS_Instance * fsi) {
+	uint32_t * queued = calloc(((fsi->countOfClusters + 2) / 32) + 1, sizeof(uint32_t));
+	FS_Cluster * queue = malloc(16 * sizeof(FS_Cluster));
+	uint64_t head = 0, tail = 0, allocQueue = 16;
+	if ((NULL == queued) || (NULL == queue)) {
+		free(queued);
+		free(queue);
+		return ERR_MALLOCFAILED;
+	}
+	fs_result result = ERR_SUCCESS;
+	queue[tail++] = fs_get_root(fsi);
+	if (isDataCluster(queue[0], fsi))
+		queued[queue[0] / 32] |= 1U << (queue[0] % 32);
+	while ((head < tail) && (ERR_SUCCESS == result)) {
+		FS_DirSlots ds;
+		if (!compactDir(queue[head++], &ds, report, fsi)) {
+			result = ERR_MALLOCFAILED;
+			break;
+		}
+		for (uint64_t i = 0; i < ds.numSlots; i++) {
+			fatEntry * ent = &(ds.slots[i]);
+			if (maskAndTest(ent->DIR_Attr, ATTR_LONG_NAME) || !maskAndTest(ent->DIR_Attr, ATTR_DIRECTORY) || ('.' == ent->DIR_Name[0]))
+				continue;
+			FS_Cluster sub = getClusterForEntry(ent);
+			if (!isDataCluster(sub, fsi) || (queued[sub / 32] & (1U << (sub % 32))))
+				continue;
+			queued[sub / 32] |= 1U << (sub % 32);
+			if (tail == allocQueue) {
+				FS_Cluster * grown = realloc(queue, allocQueue * 2 * sizeof(FS_Cluster));
+				if (NULL == grown) {
+					result = ERR_MALLOCFAILED;
+					break;
+				}
+				queue = grown;
+				allocQueue *= 2;
+			}
+			queue[tail++] = sub;
+		}
+		freeDirSlots(&ds);
+	}
+	free(queued);
+	free(queue);
+	return result;
+}
+
+/* Compacts the directory at path, or every directory on the volume when path is NULL */
+fs_result compact_dirs(FS_Instance * fsi, FS_Directory currDir, char * path, FS_CompactReport * report) {
+	memset(report, 0, sizeof(FS_CompactReport));
+	if (NULL == path)
+		return compactVolume(report, fsi);
+	FS_Directory dir = findDir(fsi, currDir, path);
+	if (0x00000001 == dir)
+		return ERR_FILENOTFOUND;
+	FS_DirSlots ds;
+	if (!compactDir(dir, &ds, report, fsi))
+		return ERR_MALLOCFAILED;
+	freeDirSlots(&ds);
+	return ERR_SUCCESS;
+}
+
+fs_result print_compact(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	FS_CompactReport report;
+	fs_result result = compact_dirs(fsi, currDir, path, &report);
+	if (ERR_SUCCESS != result)
+		return result;
+	printf("Compacted %"PRIu64" director(ies): %"PRIu64" of %"PRIu64" slot(s) still in use, %"PRIu64" cluster(s) freed\n",
+		report.dirsCompacted, report.slotsAfter, report.slotsBefore, report.clustersFreed);
+	if (0 < report.orphansDropped)
+		printf("Dropped %"PRIu64" orphaned long name entr(ies)\n", report.orphansDropped);
+	return ERR_SUCCESS;
+}
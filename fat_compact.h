@@ -0,0 +1,20 @@
+#ifndef FAT_COMPACT_H
+#define FAT_COMPACT_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+struct FS_CompactReport_struct {
+	uint64_t dirsCompacted;
+	uint64_t slotsBefore;																		// entries in use or deleted, end markers aside
+	uint64_t slotsAfter;
+	uint64_t orphansDropped;																	// long name entries with no short entry to go with
+	uint64_t clustersFreed;
+};
+
+typedef struct FS_CompactReport_struct FS_CompactReport;
+
+fs_result compact_dirs(FS_Instance * fsi, FS_Directory currDir, char * path, FS_CompactReport * report);
+fs_result print_compact(FS_Instance * fsi, FS_Directory currDir, char * path);
+
+#endif
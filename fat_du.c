@@ -0,0 +1,349 @@
+#include <pthread.h>
+#include "fat_du.h"
+#include "fat_helpers.h"
+
+struct FS_DuDeque_struct {
+	FS_DuDir ** items;
+	uint32_t head;																				// others steal from here, oldest first
+	uint32_t tail;																				// the owner pushes and pops here
+	uint32_t alloc;
+	pthread_mutex_t lock;
+};
+
+struct FS_DuState_struct {
+	FS_Instance * fsi;
+	FS_FATEntry * FAT;
+	uint32_t * queued;
+	FS_DuReport * report;
+	uint64_t allocDirs;
+	struct FS_DuDeque_struct deques[DU_MAX_THREADS];
+	uint32_t numWorkers;
+	uint64_t pending;																			// directories found but not yet listed
+	uint32_t idle;
+	uint8_t failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct FS_DuWorker_struct {
+	struct FS_DuState_struct * state;
+	uint32_t self;
+};
+
+typedef struct FS_DuDeque_struct FS_DuDeque;
+typedef struct FS_DuState_struct FS_DuState;
+typedef struct FS_DuWorker_struct FS_DuWorker;
+
+uint8_t pushDir(FS_DuDeque * dq, FS_DuDir * dir) {
+	pthread_mutex_lock(&(dq->lock));
+	if ((dq->tail == dq->alloc) && (0 < dq->head)) {
+		memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(FS_DuDir *));
+		dq->tail -= dq->head;
+		dq->head = 0;
+	}
+	if (dq->tail == dq->alloc) {
+		uint32_t newAlloc = (0 == dq->alloc) ? 64 : (dq->alloc * 2);
+		FS_DuDir ** items = realloc(dq->items, newAlloc * sizeof(FS_DuDir *));
+		if (NULL == items) {
+			pthread_mutex_unlock(&(dq->lock));
+			return 0;
+		}
+		dq->items = items;
+		dq->alloc = newAlloc;
+	}
+	dq->items[dq->tail++] = dir;
+	pthread_mutex_unlock(&(dq->lock));
+	return 1;
+}
+
+FS_DuDir * popDir(FS_DuDeque * dq, uint8_t steal) {
+	FS_DuDir * dir = NULL;
+	pthread_mutex_lock(&(dq->lock));
+	if (dq->head < dq->tail)
+		dir = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+	pthread_mutex_unlock(&(dq->lock));
+	return dir;
+}
+
+FS_DuDir * stealDir(FS_DuState * state, uint32_t self) {
+	for (uint32_t i = 1; i <= state->numWorkers; i++) {
+		FS_DuDir * dir = popDir(&(state->deques[(self + i) % state->numWorkers]), 1);
+		if (NULL != dir)
+			return dir;
+	}
+	return NULL;
+}
+
+/*
+ * Records a directory in the report and hands it to the given worker. Returns
+ * 0 without queueing anything if the directory was already reached another
+ * way, which only a damaged tree allows.
+ */
+uint8_t addDuDir(FS_DuState * state, uint32_t self, FS_DuDir * parent, char * path, FS_Cluster cluster) {
+	if (isDataCluster(cluster, state->fsi)) {
+		uint32_t mask = 1U << (cluster % 32);
+		if (__sync_fetch_and_or(&(state->queued[cluster / 32]), mask) & mask)
+			return 0;
+	}
+	FS_DuDir * dir = calloc(1, sizeof(FS_DuDir));
+	if ((NULL == dir) || (NULL == (dir->path = strdup(path)))) {
+		state->failed = 1;
+		free(dir);
+		return 0;
+	}
+	dir->cluster = cluster;
+	dir->parent = parent;
+	uint32_t length, extents;
+	getChainStats(cluster, state->FAT, &length, &extents, state->fsi);
+	dir->clusters = length;
+	pthread_mutex_lock(&(state->lock));
+	FS_DuReport * report = state->report;
+	if (report->numDirs == state->allocDirs) {
+		uint64_t newAlloc = (0 == state->allocDirs) ? 64 : (state->allocDirs * 2);
+		FS_DuDir ** dirs = realloc(report->dirs, newAlloc * sizeof(FS_DuDir *));
+		if (NULL == dirs) {
+			state->failed = 1;
+			pthread_mutex_unlock(&(state->lock));
+			free(dir->path);
+			free(dir);
+			return 0;
+		}
+		report->dirs = dirs;
+		state->allocDirs = newAlloc;
+	}
+	report->dirs[report->numDirs++] = dir;
+	pthread_mutex_unlock(&(state->lock));
+
+	__sync_fetch_and_add(&(state->pending), 1);
+	if (!pushDir(&(state->deques[self]), dir)) {
+		state->failed = 1;
+		__sync_fetch_and_sub(&(state->pending), 1);
+		return 0;
+	}
+	if (0 < __sync_fetch_and_add(&(state->idle), 0)) {
+		pthread_mutex_lock(&(state->lock));
+		pthread_cond_broadcast(&(state->cond));
+		pthread_mutex_unlock(&(state->lock));
+	}
+	return 1;
+}
+
+/*
+ * Sums the files directly in one directory and queues its subdirectories on
+ * the calling worker's own deque, where that worker picks them up again unless
+ * an idle one steals them first.
+ */
+void listDuDir(FS_DuState * state, uint32_t self, FS_DuDir * dir) {
+	FS_EntryList * el = getDirListingWithFAT(dir->cluster, state->FAT, state->fsi);
+	while (NULL != el) {
+		FS_Entry * ent = el->node;
+		if (('.' != ent->entry->DIR_Name[0]) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
+			if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY)) {
+				char * filename = getFilenameForEntry(ent->entry);
+				char * path = joinPath(dir->path, (NULL != filename) ? filename : "?");
+				free(filename);
+				if (NULL != path)
+					addDuDir(state, self, dir, path, getClusterForEntry(ent->entry));
+				else
+					state->failed = 1;
+				free(path);
+			} else {
+				uint32_t length, extents;
+				getChainStats(getClusterForEntry(ent->entry), state->FAT, &length, &extents, state->fsi);
+				dir->files++;
+				dir->bytes += ent->entry->DIR_FileSize;
+				dir->clusters += length;
+			}
+		}
+		FS_EntryList * toFree = el;
+		el = el->next;
+		freeFSEntryListItem(toFree);
+	}
+}
+
+/*
+ * Own work first, newest first, so a worker stays deep in the part of the tree
+ * it is already in; then the oldest directory of another worker, which tends
+ * to be the one with the most left below it. A worker only sleeps after one
+ * last look at every deque made while it holds the lock that wakes it.
+ */
+FS_DuDir * takeDir(FS_DuState * state, uint32_t self) {
+	while (1) {
+		FS_DuDir * dir = popDir(&(state->deques[self]), 0);
+		if (NULL == dir)
+			dir = stealDir(state, self);
+		if (NULL != dir)
+			return dir;
+		pthread_mutex_lock(&(state->lock));
+		__sync_fetch_and_add(&(state->idle), 1);
+		dir = stealDir(state, self);
+		if ((NULL == dir) && (0 < __sync_fetch_and_add(&(state->pending), 0)))
+			pthread_cond_wait(&(state->cond), &(state->lock));
+		__sync_fetch_and_sub(&(state->idle), 1);
+		uint8_t finished = (NULL == dir) && (0 == __sync_fetch_and_add(&(state->pending), 0));
+		pthread_mutex_unlock(&(state->lock));
+		if ((NULL != dir) || finished)
+			return dir;
+	}
+}
+
+void * duWorker(void * arg) {
+	FS_DuWorker * worker = arg;
+	FS_DuState * state = worker->state;
+	FS_DuDir * dir;
+	while (NULL != (dir = takeDir(state, worker->self))) {
+		listDuDir(state, worker->self, dir);
+		if (0 == __sync_sub_and_fetch(&(state->pending), 1)) {
+			pthread_mutex_lock(&(state->lock));
+			pthread_cond_broadcast(&(state->cond));
+			pthread_mutex_unlock(&(state->lock));
+		}
+	}
+	return NULL;
+}
+
+void runDuWorkers(FS_DuState * state) {
+	FS_DuWorker workers[DU_MAX_THREADS];
+	pthread_t threads[DU_MAX_THREADS];
+	uint32_t numStarted = 0;
+	for (uint32_t i = 0; i < state->numWorkers; i++) {
+		workers[i].state = state;
+		workers[i].self = i;
+		if (0 == pthread_create(&threads[numStarted], NULL, duWorker, &workers[i]))
+			numStarted++;
+	}
+	if (0 == numStarted)
+		duWorker(&workers[0]);
+	for (uint32_t i = 0; i < numStarted; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Walks the tree below path (the current directory when NULL) with a pool of
+ * threads and returns the totals of every directory in it, the top of the walk
+ * first. Sizes come from the directory entries and cluster counts from a
+ * single copy of the FAT read up front, so the only other reads are of the
+ * directories themselves.
+ */
+fs_result du_tree(FS_Instance * fsi, FS_Directory currDir, char * path, FS_DuReport ** report) {
+	*report = NULL;
+	FS_Directory top = currDir;
+	if (NULL != path) {
+		top = findDir(fsi, currDir, path);
+		if (0x00000001 == top)
+			return ERR_FILENOTFOUND;
+	}
+	FS_DuState state;
+	memset(&state, 0, sizeof(FS_DuState));
+	state.fsi = fsi;
+	state.report = calloc(1, sizeof(FS_DuReport));
+	state.queued = calloc(((fsi->countOfClusters + 2) / 32) + 1, sizeof(uint32_t));
+	state.FAT = loadFATTable(fsi);
+	if ((NULL == state.report) || (NULL == state.queued) || (NULL == state.FAT)) {
+		free(state.report);
+		free(state.queued);
+		free(state.FAT);
+		return ERR_MALLOCFAILED;
+	}
+	state.report->bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads < 1)
+		numThreads = 1;
+	if (numThreads > DU_MAX_THREADS)
+		numThreads = DU_MAX_THREADS;
+	state.numWorkers = numThreads;
+	pthread_mutex_init(&(state.lock), NULL);
+	pthread_cond_init(&(state.cond), NULL);
+	for (uint32_t i = 0; i < state.numWorkers; i++)
+		pthread_mutex_init(&(state.deques[i].lock), NULL);
+
+	if (addDuDir(&state, 0, NULL, (NULL != path) ? path : ".", top))
+		runDuWorkers(&state);
+
+	for (uint32_t i = 0; i < state.numWorkers; i++) {
+		pthread_mutex_destroy(&(state.deques[i].lock));
+		free(state.deques[i].items);
+	}
+	pthread_mutex_destroy(&(state.lock));
+	pthread_cond_destroy(&(state.cond));
+	free(state.queued);
+	free(state.FAT);
+	if (state.failed || (0 == state.report->numDirs)) {
+		free_du_report(state.report);
+		return ERR_MALLOCFAILED;
+	}
+	for (uint64_t i = state.report->numDirs - 1; 0 < i; i--) {									// children were found after their parents, so fold from the back
+		FS_DuDir * dir = state.report->dirs[i];
+		dir->parent->files += dir->files;
+		dir->parent->dirs += dir->dirs + 1;
+		dir->parent->bytes += dir->bytes;
+		dir->parent->clusters += dir->clusters;
+	}
+	*report = state.report;
+	return ERR_SUCCESS;
+}
+
+void free_du_report(FS_DuReport * report) {
+	if (NULL != report) {
+		for (uint64_t i = 0; i < report->numDirs; i++) {
+			free(report->dirs[i]->path);
+			free(report->dirs[i]);
+		}
+		free(report->dirs);
+		free(report);
+	}
+}
+
+uint8_t parse_du_options(char * args, char ** path, uint32_t * top) {
+	*path = NULL;
+	*top = DU_DEFAULT_TOP;
+	char * toke = (NULL != args) ? strtok(args, " ") : NULL;
+	while (NULL != toke) {
+		if (strcmp(toke, DU_ARG_TOP) == 0) {
+			char * value = strtok(NULL, " ");
+			char * end = NULL;
+			long count = (NULL != value) ? strtol(value, &end, 10) : -1;
+			if ((count < 0) || (end == value) || ('\0' != *end))
+				return 0;
+			*top = count;
+		} else if ((('-' == toke[0]) && ('-' == toke[1])) || (NULL != *path)) {
+			return 0;
+		} else {
+			*path = toke;
+		}
+		toke = strtok(NULL, " ");
+	}
+	return 1;
+}
+
+int compareDuDirs(const void * a, const void * b) {
+	const FS_DuDir * da = *(FS_DuDir * const *)a;
+	const FS_DuDir * db = *(FS_DuDir * const *)b;
+	if (da->clusters != db->clusters)
+		return (da->clusters < db->clusters) ? 1 : -1;
+	if (da->bytes != db->bytes)
+		return (da->bytes < db->bytes) ? 1 : -1;
+	return strcmp(da->path, db->path);
+}
+
+fs_result print_du(FS_Instance * fsi, FS_Directory currDir, char * path, uint32_t top) {
+	FS_DuReport * report;
+	fs_result result = du_tree(fsi, currDir, path, &report);
+	if (ERR_SUCCESS != result)
+		return result;
+	FS_DuDir * total = report->dirs[0];
+	qsort(report->dirs, report->numDirs, sizeof(FS_DuDir *), compareDuDirs);
+	printf("\n");
+	if (0 < top) {
+		printf("%10s%16s%10s%8s  %s\n", "Clusters", "Bytes", "Files", "Dirs", "Path");
+		for (uint64_t i = 0; (i < report->numDirs) && (i < top); i++) {
+			FS_DuDir * dir = report->dirs[i];
+			printf("%10"PRIu64"%16"PRIu64"%10"PRIu64"%8"PRIu64"  %s/\n", dir->clusters, dir->bytes, dir->files, dir->dirs, dir->path);
+		}
+		printf("\n");
+	}
+	printf("%"PRIu64" file(s) in %"PRIu64" director(ies): %"PRIu64" bytes, %"PRIu64" cluster(s) (%"PRIu64" bytes) allocated\n",
+		total->files, total->dirs + 1, total->bytes, total->clusters, total->clusters * report->bytesPerCluster);
+	free_du_report(report);
+	return ERR_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef FAT_DU_H
+#define FAT_DU_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define DU_MAX_THREADS 8
+#define DU_DEFAULT_TOP 10
+#define DU_ARG_TOP "--top"
+
+struct FS_DuDir_struct {
+	char * path;
+	FS_Cluster cluster;
+	uint64_t files;																				// totals for the whole subtree below, once the walk is done
+	uint64_t dirs;
+	uint64_t bytes;																				// as recorded in the entries
+	uint64_t clusters;																			// allocated, the directories' own chains included
+	struct FS_DuDir_struct * parent;
+};
+
+struct FS_DuReport_struct {
+	struct FS_DuDir_struct ** dirs;																// in the order found, so every parent comes before its children
+	uint64_t numDirs;
+	uint32_t bytesPerCluster;
+};
+
+typedef struct FS_DuDir_struct FS_DuDir;
+typedef struct FS_DuReport_struct FS_DuReport;
+
+fs_result du_tree(FS_Instance * fsi, FS_Directory currDir, char * path, FS_DuReport ** report);
+void free_du_report(FS_DuReport * report);
+uint8_t parse_du_options(char * args, char ** path, uint32_t * top);
+fs_result print_du(FS_Instance * fsi, FS_Directory currDir, char * path, uint32_t top);
+
+#endif
@@ -1,15 +1,36 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "fat_fs.h"
 #include "fat_helpers.h"
+#include "fat_index.h"
+#include "fat_names.h"
+#include "fat_overlay.h"
+#include "fat_ops.h"
+#include "fat_trace.h"
 
 const char * typeNames[] = {"FAT12", "FAT16", "FAT32"};
 
-FS_Instance * fs_create_instance(char * imagePath) {
-	FS_Instance * fsi = malloc(sizeof(FS_Instance));
+FS_Instance * fs_create_instance(char * imagePath, char * overlayPath) {
+	FS_Instance * fsi = calloc(1, sizeof(FS_Instance));
 	if (NULL == fsi) {
 		return NULL;
 	}
-	fsi->disk = fopen(imagePath, "rb+");
-	if (NULL == fsi->disk) {
+	fsi->disk = -1;
+	fsi->readAheadClusters = READAHEAD_CLUSTERS;
+	fsi->imagePath = strdup((NULL != overlayPath) ? overlayPath : imagePath);				// an overlay keeps its own index sidecar
+	if (NULL == fsi->imagePath) {
+		fs_cleanup(fsi);
+		return NULL;
+	}
+	fsi->disk = open(imagePath, (NULL != overlayPath) ? O_RDONLY : O_RDWR);
+	if (0 > fsi->disk) {
+		fs_cleanup(fsi);
+		return NULL;
+	}
+	if ((NULL != overlayPath) && !openOverlay(fsi, overlayPath)) {
 		fs_cleanup(fsi);
 		return NULL;
 	}
@@ -18,7 +39,7 @@ FS_Instance * fs_create_instance(char * imagePath) {
 		fs_cleanup(fsi);
 		return NULL;
 	}
-	fread(fsi->bootsect, sizeof(fatBS), 1, fsi->disk);
+	readDisk(fsi->bootsect, sizeof(fatBS), 0, fsi);
 	if (0 == fsi->bootsect->BPB_RootEntCnt) {
 		fsi->bootsect16 = NULL;
 		fsi->bootsect32 = malloc(sizeof(fatBS32));
@@ -27,15 +48,14 @@ FS_Instance * fs_create_instance(char * imagePath) {
 			return NULL;
 		}
 		fsi->type = FS_FAT32;
-		fread(fsi->bootsect32, sizeof(fatBS32), 1, fsi->disk);
+		readDisk(fsi->bootsect32, sizeof(fatBS32), sizeof(fatBS), fsi);
 		fsi->FATsz = fsi->bootsect32->BPB_FATSz32;
 		fsi->fsInfo = malloc(sizeof(fat32FSInfo));
 		if (NULL == fsi->fsInfo) {
 			fs_cleanup(fsi);
 			return NULL;
 		}
-		fseek(fsi->disk, (fsi->bootsect32->BPB_FSInfo * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-		fread(fsi->fsInfo, sizeof(fat32FSInfo), 1, fsi->disk);
+		readDisk(fsi->fsInfo, sizeof(fat32FSInfo), (uint64_t)fsi->bootsect32->BPB_FSInfo * fsi->bootsect->BPB_BytsPerSec, fsi);
 	} else {
 		fsi->bootsect32 = NULL;
 		fsi->bootsect16 = malloc(sizeof(fatBS16));
@@ -44,7 +64,7 @@ FS_Instance * fs_create_instance(char * imagePath) {
 			return NULL;
 		}
 		fsi->type = FS_FAT16;
-		fread(fsi->bootsect16, sizeof(fatBS16), 1, fsi->disk);
+		readDisk(fsi->bootsect16, sizeof(fatBS16), sizeof(fatBS), fsi);
 		fsi->fsInfo = NULL;
 	}
 	if (0 != fsi->bootsect->BPB_FATSz16)
@@ -53,7 +73,7 @@ FS_Instance * fs_create_instance(char * imagePath) {
 	fsi->numSectors = fsi->bootsect->BPB_TotSec32;
 	if (fsi->numSectors == 0)
 		fsi->numSectors = fsi->bootsect->BPB_TotSec16;
-	fsi->totalSize = fsi->numSectors * fsi->bootsect->BPB_BytsPerSec;
+	fsi->totalSize = (uint64_t)fsi->numSectors * fsi->bootsect->BPB_BytsPerSec;
 
 	fsi->rootDirSectors = ((fsi->bootsect->BPB_RootEntCnt * 32) + (fsi->bootsect->BPB_BytsPerSec - 1)) / fsi->bootsect->BPB_BytsPerSec;
 	fsi->dataSec = (fsi->bootsect->BPB_RsvdSecCnt + (fsi->bootsect->BPB_NumFATs * fsi->FATsz) + fsi->rootDirSectors);
@@ -67,10 +87,40 @@ FS_Instance * fs_create_instance(char * imagePath) {
 	} else {
 		fsi->type = FS_FAT32;
 	}
+	fsi->ops = getFATOps(fsi->type);
+	fsi->mirrorFATs = (1 < fsi->bootsect->BPB_NumFATs);
+	if ((FS_FAT32 == fsi->type) && (NULL != fsi->bootsect32) && (0 != (fsi->bootsect32->BPB_ExtFlags & EXTFLAGS_NO_MIRROR))) {
+		fsi->mirrorFATs = 0;
+		if ((fsi->bootsect32->BPB_ExtFlags & EXTFLAGS_ACTIVE_FAT) < fsi->bootsect->BPB_NumFATs)
+			fsi->activeFAT = fsi->bootsect32->BPB_ExtFlags & EXTFLAGS_ACTIVE_FAT;
+	}
 
+	loadIndex(fsi);
 	return fsi;
 }
 
+void fs_enable_index(FS_Instance * fsi, uint8_t enable) {
+	fsi->useIndex = enable;
+}
+
+void fs_set_readahead(FS_Instance * fsi, uint32_t clusters) {
+	fsi->readAheadClusters = clusters;
+}
+
+void fs_set_punch_holes(FS_Instance * fsi, uint8_t enable) {
+	fsi->punchHoles = enable;
+}
+
+void fs_set_alloc_policy(FS_Instance * fsi, fs_alloc_policy policy) {
+	fsi->allocPolicy = policy;
+	fsi->allocCursor = 2;
+}
+
+void fs_flush(FS_Instance * fsi) {
+	syncFATMirrors(fsi);
+	syncFSInfo(fsi);
+}
+
 FS_Directory fs_get_root(FS_Instance * fsi) {
 	switch (fsi->type) {
 		case FS_FAT12:
@@ -143,114 +193,223 @@ void print_info(FS_Instance * fsi) {
 	if (NULL != fsi->fsInfo) {
 		if ((fsi->fsInfo->FSI_LeadSig == 0x41615252) && (fsi->fsInfo->FSI_StrucSig == 0x61417272) && (fsi->fsInfo->FSI_TrailSig == 0xAA550000))
 			printf("FAT32 FSInfo signature check passed\n");
-		printf("FAT32 - Free Cluster Count: %u", fsi->fsInfo->FSI_Free_Count);
-		printf("FAT32 - Next Free Cluster: 0x%08X", fsi->fsInfo->FSI_Nxt_Free);
+		printf("FAT32 - Free Cluster Count: %u\n", fsi->fsInfo->FSI_Free_Count);
+		printf("FAT32 - Next Free Cluster: 0x%08X\n", fsi->fsInfo->FSI_Nxt_Free);
 	}
-	uint32_t freeClusters = 0;
-	for (int i = 0; i < fsi->countOfClusters; i++) {
-		if (getFATEntryForCluster(i+2, fsi) == 0) {
-			freeClusters++;
+	uint64_t freeClusters = 0;
+	FS_FATEntry * FAT = loadFATTable(fsi);
+	if (NULL != FAT) {
+		for (FS_Cluster i = 2; i < (fsi->countOfClusters + 2); i++) {
+			if (0 == FAT[i])
+				freeClusters++;
 		}
+		free(FAT);
 	}
-	printf("Free space: %d bytes\n", freeClusters * fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec);
+	printf("Free space: %"PRIu64" bytes\n", freeClusters * fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec);
 	printf("\n");
 }
 
-char * getFilenameForEntry(fatEntry * ent) {
-	char * filename = malloc(sizeof(char) * (DIR_Name_LENGTH + 2));
-	if (NULL != filename) {
-		int i = 0, j = 0;
-		while (j < DIR_Name_LENGTH) {
-			if (0x20 <= ent->DIR_Name[j]) {
-				uint8_t isPadding = 1;
-				for (int k = j; k < ((j < 8) ? 8 : 11); k++) {
-					if (' ' != ent->DIR_Name[k]) {
-						isPadding = 0;
-						break;
-					}
-				}
-				if (!isPadding)
-					filename[i++] = ent->DIR_Name[j];
-			}
-			if ((7 == j) && (' ' != ent->DIR_Name[8]))
-				filename[i++] = '.';
-			j++;
+struct FS_DirLine_struct {
+	FS_Entry * ent;
+	char * name;
+	uint64_t key;
+};
+
+int compareDirLines(const void * a, const void * b) {
+	const struct FS_DirLine_struct * x = a, * y = b;
+	if (x->key != y->key)
+		return (x->key > y->key) ? 1 : -1;
+	if ((NULL == x->name) || (NULL == y->name))
+		return 0;
+	return strcasecmp(x->name, y->name);
+}
+
+uint64_t getEntryDateKey(fatEntry * entry) {
+	return ((uint64_t)entry->DIR_WrtDate.year << 25) | ((uint64_t)entry->DIR_WrtDate.month << 21) | ((uint64_t)entry->DIR_WrtDate.day << 16) |
+		((uint64_t)entry->DIR_WrtTime.hour << 11) | ((uint64_t)entry->DIR_WrtTime.min << 5) | entry->DIR_WrtTime.sec;
+}
+
+size_t formatDirLine(char * out, FS_Entry * ent, uint8_t machineReadable) {
+	fatEntry * entry = ent->entry;
+	char shortName[DIR_Name_LENGTH + 2];
+	formatShortName(entry, shortName);
+	char flags[7];
+	flags[0] = maskAndTest(entry->DIR_Attr, ATTR_VOLUME_ID) ? 'V' : '-';
+	flags[1] = maskAndTest(entry->DIR_Attr, ATTR_DIRECTORY) ? 'D' : '-';
+	flags[2] = maskAndTest(entry->DIR_Attr, ATTR_ARCHIVE)   ? 'A' : '-';
+	flags[3] = maskAndTest(entry->DIR_Attr, ATTR_SYSTEM)    ? 'S' : '-';
+	flags[4] = maskAndTest(entry->DIR_Attr, ATTR_HIDDEN)    ? 'H' : '-';
+	flags[5] = maskAndTest(entry->DIR_Attr, ATTR_READ_ONLY) ? 'R' : '-';
+	flags[6] = '\0';
+	fatDate * cDate = &(entry->DIR_WrtDate);
+	fatTime * cTime = &(entry->DIR_WrtTime);
+	int seconds = (cTime->sec * 2) + (entry->DIR_CrtTimeTenth / 100);
+	size_t used;
+	if (machineReadable) {
+		used = sprintf(out, "%s\t%u\t%s\t%04d-%02d-%02dT%02d:%02d:%02d\t", shortName, entry->DIR_FileSize, flags,
+			cDate->year + 1980, cDate->month, cDate->day, cTime->hour, cTime->min, seconds);
+	} else {
+		used = sprintf(out, "%-12s", shortName);
+		if (maskAndTest(entry->DIR_Attr, ATTR_DIRECTORY) || maskAndTest(entry->DIR_Attr, ATTR_VOLUME_ID)) {
+			used += sprintf(out + used, "%25s", "");
+		} else {
+			long double scaledSz = entry->DIR_FileSize;
+			int theUnit = scaleFileSize(&scaledSz);
+			used += sprintf(out + used, "%12u (%7.3Lf %2s)", entry->DIR_FileSize, scaledSz, units[theUnit]);
 		}
-		filename[i] = '\0';
+		used += sprintf(out + used, " %s %04d/%02d/%02d %02d:%02d:%02d", flags, cDate->year + 1980, cDate->month, cDate->day, cTime->hour, cTime->min, seconds);
+		if (ent->filename)
+			used += sprintf(out + used, " ( ");
+	}
+	if (ent->filename) {
+		for (int idx = 0; 0x0000 != ent->filename[idx]; idx++)
+			out[used++] = ent->filename[idx] & 0x00FF;
+		if (!machineReadable)
+			used += sprintf(out + used, " )");
 	}
-	return filename;
+	out[used++] = '\n';
+	return used;
 }
 
-void print_dir(FS_Instance * fsi, FS_Directory currDir) {
-	uint16_t dirCount = 0, fileCount = 0;
-	FS_EntryList * el = getDirListing((FS_Cluster)currDir, fsi);
-	printf("%12s%25s%7s%20s\n", "Name    ", "Size         ", "Flags ", "Modified Date   ");
-	printf("----------------------------------------------------------------\n");
-	while (NULL != el) {
-		FS_Entry * ent = el->node;
-		char * filename = getFilenameForEntry(ent->entry);
-		printf("%-12s", filename);
-		free(filename);
-		if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) || maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
-			if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && ('.' != ent->entry->DIR_Name[0]))
-				dirCount++;
-			printf("%25s", "");
+uint8_t parse_dir_options(char * args, FS_DirOptions * options) {
+	char * toke = (NULL != args) ? strtok(args, " ") : NULL;
+	while (NULL != toke) {
+		if (strcmp(toke, DIR_ARG_SORT) == 0) {
+			char * key = strtok(NULL, " ");
+			if (NULL == key)
+				return 0;
+			else if (strcasecmp(key, "name") == 0)
+				options->sort = DIR_SORT_NAME;
+			else if (strcasecmp(key, "size") == 0)
+				options->sort = DIR_SORT_SIZE;
+			else if (strcasecmp(key, "date") == 0)
+				options->sort = DIR_SORT_DATE;
+			else
+				return 0;
+		} else if ((strcmp(toke, DIR_ARG_LIMIT) == 0) || (strcmp(toke, DIR_ARG_OFFSET) == 0)) {
+			char * value = strtok(NULL, " ");
+			char * end = NULL;
+			long count = (NULL != value) ? strtol(value, &end, 10) : -1;
+			if ((count < 0) || (end == value) || ('\0' != *end))
+				return 0;
+			if (strcmp(toke, DIR_ARG_LIMIT) == 0)
+				options->limit = count;
+			else
+				options->offset = count;
+		} else if (strcmp(toke, DIR_ARG_REVERSE) == 0) {
+			options->reverse = 1;
+		} else if (strcmp(toke, DIR_ARG_RAW) == 0) {
+			options->machineReadable = 1;
+		} else if (('-' == toke[0]) && ('-' == toke[1])) {
+			return 0;
 		} else {
-			fileCount++;
-			long double scaledSz = ent->entry->DIR_FileSize;
-			int theUnit = scaleFileSize(&scaledSz);
-			printf("%12u (%7.3Lf %2s)", ent->entry->DIR_FileSize, scaledSz, units[theUnit]);
-		}
-		printf(" ");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID) ? "V" : "-");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) ? "D" : "-");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_ARCHIVE)   ? "A" : "-");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_SYSTEM)    ? "S" : "-");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_HIDDEN)    ? "H" : "-");
-		printf(maskAndTest(ent->entry->DIR_Attr, ATTR_READ_ONLY) ? "R" : "-");
-		printf(" ");
-		fatDate * cDate = &(ent->entry->DIR_WrtDate);
-		fatTime * cTime = &(ent->entry->DIR_WrtTime);
-		printf("%04d/%02d/%02d %02d:%02d:%02d", cDate->year + 1980, cDate->month, cDate->day, cTime->hour, cTime->min, (cTime->sec * 2) + (ent->entry->DIR_CrtTimeTenth / 100));
-		if (ent->filename) {
-			printf(" ( ");
-			int idx = 0;
-			while (0x0000 != ent->filename[idx]) {
-				printf("%c", ent->filename[idx++] & 0x00FF);
+			options->pattern = toke;
+		}
+		toke = strtok(NULL, " ");
+	}
+	return 1;
+}
+
+void print_dir(FS_Instance * fsi, FS_Directory currDir, FS_DirOptions * options) {
+	fprint_dir(stdout, fsi, currDir, options);
+}
+
+void fprint_dir(FILE * stream, FS_Instance * fsi, FS_Directory currDir, FS_DirOptions * options) {
+	FS_DirOptions defaults = { NULL, DIR_SORT_NONE, 0, 0, 0, 0 };
+	if (NULL == options)
+		options = &defaults;
+	FS_EntryList * el = getDirListing((FS_Cluster)currDir, fsi);
+	struct FS_DirLine_struct * lines = NULL;
+	uint32_t numLines = 0, allocLines = 0;
+	for (FS_EntryList * item = el; NULL != item; item = item->next) {
+		FS_Entry * ent = item->node;
+		if ((NULL != options->pattern) && !entryMatchesPattern(ent, options->pattern))
+			continue;
+		if (numLines == allocLines) {
+			allocLines = (0 == allocLines) ? 64 : (allocLines * 2);
+			struct FS_DirLine_struct * grown = realloc(lines, allocLines * sizeof(struct FS_DirLine_struct));
+			if (NULL == grown)
+				break;
+			lines = grown;
+		}
+		struct FS_DirLine_struct * line = &(lines[numLines++]);
+		line->ent = ent;
+		line->name = NULL;
+		line->key = 0;
+		switch (options->sort) {																// sort keys are computed once per entry
+			case DIR_SORT_NONE:
+				break;
+			case DIR_SORT_NAME:
+				line->name = getDisplayNameForEntry(ent);
+				break;
+			case DIR_SORT_SIZE:
+				line->key = ent->entry->DIR_FileSize;
+				break;
+			case DIR_SORT_DATE:
+				line->key = getEntryDateKey(ent->entry);
+				break;
+		}
+	}
+	if (DIR_SORT_NONE != options->sort)
+		qsort(lines, numLines, sizeof(struct FS_DirLine_struct), compareDirLines);
+	char * out = malloc(DIR_OUTPUT_BYTES);
+	if (NULL != out) {
+		size_t used = 0;
+		uint32_t dirCount = 0, fileCount = 0;
+		uint32_t first = (options->offset < numLines) ? options->offset : numLines;
+		uint32_t last = ((0 != options->limit) && ((numLines - first) > options->limit)) ? (first + options->limit) : numLines;
+		if (!options->machineReadable) {
+			used += sprintf(out + used, "%12s%25s%7s%20s\n", "Name    ", "Size         ", "Flags ", "Modified Date   ");
+			used += sprintf(out + used, "----------------------------------------------------------------\n");
+		}
+		for (uint32_t i = first; i < last; i++) {
+			FS_Entry * ent = lines[options->reverse ? (numLines - 1 - i) : i].ent;
+			if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) || maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
+				if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && ('.' != ent->entry->DIR_Name[0]))
+					dirCount++;
+			} else {
+				fileCount++;
 			}
-			printf(" )");
+			if ((used + DIR_LINE_BYTES) > DIR_OUTPUT_BYTES) {
+				fwrite(out, sizeof(char), used, stream);										// one write per full buffer rather than per field
+				used = 0;
+			}
+			used += formatDirLine(out + used, ent, options->machineReadable);
 		}
-		printf("\n");
+		if (!options->machineReadable) {
+			used += sprintf(out + used, "\t%u file(s), %u folder(s)\n", fileCount, dirCount);
+			if ((0 != first) || (last != numLines))
+				used += sprintf(out + used, "\tentries %u to %u of %u\n", (first < last) ? (first + 1) : first, last, numLines);
+		}
+		fwrite(out, sizeof(char), used, stream);
+		free(out);
+	}
+	for (uint32_t i = 0; i < numLines; i++)
+		free(lines[i].name);
+	free(lines);
+	while (NULL != el) {
 		FS_EntryList * toFree = el;
 		el = el->next;
 		freeFSEntryListItem(toFree);
 	}
-	printf("\t%d file(s), %d folder(s)\n", fileCount, dirCount);
 }
 
-FS_Directory change_dir(FS_Instance * fsi, FS_Directory currDir, char * path) {
+FS_Directory findDir(FS_Instance * fsi, FS_Directory currDir, char * path) {
 	char * pathCopy = strdup(path);
 																										// validate the filename
 	char * toke = strtok(pathCopy, "/\\");
 	FS_Directory dir = currDir;
 	while (NULL != toke) {
-		currDir = dir;
-		FS_EntryList * el = getDirListing((FS_Cluster)dir, fsi);
+		FS_DirCache * dc = openDir((FS_Cluster)dir, fsi);
+		FS_Entry * ent = (NULL != dc) ? findEntryByName(dc->hash, toke) : NULL;
 		uint8_t found = 0;
-		while (NULL != el) {
-			FS_Entry * ent = el->node;
-			if ((currDir == dir) && (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY))) {
-				char * filename = getFilenameForEntry(ent->entry);
-				if (strcmp(toke, filename) == 0) {
-					found = 1;
-					dir = (ent->entry->DIR_FstClusHI << 8) + ent->entry->DIR_FstClusLO;
-				}
-				free(filename);
-			}
-			FS_EntryList * toFree = el;
-			el = el->next;
-			freeFSEntryListItem(toFree);
+		if ((NULL != ent) && maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY)) {
+			found = 1;
+			dir = getClusterForEntry(ent->entry);
+			if (0 == dir)
+				dir = fs_get_root(fsi);													// '..' entries point at cluster 0 for the root
 		}
+		closeDir(dc, fsi);
 		if (!found) {
 			dir = 0x00000001;
 			break;
@@ -261,49 +420,230 @@ FS_Directory change_dir(FS_Instance * fsi, FS_Directory currDir, char * path) {
 	return dir;
 }
 
-fs_result get_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath) {
-	FS_Cluster file = 0x00000001;
-	uint32_t fileSz = 0;
-	FS_EntryList * el = getDirListing((FS_Cluster)currDir, fsi);
-	uint8_t found = 0;
-	while (NULL != el) {
-		FS_Entry * ent = el->node;
-		if ((0 == found) && !maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
-			char * filename = getFilenameForEntry(ent->entry);
-			if (strcmp(path, filename) == 0) {
-				found = 1;
-				file = (ent->entry->DIR_FstClusHI << 8) + ent->entry->DIR_FstClusLO;
-				fileSz = ent->entry->DIR_FileSize;
+FS_Directory change_dir(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	uint64_t started = traceStart(fsi);
+	FS_Directory dir = findDir(fsi, currDir, path);
+	traceCall(fsi, TRACE_CD, currDir, path, NULL, dir, 0, started);
+	return dir;
+}
+
+/* Descriptor a GET destination names ('-' or '&n'), or -1 for a plain path */
+int getStreamDescriptor(char * localPath) {
+	if (0 == strcmp(localPath, GET_STDOUT))
+		return STDOUT_FILENO;
+	if ((0 != strncmp(localPath, GET_FD_PREFIX, strlen(GET_FD_PREFIX))) || !isdigit((unsigned char)localPath[strlen(GET_FD_PREFIX)]))
+		return -1;
+	char * end = NULL;
+	long fd = strtol(localPath + strlen(GET_FD_PREFIX), &end, 10);
+	return (('\0' == *end) && (fd <= INT_MAX)) ? (int)fd : -1;
+}
+
+/*
+ * Whether fd is open for writing and is not one of the instance's own files,
+ * so that '&3' naming the image itself cannot overwrite its boot sector.
+ */
+uint8_t isWritableStream(int fd, FS_Instance * fsi) {
+	if ((fd == fsi->disk) || ((NULL != fsi->overlay) && (fd == fsi->overlay->fd)) || ((NULL != fsi->trace) && (fd == fileno(fsi->trace))))
+		return 0;
+	int flags = fcntl(fd, F_GETFL);
+	return (0 <= flags) && (O_RDONLY != (flags & O_ACCMODE));
+}
+
+uint8_t writeStream(int fd, const uint8_t * buf, size_t len) {
+	while (0 < len) {
+		ssize_t bytesWritten = write(fd, buf, len);
+		if ((0 > bytesWritten) && (EINTR == errno))
+			continue;
+		if (0 >= bytesWritten)
+			return 0;
+		buf += bytesWritten;
+		len -= bytesWritten;
+	}
+	return 1;
+}
+
+/*
+ * Moves one contiguous run of the image to fd. Without an overlay the image
+ * file holds the run as is, so it is spliced straight into fd when that is a
+ * pipe and never passes through user space; anything splice cannot take,
+ * including a run past the end of a truncated image, is read and written
+ * through buf. *canSplice is cleared the first time splice turns fd down.
+ */
+uint8_t streamRun(int fd, uint64_t offset, uint64_t len, uint8_t * buf, uint8_t * canSplice, FS_Instance * fsi) {
+	while (*canSplice && (0 < len)) {
+		loff_t from = offset;
+		ssize_t moved = splice(fsi->disk, &from, fd, NULL, len, SPLICE_F_MORE);
+		if ((0 > moved) && (EINTR == errno))
+			continue;
+		if ((0 > moved) && ((EINVAL == errno) || (ENOSYS == errno)))
+			*canSplice = 0;
+		else if (0 > moved)
+			return 0;
+		if (0 >= moved)
+			break;
+		offset += moved;
+		len -= moved;
+	}
+	while (0 < len) {
+		size_t chunk = (len < GET_STREAM_BYTES) ? len : GET_STREAM_BYTES;
+		readDisk(buf, chunk, offset, fsi);
+		if (!writeStream(fd, buf, chunk))
+			return 0;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 1;
+}
+
+/*
+ * Writes a file's contents to a descriptor that may not be seekable, such as
+ * a pipe, so no holes are left and every byte is written in order. Clusters
+ * that follow each other on disk are gathered into runs of up to
+ * GET_STREAM_BYTES, so a contiguous file goes out in a few large transfers.
+ */
+fs_result streamEntry(FS_Instance * fsi, FS_Directory currDir, FS_Entry * ent, int fd) {
+	FS_Cluster file = getClusterForEntry(ent->entry);
+	uint64_t fileSz = ent->entry->DIR_FileSize;
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	uint32_t clustersPerRun = (GET_STREAM_BYTES > bytesPerCluster) ? (GET_STREAM_BYTES / bytesPerCluster) : 1;
+	uint8_t * buf = malloc((uint64_t)clustersPerRun * bytesPerCluster);
+	uint32_t numExtents = 0;
+	FS_IndexExtent * extents = getExtentsFromIndex((FS_Cluster)currDir, file, &numExtents, fsi);
+	FS_ChainReader * chain = (NULL != extents) ? openExtentReader(extents, numExtents, fsi) : openChainReader(file, NULL, fsi);
+	if ((NULL == buf) || (NULL == chain)) {
+		free(buf);
+		closeChainReader(chain);
+		return ERR_MALLOCFAILED;
+	}
+	fflush(stdout);																				// keep anything already printed ahead of the data
+	uint8_t canSplice = (NULL == fsi->overlay);
+	if (canSplice)
+		fcntl(fd, F_SETPIPE_SZ, GET_STREAM_BYTES);												// a bigger pipe takes a whole run per splice; harmless if fd is no pipe
+	fs_result result = ERR_SUCCESS;
+	FS_Cluster runStart = 0;
+	uint32_t runLength = 0;
+	for (file = nextChainCluster(chain, fsi); ; file = nextChainCluster(chain, fsi)) {
+		uint8_t more = isDataCluster(file, fsi) && (((uint64_t)runLength * bytesPerCluster) < fileSz);
+		if (more && (0 < runLength) && (file == (runStart + runLength)) && (runLength < clustersPerRun)) {
+			runLength++;
+			continue;
+		}
+		if (0 < runLength) {
+			uint64_t runBytes = (uint64_t)runLength * bytesPerCluster;
+			if (runBytes > fileSz)
+				runBytes = fileSz;
+			if (!streamRun(fd, getClusterOffset(runStart, fsi), runBytes, buf, &canSplice, fsi)) {
+				result = ERR_FOPENFAILEDWRITE;
+				break;
 			}
-			free(filename);
+			fileSz -= runBytes;
 		}
-		FS_EntryList * toFree = el;
-		el = el->next;
-		freeFSEntryListItem(toFree);
+		if (!more || (0 == fileSz))
+			break;
+		runStart = file;
+		runLength = 1;
 	}
-	if (found) {
-		FILE * localFile = fopen(localPath, "wb");
-		if (NULL != localFile) {
-			uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
-			uint8_t * cluster = malloc(sizeof(uint8_t) * bytesPerCluster);
-			do {
-				size_t bytesToRead = sizeof(uint8_t) * bytesPerCluster;
-				if (bytesToRead > fileSz)
-					bytesToRead = fileSz;
-				fileSz -= bytesToRead;
-				fseek(fsi->disk, (getFirstSectorOfCluster(file, fsi) * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-				fread(cluster, sizeof(uint8_t), bytesToRead, fsi->disk);
-				fwrite(cluster, sizeof(uint8_t), bytesToRead, localFile);
-				file = getFATEntryForCluster(file, fsi);
-			} while (!isFATEntryEOF(file, fsi));
-			free(cluster);
-			fflush(localFile);
-			fclose(localFile);
-			return ERR_SUCCESS;
-		}
+	closeChainReader(chain);
+	free(buf);
+	return result;
+}
+
+fs_result extractEntry(FS_Instance * fsi, FS_Directory currDir, FS_Entry * ent, char * localPath) {
+	int fd = getStreamDescriptor(localPath);
+	if (0 <= fd)
+		return isWritableStream(fd, fsi) ? streamEntry(fsi, currDir, ent, fd) : ERR_FOPENFAILEDWRITE;
+	FS_Cluster file = getClusterForEntry(ent->entry);
+	uint32_t fileSz = ent->entry->DIR_FileSize;
+	FILE * localFile = fopen(localPath, "wb");
+	if (NULL == localFile)
 		return ERR_FOPENFAILEDWRITE;
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * cluster = malloc(sizeof(uint8_t) * bytesPerCluster);
+	uint32_t numExtents = 0;
+	FS_IndexExtent * extents = getExtentsFromIndex((FS_Cluster)currDir, file, &numExtents, fsi);
+	FS_ChainReader * chain = (NULL != extents) ? openExtentReader(extents, numExtents, fsi) : openChainReader(file, NULL, fsi);	// the sidecar already knows the chain, skip the FAT
+	uint8_t skipped = 0;
+	if ((NULL == cluster) || (NULL == chain)) {
+		free(cluster);
+		closeChainReader(chain);
+		fclose(localFile);
+		return ERR_MALLOCFAILED;
+	}
+	uint8_t failed = 0;
+	for (file = nextChainCluster(chain, fsi); !failed && isDataCluster(file, fsi) && (0 < fileSz); file = nextChainCluster(chain, fsi)) {
+		size_t bytesToRead = sizeof(uint8_t) * bytesPerCluster;
+		if (bytesToRead > fileSz)
+			bytesToRead = fileSz;
+		fileSz -= bytesToRead;
+		readDisk(cluster, bytesToRead, getClusterOffset(file, fsi), fsi);
+		if (isZeroFilled(cluster, bytesToRead) && (0 == fseeko(localFile, bytesToRead, SEEK_CUR)))
+			skipped = 1;																		// leave a hole rather than writing zeros
+		else
+			failed = (bytesToRead != fwrite(cluster, sizeof(uint8_t), bytesToRead, localFile));
 	}
-	return ERR_FILENOTFOUND;
+	closeChainReader(chain);
+	free(cluster);
+	failed |= (0 != fflush(localFile));
+	if (skipped && !failed)
+		failed = (0 != ftruncate(fileno(localFile), ftello(localFile)));						// a trailing hole has to be given a size
+	failed |= (0 != fclose(localFile));
+	return failed ? ERR_FOPENFAILEDWRITE : ERR_SUCCESS;
+}
+
+uint8_t isFileMatch(FS_Entry * ent, char * pattern) {
+	return !maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID) && entryMatchesPattern(ent, pattern);
+}
+
+fs_result extractFiles(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath, uint64_t * bytes) {
+	uint8_t isPattern = hasWildcards(path);
+	uint8_t toStream = (0 <= getStreamDescriptor(localPath));
+	fs_result result = ERR_FILENOTFOUND;
+	FS_DirCache * dc = openDir((FS_Cluster)currDir, fsi);
+	if (NULL == dc)
+		return ERR_MALLOCFAILED;
+	FS_Entry * single = NULL;
+	if (!isPattern) {
+		FS_Entry * ent = findEntryByName(dc->hash, path);
+		if ((NULL != ent) && !maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY))
+			single = ent;
+	} else if (toStream) {
+		for (FS_EntryList * it = dc->listing; (NULL != it) && (ERR_MULTIPLEMATCHES != result); it = it->next) {
+			if (!isFileMatch(it->node, path))
+				continue;
+			if (NULL != single)
+				result = ERR_MULTIPLEMATCHES;													// a stream takes one file, the matches would run together
+			single = it->node;
+		}
+	}
+	if ((NULL != single) && (ERR_MULTIPLEMATCHES != result)) {
+		result = extractEntry(fsi, currDir, single, localPath);
+		if (ERR_SUCCESS == result)
+			*bytes += single->entry->DIR_FileSize;
+	}
+	for (FS_EntryList * el = dc->listing; isPattern && !toStream && (NULL != el); el = el->next) {
+		FS_Entry * ent = el->node;
+		if (isFileMatch(ent, path)) {
+			char * name = getDisplayNameForEntry(ent);											// every match lands in localPath under its own name
+			char * target = (NULL != name) ? joinPath(localPath, name) : NULL;
+			fs_result extracted = (NULL != target) ? extractEntry(fsi, currDir, ent, target) : ERR_MALLOCFAILED;
+			if ((ERR_SUCCESS != extracted) || (ERR_FILENOTFOUND == result))
+				result = extracted;
+			if (ERR_SUCCESS == extracted)
+				*bytes += ent->entry->DIR_FileSize;
+			free(target);
+			free(name);
+		}
+	}
+	closeDir(dc, fsi);
+	return result;
+}
+
+fs_result get_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath) {
+	uint64_t started = traceStart(fsi);
+	uint64_t bytes = 0;
+	fs_result result = extractFiles(fsi, currDir, path, localPath, &bytes);
+	traceCall(fsi, TRACE_GET, currDir, path, localPath, result, bytes, started);
+	return result;
 }
 
 void fillEntryForNewItem(fatEntry * entry, FS_Cluster cluster, uint8_t attrs, uint32_t size, struct timeval * tv) {
@@ -323,27 +663,209 @@ void fillEntryForNewItem(fatEntry * entry, FS_Cluster cluster, uint8_t attrs, ui
 	entry->DIR_CrtTime = *currTime;
 	entry->DIR_CrtDate = *currDate;
 	entry->DIR_LstAccDate = *currDate;
-	entry->DIR_FstClusHI = cluster >> 8;
 	entry->DIR_WrtTime = *currTime;
 	entry->DIR_WrtDate = *currDate;
-	entry->DIR_FstClusLO = cluster & 0x00FF;
+	setClusterForEntry(entry, cluster);
 	entry->DIR_FileSize = size;
 	free(currDate);
 	free(currTime);
 }
 
-fs_result put_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath) {
-	FILE * localFile = fopen(localPath, "rb");
+FILE * openLocalFile(char * localPath) {
+	if (0 == strcmp(localPath, PUT_STDIN))
+		return stdin;
+	return fopen(localPath, "rb");
+}
+
+void closeLocalFile(FILE * localFile) {
+	if (stdin != localFile) {
+		fclose(localFile);
+		return;
+	}
+	int c;
+	do c = fgetc(localFile); while (EOF != c);													// whatever a failed write left behind must not be run as commands
+}
+
+/*
+ * Copies localFile into the image from offset on until it runs dry. Whenever
+ * a write would pass the clusters already chained, the next batch is reserved
+ * up front as one run, doubling each time up to PUT_RESERVE_MAX_BYTES, so data
+ * of unknown length still lands in a few long extents rather than in whatever
+ * single clusters the allocator hands out. fs_close gives back the unused end.
+ */
+fs_result writeLocalFileAt(FS_File * file, FILE * localFile, uint64_t offset, uint64_t * written) {
+	uint8_t * buf = malloc(PUT_BUFFER_BYTES);
+	if (NULL == buf)
+		return ERR_MALLOCFAILED;
+	fs_result result = ERR_SUCCESS;
+	size_t bytesRead;
+	uint64_t batch = PUT_BUFFER_BYTES;
+	*written = 0;
+	while (0 < (bytesRead = fread(buf, sizeof(uint8_t), PUT_BUFFER_BYTES, localFile))) {
+		uint64_t end = offset + *written + bytesRead;
+		if ((0 < batch) && (end > ((uint64_t)file->reservedClusters * file->bytesPerCluster))) {
+			uint64_t want = end + batch;
+			if (want > 0xFFFFFFFF)
+				want = 0xFFFFFFFF;
+			if ((want > fs_size(file)) && (ERR_SUCCESS != fs_reserve(file, want - fs_size(file))))
+				batch = 0;																		// too little room left for a run, so plain writes take over
+			else if (batch < PUT_RESERVE_MAX_BYTES)
+				batch *= 2;
+		}
+		ssize_t bytesWritten = fs_pwrite(file, buf, bytesRead, offset + *written);
+		if (0 < bytesWritten)
+			*written += bytesWritten;
+		if (bytesWritten != bytesRead) {
+			result = ERR_NOFREESPACE;
+			break;
+		}
+	}
+	free(buf);
+	return result;
+}
+
+fs_result overwrite_file(FS_File * file, char * localPath, uint64_t * bytes) {
+	FILE * localFile = openLocalFile(localPath);
+	if (NULL == localFile) {
+		fs_close(file);
+		return ERR_FOPENFAILEDREAD;
+	}
+	struct stat stats;
+	if ((0 == fstat(fileno(localFile), &stats)) && S_ISREG(stats.st_mode) && (stats.st_size > fs_size(file)))
+		fs_reserve(file, ((stats.st_size < 0xFFFFFFFF) ? stats.st_size : 0xFFFFFFFF) - fs_size(file));
+	fs_result result = writeLocalFileAt(file, localFile, 0, bytes);
+	closeLocalFile(localFile);
+	if (ERR_SUCCESS == result)
+		result = fs_truncate(file, *bytes);
+	fs_close(file);
+	return result;
+}
+
+fs_result makeDir(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	FS_Cluster cluster = getNextFreeCluster(currDir, fsi);
+	if (1 == cluster)
+		return ERR_NOFREESPACE;
+	zeroCluster(cluster, fsi);
+	setFATEntryForCluster(cluster, getEOFMarker(fsi), fsi);										// taken before the parent can grow into it
+	fatEntry * entry = malloc(sizeof(fatEntry));
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	fillEntryForNewItem(entry, cluster, ATTR_DIRECTORY | ATTR_ARCHIVE, 0, &tv);
+	fs_result result = addDirListing(currDir, path, entry, 0, fsi);
+	if (ERR_SUCCESS == result) {
+		fillEntryForNewItem(entry, cluster, ATTR_DIRECTORY, 0, &tv);
+		addDirListing(cluster, ".", entry, 1, fsi);
+		fillEntryForNewItem(entry, ((fs_get_root(fsi) == currDir) ? 0 : currDir), ATTR_DIRECTORY, 0, &tv);
+		addDirListing(cluster, "..", entry, 1, fsi);
+	} else {
+		setFATEntryForCluster(cluster, 0, fsi);
+	}
+	free(entry);
+	return result;
+}
+
+fs_result make_dir(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	uint64_t started = traceStart(fsi);
+	fs_result result = makeDir(fsi, currDir, path);
+	traceCall(fsi, TRACE_MD, currDir, path, NULL, result, 0, started);
+	return result;
+}
+
+uint8_t addEntryMatch(FS_Entry * ent, FS_Entry *** matches, uint32_t * numMatches, uint32_t * allocMatches) {
+	if (*numMatches == *allocMatches) {
+		uint32_t newAlloc = (0 == *allocMatches) ? 16 : (*allocMatches * 2);
+		FS_Entry ** grown = realloc(*matches, newAlloc * sizeof(FS_Entry *));
+		if (NULL == grown)
+			return 0;
+		*matches = grown;
+		*allocMatches = newAlloc;
+	}
+	(*matches)[(*numMatches)++] = ent;
+	return 1;
+}
+
+fs_result deleteItems(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	if ((strcmp(path, ".") == 0) || (strcmp(path, "..") == 0))
+		return ERR_DELETESPECIALDIR;
+	FS_Entry ** matches = NULL;
+	uint32_t numMatches = 0, allocMatches = 0;
+	FS_DirCache * dc = openDir((FS_Cluster)currDir, fsi);
+	if (NULL == dc)
+		return ERR_MALLOCFAILED;
+	fs_result result = ERR_SUCCESS;
+	if (hasWildcards(path)) {
+		for (FS_EntryList * item = dc->listing; (NULL != item) && (ERR_SUCCESS == result); item = item->next) {
+			FS_Entry * ent = item->node;
+			if (maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID) || maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) || !entryMatchesPattern(ent, path))
+				continue;																// patterns only ever remove files
+			if (!addEntryMatch(ent, &matches, &numMatches, &allocMatches))
+				result = ERR_MALLOCFAILED;
+		}
+	} else {
+		FS_Entry * ent = findEntryByName(dc->hash, path);
+		if ((NULL != ent) && ('.' != ent->entry->DIR_Name[0]) && !addEntryMatch(ent, &matches, &numMatches, &allocMatches))
+			result = ERR_MALLOCFAILED;
+	}
+	if (ERR_SUCCESS == result) {
+		for (uint32_t i = 0; i < numMatches; i++)
+			freeEntryClusters(matches[i], fsi);
+		markEntriesDeleted((FS_Cluster)currDir, matches, numMatches, fsi);			// one write per directory cluster touched
+		if (0 == numMatches)
+			result = ERR_FILENOTFOUND;
+	}
+	free(matches);
+	closeDir(dc, fsi);
+	return result;
+}
+
+fs_result delete_file(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	uint64_t started = traceStart(fsi);
+	fs_result result = deleteItems(fsi, currDir, path);
+	traceCall(fsi, TRACE_DEL, currDir, path, NULL, result, 0, started);
+	return result;
+}
+
+/*
+ * Writes a source whose length is not known until it ends, such as a pipe or
+ * standard input. The entry is created empty, filled by writeLocalFileAt, and
+ * gets its real DIR_FileSize when fs_close writes it back. If the image fills
+ * up first the half-written file is deleted again, the same as a PUT that
+ * never started.
+ */
+fs_result putLocalStream(FS_Instance * fsi, FS_Directory currDir, char * path, FILE * localFile, uint64_t * bytes) {
+	FS_File * file;
+	fs_result result = fs_create(fsi, currDir, path, &file);
+	if (ERR_SUCCESS != result)
+		return result;
+	result = writeLocalFileAt(file, localFile, 0, bytes);
+	fs_close(file);
+	if (ERR_SUCCESS != result)
+		deleteItems(fsi, currDir, path);
+	return result;
+}
+
+fs_result putLocalFile(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath, uint64_t * bytes) {
+	FS_File * existing;
+	fs_result openResult = fs_open(fsi, currDir, path, &existing);
+	if (ERR_SUCCESS == openResult)
+		return overwrite_file(existing, localPath, bytes);									// reuse the chain already on disk
+	if (ERR_FILENOTFOUND != openResult)
+		return openResult;
+	FILE * localFile = openLocalFile(localPath);
 	if (NULL != localFile) {
 		struct stat stats;
-		stat(localPath, &stats);
+		if ((stdin == localFile) || (0 != fstat(fileno(localFile), &stats)) || !S_ISREG(stats.st_mode)) {
+			fs_result result = putLocalStream(fsi, currDir, path, localFile, bytes);
+			closeLocalFile(localFile);
+			return result;
+		}
 		off_t fileSz = stats.st_size;
 		uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
-		uint16_t numClustersForFile = (fileSz / bytesPerCluster) + 1;
-		FS_Cluster file = getNextFreeCluster(fsi);
+		uint32_t numClustersForFile = (fileSz / bytesPerCluster) + 1;
+		FS_Cluster file = getNextFreeCluster(currDir, fsi);
 		FS_Cluster curr = file, next = file;
 		while (numClustersForFile-- > 0) {
-			next = getNextFreeCluster(fsi);
+			next = getNextFreeCluster(curr, fsi);
 			if (1 == next) {
 				if (1 != curr)
 					setFATEntryForCluster(curr, getEOFMarker(fsi), fsi);
@@ -354,13 +876,8 @@ fs_result put_file(FS_Instance * fsi, FS_Directory currDir, char * path, char *
 			curr = next;
 		}
 		if (1 == next) {
-			if (1 != file) {
-				do {
-					curr = getFATEntryForCluster(file, fsi);
-					setFATEntryForCluster(file, 0, fsi);
-					file = curr;
-				} while (!isFATEntryEOF(file, fsi));
-			}
+			freeChain(file, fsi);
+			closeLocalFile(localFile);
 			return ERR_NOFREESPACE;
 		}
 		setFATEntryForCluster(next, getEOFMarker(fsi), fsi);
@@ -378,57 +895,515 @@ fs_result put_file(FS_Instance * fsi, FS_Directory currDir, char * path, char *
 				if (bytesToRead > fileSz)
 					bytesToRead = fileSz;
 				fileSz -= bytesToRead;
-				fseek(fsi->disk, (getFirstSectorOfCluster(file, fsi) * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-				fread(cluster, sizeof(uint8_t), bytesToRead, localFile);
-				fwrite(cluster, sizeof(uint8_t), bytesToRead, fsi->disk);
+				bytesToRead = fread(cluster, sizeof(uint8_t), bytesToRead, localFile);
+				writeDisk(cluster, bytesToRead, getClusterOffset(file, fsi), fsi);
 				file = getFATEntryForCluster(file, fsi);
 			} while (!isFATEntryEOF(file, fsi));
 			free(cluster);
+			closeLocalFile(localFile);
+			*bytes = stats.st_size;
 			return ERR_SUCCESS;
-		} else {
-			do {
-				curr = getFATEntryForCluster(file, fsi);
-				setFATEntryForCluster(file, 0, fsi);
-				file = curr;
-			} while (!isFATEntryEOF(file, fsi));
 		}
-		fclose(localFile);
+		freeChain(file, fsi);
+		closeLocalFile(localFile);
 		return result;
 	}
 	return ERR_FOPENFAILEDREAD;
 }
 
-fs_result make_dir(FS_Instance * fsi, FS_Directory currDir, char * path) {
-	FS_Cluster cluster = getNextFreeCluster(fsi);
-	if (1 == cluster)
-		return ERR_NOFREESPACE;
-	zeroCluster(cluster, fsi);
-	fatEntry * entry = malloc(sizeof(fatEntry));
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	fillEntryForNewItem(entry, cluster, ATTR_DIRECTORY | ATTR_ARCHIVE, 0, &tv);
-	fs_result result = addDirListing(currDir, path, entry, 0, fsi);
-	if (ERR_SUCCESS == result) {
+fs_result put_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath) {
+	uint64_t started = traceStart(fsi);
+	uint64_t bytes = 0;
+	fs_result result = putLocalFile(fsi, currDir, path, localPath, &bytes);
+	traceCall(fsi, TRACE_PUT, currDir, path, localPath, result, bytes, started);
+	return result;
+}
+
+fs_result appendLocalFile(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath, uint64_t * bytes) {
+	FS_File * file;
+	fs_result result = fs_open(fsi, currDir, path, &file);
+	if (ERR_FILENOTFOUND == result)
+		return putLocalFile(fsi, currDir, path, localPath, bytes);
+	if (ERR_SUCCESS != result)
+		return result;
+	FILE * localFile = openLocalFile(localPath);
+	if (NULL == localFile) {
+		fs_close(file);
+		return ERR_FOPENFAILEDREAD;
+	}
+	struct stat stats;
+	if ((0 == fstat(fileno(localFile), &stats)) && S_ISREG(stats.st_mode) && (0 < stats.st_size))
+		fs_reserve(file, (stats.st_size < 0xFFFFFFFF) ? stats.st_size : 0xFFFFFFFF);			// one contiguous run instead of a cluster at a time
+	result = writeLocalFileAt(file, localFile, fs_size(file), bytes);
+	closeLocalFile(localFile);
+	fs_close(file);
+	return result;
+}
+
+fs_result append_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath) {
+	uint64_t started = traceStart(fsi);
+	uint64_t bytes = 0;
+	fs_result result = appendLocalFile(fsi, currDir, path, localPath, &bytes);
+	traceCall(fsi, TRACE_APPEND, currDir, path, localPath, result, bytes, started);
+	return result;
+}
+
+void setEntryWriteTime(fatEntry * entry, struct timeval * tv) {
+	struct tm * now = localtime(&(tv->tv_sec));
+	entry->DIR_WrtDate.year = now->tm_year - 80;
+	entry->DIR_WrtDate.month = now->tm_mon + 1;
+	entry->DIR_WrtDate.day = now->tm_mday;
+	entry->DIR_WrtTime.hour = now->tm_hour;
+	entry->DIR_WrtTime.min = now->tm_min;
+	entry->DIR_WrtTime.sec = now->tm_sec / 2;
+	entry->DIR_LstAccDate = entry->DIR_WrtDate;
+}
+
+uint8_t addFileCheckpoint(FS_File * file, FS_Cluster cluster) {
+	if (file->numCheckpoints == file->allocCheckpoints) {
+		uint32_t newAlloc = (0 == file->allocCheckpoints) ? 16 : (file->allocCheckpoints * 2);
+		FS_Cluster * checkpoints = realloc(file->checkpoints, newAlloc * sizeof(FS_Cluster));
+		if (NULL == checkpoints)
+			return 0;
+		file->checkpoints = checkpoints;
+		file->allocCheckpoints = newAlloc;
+	}
+	file->checkpoints[file->numCheckpoints++] = cluster;
+	return 1;
+}
+
+/* Resolves the cluster holding the idx'th cluster of the file, starting from the
+ * closest checkpoint or the last resolved cluster, whichever is nearer. */
+FS_Cluster getFileClusterAtIndex(FS_File * file, uint32_t idx) {
+	FS_Instance * fsi = file->fsi;
+	if (0 == file->numCheckpoints)
+		return 0x00000001;
+	uint32_t cp = idx / FILE_CHECKPOINT_INTERVAL;
+	if (cp >= file->numCheckpoints)
+		cp = file->numCheckpoints - 1;
+	FS_Cluster cluster = file->checkpoints[cp];
+	uint32_t at = cp * FILE_CHECKPOINT_INTERVAL;
+	if ((0 != file->lastCluster) && (file->lastIndex <= idx) && (file->lastIndex > at)) {
+		cluster = file->lastCluster;
+		at = file->lastIndex;
+	}
+	FS_Cluster walked[FAT_WALK_BATCH];
+	uint32_t numWalked = 0, walkPos = 0;
+	while (at < idx) {
+		if (walkPos == numWalked) {
+			numWalked = walkFATChain(cluster, walked, ((idx - at) < FAT_WALK_BATCH) ? (idx - at) : FAT_WALK_BATCH, fsi);
+			walkPos = 0;
+		}
+		FS_FATEntry next = walked[walkPos++];
+		if (!isDataCluster(next, fsi))
+			break;
+		cluster = next;
+		at++;
+		if ((0 == (at % FILE_CHECKPOINT_INTERVAL)) && ((at / FILE_CHECKPOINT_INTERVAL) == file->numCheckpoints))
+			addFileCheckpoint(file, cluster);
+	}
+	file->lastCluster = cluster;
+	file->lastIndex = at;
+	return (at == idx) ? cluster : 0x00000001;
+}
+
+/* Grows the chain until it has a cluster at index idx. New clusters are zeroed so
+ * that gaps read back as zeros. */
+fs_result extendFileToIndex(FS_File * file, uint32_t idx) {
+	FS_Instance * fsi = file->fsi;
+	while (1 == getFileClusterAtIndex(file, idx)) {
+		FS_Cluster cluster = 0x00000001;
+		if ((0 < file->numCheckpoints) && isDataCluster(file->lastCluster + 1, fsi) && (0 == getFATEntryForCluster(file->lastCluster + 1, fsi)))
+			cluster = file->lastCluster + 1;													// keep the chain contiguous with its tail
+		else
+			cluster = getNextFreeCluster((0 < file->numCheckpoints) ? file->lastCluster : file->parentDir, fsi);
+		if (1 == cluster)
+			return ERR_NOFREESPACE;
 		setFATEntryForCluster(cluster, getEOFMarker(fsi), fsi);
-		fillEntryForNewItem(entry, cluster, ATTR_DIRECTORY, 0, &tv);
-		addDirListing(cluster, ".", entry, 1, fsi);
-		fillEntryForNewItem(entry, ((fs_get_root(fsi) == currDir) ? 0 : currDir), ATTR_DIRECTORY, 0, &tv);
-		addDirListing(cluster, "..", entry, 1, fsi);
+		zeroCluster(cluster, fsi);
+		if (0 == file->numCheckpoints) {
+			setClusterForEntry(&(file->entry), cluster);
+			file->dirty = 1;
+			file->lastIndex = 0;
+		} else {
+			setFATEntryForCluster(file->lastCluster, cluster, fsi);
+			file->lastIndex++;
+		}
+		file->lastCluster = cluster;
+		if ((0 == (file->lastIndex % FILE_CHECKPOINT_INTERVAL)) && ((file->lastIndex / FILE_CHECKPOINT_INTERVAL) == file->numCheckpoints))
+			if (!addFileCheckpoint(file, cluster))
+				return ERR_MALLOCFAILED;
+	}
+	return ERR_SUCCESS;
+}
+
+ssize_t transferFileData(FS_File * file, uint8_t * buf, size_t len, uint64_t offset, uint8_t isWrite) {
+	FS_Instance * fsi = file->fsi;
+	size_t done = 0;
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint32_t idx = pos / file->bytesPerCluster;
+		uint32_t within = pos % file->bytesPerCluster;
+		if (isWrite && (ERR_SUCCESS != extendFileToIndex(file, idx)))
+			break;
+		FS_Cluster cluster = getFileClusterAtIndex(file, idx);
+		if (1 == cluster)
+			break;
+		size_t chunk = file->bytesPerCluster - within;
+		if (chunk > (len - done))
+			chunk = len - done;
+		if (isWrite)
+			chunk = writeDisk(buf + done, chunk, getClusterOffset(cluster, fsi) + within, fsi);
+		else
+			chunk = readDisk(buf + done, chunk, getClusterOffset(cluster, fsi) + within, fsi);
+		if (0 == chunk)
+			break;
+		done += chunk;
+	}
+	if (isWrite && (0 < done)) {
+		if ((offset + done) > file->entry.DIR_FileSize)
+			file->entry.DIR_FileSize = offset + done;
+		file->dirty = 1;
+	}
+	return ((0 == done) && (0 < len)) ? -1 : done;
+}
+
+fs_result fs_open(FS_Instance * fsi, FS_Directory currDir, char * path, FS_File ** file) {
+	*file = NULL;
+	fs_result result = ERR_FILENOTFOUND;
+	FS_DirCache * dc = openDir((FS_Cluster)currDir, fsi);
+	FS_Entry * ent = (NULL != dc) ? findEntryByName(dc->hash, path) : NULL;
+	if (NULL == dc) {
+		result = ERR_MALLOCFAILED;
+	} else if (NULL != ent) {
+		result = ERR_FILENAMEEXISTS;															// a directory by that name
+		if (!maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY)) {
+			*file = calloc(1, sizeof(FS_File));
+			result = ERR_MALLOCFAILED;
+			if (NULL != *file) {
+				(*file)->fsi = fsi;
+				(*file)->entry = *(ent->entry);
+				(*file)->info = *(ent->info);
+				(*file)->parentDir = (FS_Cluster)currDir;
+				(*file)->bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+				FS_Cluster first = getClusterForEntry(ent->entry);
+				if (!isDataCluster(first, fsi) || addFileCheckpoint(*file, first))
+					result = ERR_SUCCESS;
+			}
+		}
+	}
+	closeDir(dc, fsi);
+	if ((ERR_SUCCESS != result) && (NULL != *file)) {
+		free((*file)->checkpoints);
+		free(*file);
+		*file = NULL;
 	}
-	free(entry);
 	return result;
 }
 
-FS_Directory delete_file(FS_Instance * fsi, FS_Directory currDir, char * path) {
-	FS_EntryList * el = getDirListing((FS_Cluster)currDir, fsi);
-	uint8_t found = 0;
+fs_result fs_create(FS_Instance * fsi, FS_Directory currDir, char * path, FS_File ** file) {
+	*file = NULL;
+	fatEntry entry;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	fillEntryForNewItem(&entry, 0, ATTR_ARCHIVE, 0, &tv);										// empty until the first write allocates a chain
+	fs_result result = addDirListing(currDir, path, &entry, 0, fsi);
+	if (ERR_SUCCESS != result)
+		return result;
+	return fs_open(fsi, currDir, path, file);
+}
+
+ssize_t fs_pread(FS_File * file, void * buf, size_t len, uint64_t offset) {
+	if (offset >= file->entry.DIR_FileSize)
+		return 0;
+	if (len > (file->entry.DIR_FileSize - offset))
+		len = file->entry.DIR_FileSize - offset;
+	return transferFileData(file, buf, len, offset, 0);
+}
+
+ssize_t fs_read(FS_File * file, void * buf, size_t len) {
+	ssize_t bytesRead = fs_pread(file, buf, len, file->position);
+	if (0 < bytesRead)
+		file->position += bytesRead;
+	return bytesRead;
+}
+
+ssize_t fs_pwrite(FS_File * file, const void * buf, size_t len, uint64_t offset) {
+	if (offset > 0xFFFFFFFF)
+		return -1;
+	if (len > (0xFFFFFFFF - offset))
+		len = 0xFFFFFFFF - offset;
+	if (offset > file->entry.DIR_FileSize) {
+		uint64_t gapStart = file->entry.DIR_FileSize;										// the tail of the last cluster may hold stale bytes
+		uint32_t within = gapStart % file->bytesPerCluster;
+		if (0 != within) {
+			uint64_t gapLen = file->bytesPerCluster - within;
+			if (gapLen > (offset - gapStart))
+				gapLen = offset - gapStart;
+			uint8_t * zeros = calloc(gapLen, sizeof(uint8_t));
+			if (NULL == zeros)
+				return -1;
+			transferFileData(file, zeros, gapLen, gapStart, 1);
+			free(zeros);
+		}
+	}
+	return transferFileData(file, (uint8_t *)buf, len, offset, 1);
+}
+
+ssize_t fs_write(FS_File * file, const void * buf, size_t len) {
+	ssize_t bytesWritten = fs_pwrite(file, buf, len, file->position);
+	if (0 < bytesWritten)
+		file->position += bytesWritten;
+	return bytesWritten;
+}
+
+int64_t fs_seek(FS_File * file, int64_t offset, int whence) {
+	int64_t base = 0;
+	switch (whence) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = file->position;
+			break;
+		case SEEK_END:
+			base = file->entry.DIR_FileSize;
+			break;
+		default:
+			return -1;
+	}
+	if (0 > (base + offset))
+		return -1;
+	file->position = base + offset;
+	return file->position;
+}
+
+fs_result fs_truncate(FS_File * file, uint32_t size) {
+	FS_Instance * fsi = file->fsi;
+	uint32_t keep = (size + (file->bytesPerCluster - 1)) / file->bytesPerCluster;
+	FS_Cluster surplus = 0x00000001;
+	if (0 == keep) {
+		if (0 < file->numCheckpoints)
+			surplus = file->checkpoints[0];
+		setClusterForEntry(&(file->entry), 0);
+		file->numCheckpoints = 0;
+		file->lastCluster = 0;
+	} else {
+		FS_Cluster last = getFileClusterAtIndex(file, keep - 1);
+		if (1 == last)
+			return ERR_FILENOTFOUND;
+		surplus = getFATEntryForCluster(last, fsi);
+		if (isDataCluster(surplus, fsi))
+			setFATEntryForCluster(last, getEOFMarker(fsi), fsi);
+		uint32_t maxCheckpoints = ((keep - 1) / FILE_CHECKPOINT_INTERVAL) + 1;
+		if (file->numCheckpoints > maxCheckpoints)
+			file->numCheckpoints = maxCheckpoints;
+	}
+	freeChain(surplus, fsi);
+	if (file->reservedClusters > keep)
+		file->reservedClusters = keep;
+	if (file->entry.DIR_FileSize != size) {
+		file->entry.DIR_FileSize = size;
+		file->dirty = 1;
+	}
+	if (0 == keep)
+		file->dirty = 1;
+	return ERR_SUCCESS;
+}
+
+/*
+ * Chains enough clusters onto the file to hold len bytes past its current
+ * size, leaving DIR_FileSize alone, so writes up to there never reach the
+ * allocator. The clusters come from a single free run, looked for first
+ * after the file's tail and then anywhere; a volume with no run that long
+ * gets them one at a time instead. They are zeroed like any other extension,
+ * and whatever is still past the size at fs_close is freed again.
+ */
+fs_result fs_reserve(FS_File * file, uint32_t len) {
+	FS_Instance * fsi = file->fsi;
+	uint64_t target = (uint64_t)file->entry.DIR_FileSize + len;
+	if (target > 0xFFFFFFFF)
+		target = 0xFFFFFFFF;
+	uint32_t want = (target + (file->bytesPerCluster - 1)) / file->bytesPerCluster;
+	if ((0 == want) || (want <= file->reservedClusters))
+		return ERR_SUCCESS;
+	uint32_t have = 0;
+	if (0 < file->numCheckpoints) {
+		if (1 != getFileClusterAtIndex(file, want - 1)) {
+			file->reservedClusters = want;
+			return ERR_SUCCESS;
+		}
+		have = file->lastIndex + 1;																// the walk stopped at the tail
+	}
+	uint32_t need = want - have;
+	uint64_t end = fsi->countOfClusters + 2;
+	FS_Cluster near = (0 < have) ? (file->lastCluster + 1) : getAllocationStart(file->parentDir, fsi);
+	FS_Cluster run = scanFreeRun(near, end, need, fsi);
+	if ((1 == run) && (2 < near))
+		run = scanFreeRun(2, end, need, fsi);
+	if (1 == run) {
+		fs_result result = extendFileToIndex(file, want - 1);
+		if (ERR_SUCCESS == result)
+			file->reservedClusters = want;
+		return result;
+	}
+	zeroClusters(run, need, fsi);
+	for (uint32_t i = 0; i < need; i++)
+		setFATEntryForCluster(run + i, ((i + 1) < need) ? (run + i + 1) : getEOFMarker(fsi), fsi);
+	if (0 == have) {
+		setClusterForEntry(&(file->entry), run);
+		file->dirty = 1;
+		if (!addFileCheckpoint(file, run))
+			return ERR_MALLOCFAILED;
+		file->lastCluster = run;
+		file->lastIndex = 0;
+	} else {
+		setFATEntryForCluster(file->lastCluster, run, fsi);
+	}
+	file->reservedClusters = want;
+	return ERR_SUCCESS;
+}
+
+uint32_t fs_size(FS_File * file) {
+	return file->entry.DIR_FileSize;
+}
+
+fs_result fs_close(FS_File * file) {
+	if (NULL == file)
+		return ERR_SUCCESS;
+	if (0 < file->reservedClusters)
+		fs_truncate(file, file->entry.DIR_FileSize);											// give back what was reserved but never written
+	if (file->dirty) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		setEntryWriteTime(&(file->entry), &tv);
+		FS_Entry ent;
+		ent.filename = NULL;
+		ent.entry = &(file->entry);
+		ent.info = &(file->info);
+		updateDirEntry(&ent, file->fsi);
+	}
+	free(file->checkpoints);
+	free(file);
+	return ERR_SUCCESS;
+}
+
+struct FS_DefragStats_struct {
+	uint32_t files;
+	uint32_t moved;
+	uint32_t skipped;
+	uint64_t extentsBefore;
+	uint64_t extentsAfter;
+};
+
+void defragEntry(FS_Entry * ent, FS_FATEntry * FAT, struct FS_DefragStats_struct * stats, FS_Instance * fsi) {
+	FS_Cluster first = getClusterForEntry(ent->entry);
+	if (!isDataCluster(first, fsi))
+		return;
+	uint32_t extents = countChainExtents(first, FAT, fsi);
+	stats->files++;
+	stats->extentsBefore += extents;
+	if ((extents > 1) && (ERR_SUCCESS == relocateChain(ent, FAT, fsi))) {
+		stats->moved++;
+		extents = countChainExtents(getClusterForEntry(ent->entry), FAT, fsi);
+	} else if (extents > 1) {
+		stats->skipped++;
+	}
+	stats->extentsAfter += extents;
+}
+
+void defragDir(FS_Cluster dir, FS_FATEntry * FAT, struct FS_DefragStats_struct * stats, FS_Instance * fsi) {
+	FS_DirCache * dc = openDir(dir, fsi);
+	for (FS_EntryList * el = (NULL != dc) ? dc->listing : NULL; NULL != el; el = el->next) {
+		FS_Entry * ent = el->node;
+		if (('.' != ent->entry->DIR_Name[0]) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
+			if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY))					// directory chains stay put, '.' and '..' point at them
+				defragDir(getClusterForEntry(ent->entry), FAT, stats, fsi);
+			else
+				defragEntry(ent, FAT, stats, fsi);
+		}
+	}
+	closeDir(dc, fsi);
+}
+
+fs_result defrag(FS_Instance * fsi, FS_Directory currDir, char * path) {
+	struct FS_DefragStats_struct stats = {0, 0, 0, 0, 0};
+	FS_FATEntry * FAT = loadFATTable(fsi);
+	if (NULL == FAT)
+		return ERR_MALLOCFAILED;
+	uint8_t found = 1;
+	if (NULL == path) {
+		defragDir(fs_get_root(fsi), FAT, &stats, fsi);
+	} else {
+		FS_Directory dir = findDir(fsi, currDir, path);
+		if (0x00000001 != dir) {
+			defragDir(dir, FAT, &stats, fsi);
+		} else {
+			found = 0;
+			char * pathCopy = strdup(path);
+			char * name = (NULL != pathCopy) ? pathCopy + strlen(pathCopy) : NULL;
+			while ((NULL != name) && (name > pathCopy) && ('/' != name[-1]) && ('\\' != name[-1]))
+				name--;
+			FS_Directory parent = currDir;
+			if ((NULL != name) && (name > pathCopy)) {
+				name[-1] = '\0';																// everything before the last separator names the directory
+				parent = ('\0' != pathCopy[0]) ? findDir(fsi, currDir, pathCopy) : fs_get_root(fsi);
+			}
+			if ((NULL != name) && (0x00000001 != parent)) {
+				FS_DirCache * dc = openDir((FS_Cluster)parent, fsi);
+				FS_Entry * ent = (NULL != dc) ? findEntryByName(dc->hash, name) : NULL;
+				if ((NULL != ent) && !maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
+					found = 1;
+					defragEntry(ent, FAT, &stats, fsi);
+				}
+				closeDir(dc, fsi);
+			}
+			free(pathCopy);
+		}
+	}
+	free(FAT);
+	if (!found)
+		return ERR_FILENOTFOUND;
+	printf("Defragmented %u of %u file(s)", stats.moved, stats.files);
+	if (stats.skipped)
+		printf(", %u skipped (no contiguous free run large enough)", stats.skipped);
+	printf("\n");
+	printf("Extents before: %"PRIu64", after: %"PRIu64"\n", stats.extentsBefore, stats.extentsAfter);
+	return ERR_SUCCESS;
+}
+
+void addFragFile(FS_FragReport * report, char * path, fatEntry * entry, FS_FATEntry * FAT, FS_Instance * fsi) {
+	if (report->numFiles == report->allocFiles) {
+		uint32_t newAlloc = (0 == report->allocFiles) ? 64 : (report->allocFiles * 2);
+		FS_FragFile * files = realloc(report->files, newAlloc * sizeof(FS_FragFile));
+		if (NULL == files)
+			return;
+		report->files = files;
+		report->allocFiles = newAlloc;
+	}
+	FS_FragFile * file = &(report->files[report->numFiles++]);
+	file->path = strdup(path);
+	file->isDirectory = maskAndTest(entry->DIR_Attr, ATTR_DIRECTORY);
+	file->size = entry->DIR_FileSize;
+	getChainStats(getClusterForEntry(entry), FAT, &(file->clusters), &(file->extents), fsi);
+	report->usedClusters += file->clusters;
+	report->usedExtents += file->extents;
+	if (file->extents > 1)
+		report->fragmentedFiles++;
+}
+
+void fragDir(FS_Cluster dir, char * dirPath, FS_FragReport * report, FS_FATEntry * FAT, FS_Instance * fsi) {
+	FS_EntryList * el = getDirListing(dir, fsi);
 	while (NULL != el) {
 		FS_Entry * ent = el->node;
-		if (!found) {
+		if (('.' != ent->entry->DIR_Name[0]) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
 			char * filename = getFilenameForEntry(ent->entry);
-			if (strcmp(path, filename) == 0) {
-				found = 1;
-				deleteDirListing(currDir, ent, fsi);
+			char * path = joinPath(dirPath, filename);
+			if (NULL != path) {
+				addFragFile(report, path, ent->entry, FAT, fsi);
+				if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY))
+					fragDir(getClusterForEntry(ent->entry), path, report, FAT, fsi);
+				free(path);
 			}
 			free(filename);
 		}
@@ -436,22 +1411,171 @@ FS_Directory delete_file(FS_Instance * fsi, FS_Directory currDir, char * path) {
 		el = el->next;
 		freeFSEntryListItem(toFree);
 	}
-	if (found) {
-		return ERR_SUCCESS;
+}
+
+FS_FragReport * get_frag_report(FS_Instance * fsi) {
+	FS_FragReport * report = calloc(1, sizeof(FS_FragReport));
+	if (NULL == report)
+		return NULL;
+	FS_FATEntry * FAT = loadFATTable(fsi);
+	if (NULL == FAT) {
+		free(report);
+		return NULL;
+	}
+	fragDir(fs_get_root(fsi), "", report, FAT, fsi);
+	uint64_t runLength = 0;
+	for (FS_Cluster i = 2; i <= (fsi->countOfClusters + 2); i++) {
+		if ((i < (fsi->countOfClusters + 2)) && (0 == FAT[i])) {
+			runLength++;
+			continue;
+		}
+		if (runLength) {
+			uint8_t bucket = 0;
+			while ((bucket < (FRAG_HISTOGRAM_BUCKETS - 1)) && ((runLength >> (bucket + 1)) > 0))
+				bucket++;
+			report->freeRunHistogram[bucket]++;
+			report->freeClusters += runLength;
+			report->freeRuns++;
+			runLength = 0;
+		}
+	}
+	free(FAT);
+	return report;
+}
+
+void free_frag_report(FS_FragReport * report) {
+	if (NULL != report) {
+		for (uint32_t i = 0; i < report->numFiles; i++)
+			free(report->files[i].path);
+		free(report->files);
+		free(report);
+	}
+}
+
+int compareFragFiles(const void * a, const void * b) {
+	const FS_FragFile * fa = a;
+	const FS_FragFile * fb = b;
+	if (fa->extents != fb->extents)
+		return (fa->extents < fb->extents) ? 1 : -1;
+	return (fa->clusters < fb->clusters) ? 1 : ((fa->clusters > fb->clusters) ? -1 : 0);
+}
+
+void print_frag(FS_Instance * fsi) {
+	FS_FragReport * report = get_frag_report(fsi);
+	if (NULL == report) {
+		fprintf(stderr, "Error: Failed to allocate sufficient scratchpad RAM\n");
+		return;
+	}
+	qsort(report->files, report->numFiles, sizeof(FS_FragFile), compareFragFiles);
+	printf("\n");
+	printf("Fragmentation report:\n---------------------\n");
+	printf("Files/directories: %u (%u fragmented)\n", report->numFiles, report->fragmentedFiles);
+	printf("Clusters in use: %"PRIu64" in %"PRIu64" extent(s)", report->usedClusters, report->usedExtents);
+	if (report->usedExtents)
+		printf(", average extent length %.2f clusters", (double)report->usedClusters / report->usedExtents);
+	printf("\n");
+	printf("Free clusters: %"PRIu64" in %"PRIu64" run(s)\n", report->freeClusters, report->freeRuns);
+	printf("\n");
+	if (report->fragmentedFiles) {
+		printf("Most fragmented:\n%8s%10s  %s\n", "Extents", "Clusters", "Path");
+		for (uint32_t i = 0; (i < report->numFiles) && (i < FRAG_WORST_COUNT) && (report->files[i].extents > 1); i++)
+			printf("%8u%10u  %s%s\n", report->files[i].extents, report->files[i].clusters, report->files[i].path, report->files[i].isDirectory ? "/" : "");
+		printf("\n");
+	}
+	if (report->freeRuns) {
+		printf("Free run sizes (clusters):\n");
+		for (uint8_t i = 0; i < FRAG_HISTOGRAM_BUCKETS; i++) {
+			if (0 == report->freeRunHistogram[i])
+				continue;
+			char range[32];
+			if (0 == i)
+				sprintf(range, "1");
+			else if ((FRAG_HISTOGRAM_BUCKETS - 1) == i)
+				sprintf(range, "%u+", 1U << i);
+			else
+				sprintf(range, "%u-%u", 1U << i, (1U << (i + 1)) - 1);
+			printf("%14s: %"PRIu64"\n", range, report->freeRunHistogram[i]);
+		}
+		printf("\n");
+	}
+	free_frag_report(report);
+}
+
+uint8_t copyImageRange(int out, uint64_t start, uint64_t end, uint8_t * buf, FS_Instance * fsi) {
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	while (start < end) {
+		size_t len = ((end - start) < DEFRAG_BATCH_BYTES) ? (end - start) : DEFRAG_BATCH_BYTES;
+		readDisk(buf, len, start, fsi);
+		for (size_t done = 0; done < len; done += bytesPerCluster) {
+			size_t piece = ((len - done) < bytesPerCluster) ? (len - done) : bytesPerCluster;
+			if (!isZeroFilled(buf + done, piece) && (writeFully(out, buf + done, piece, start + done) != piece))
+				return 0;
+		}
+		start += len;
+	}
+	return 1;
+}
+
+/*
+ * Writes a standalone copy of the image, with any overlay applied, leaving
+ * holes wherever the result is all zeros. Only the regions holding data in
+ * the base and the blocks held by the overlay are read.
+ */
+fs_result flatten_image(FS_Instance * fsi, char * outPath) {
+	struct stat baseStats;
+	if (0 != fstat(fsi->disk, &baseStats))
+		return ERR_FOPENFAILEDREAD;
+	syncFATMirrors(fsi);																		// the copy gets every FAT up to date
+	uint64_t size = (fsi->totalSize > baseStats.st_size) ? fsi->totalSize : baseStats.st_size;
+	uint8_t * buf = malloc(DEFRAG_BATCH_BYTES);
+	if (NULL == buf)
+		return ERR_MALLOCFAILED;
+	int out = open(outPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (0 > out) {
+		free(buf);
+		return ERR_FOPENFAILEDWRITE;
+	}
+	uint8_t ok = (0 == ftruncate(out, size));
+	off_t dataStart = 0;
+	while (ok && (0 <= (dataStart = lseek(fsi->disk, dataStart, SEEK_DATA)))) {
+		off_t dataEnd = lseek(fsi->disk, dataStart, SEEK_HOLE);
+		if (0 > dataEnd)
+			dataEnd = baseStats.st_size;
+		ok = copyImageRange(out, dataStart, dataEnd, buf, fsi);
+		dataStart = dataEnd;
+	}
+	if (ok && (NULL != fsi->overlay))
+		ok = copyOverlayBlocks(out, size, fsi);
+	free(buf);
+	if (0 != close(out))
+		ok = 0;
+	if (!ok) {
+		unlink(outPath);
+		return ERR_NOFREESPACE;
 	}
-	return ERR_FILENOTFOUND;
+	return ERR_SUCCESS;
 }
 
 void fs_cleanup(FS_Instance * fsi) {
 	if (NULL != fsi) {
-		if (NULL != fsi->disk) {
-			fflush(fsi->disk);
-			fclose(fsi->disk);
+		if (0 <= fsi->disk) {
+			syncFATMirrors(fsi);
+			syncFSInfo(fsi);
+			syncOverlay(fsi);																	// before the index records the overlay's mtime
+			saveIndex(fsi);
+			unloadIndex(fsi);
+			dropNameIndex(fsi);
+			dropDirCache(fsi);
+			closeOverlay(fsi);
+			close(fsi->disk);
 		}
+		closeTrace(fsi);
+		free(fsi->imagePath);
 		free(fsi->bootsect);
 		free(fsi->bootsect16);
 		free(fsi->bootsect32);
 		free(fsi->fsInfo);
+		free(fsi->dirtyFATSectors);
 		free(fsi);
 	}
 }
@@ -20,6 +20,12 @@ typedef enum {
 	FS_FAT32 = 2
 } fs_type;
 
+typedef enum {
+	FS_ALLOC_FIRST_FIT = 0,																		// lowest free cluster on the volume
+	FS_ALLOC_NEXT_FIT = 1,																		// first free cluster at or after the last one handed out
+	FS_ALLOC_NEAR_DIR = 2																		// first free cluster at or after the parent directory
+} fs_alloc_policy;
+
 typedef enum {
 	ERR_SUCCESS,
 	ERR_NOFREESPACE,
@@ -29,20 +35,30 @@ typedef enum {
 	ERR_FOPENFAILEDWRITE,
 	ERR_DELETESPECIALDIR,
 	ERR_MALLOCFAILED,
-	ERR_ROOTDIRFULL
+	ERR_ROOTDIRFULL,
+	ERR_INVALIDGEOMETRY,
+	ERR_MULTIPLEMATCHES
 } fs_result;
 
 typedef uint32_t FS_Directory;
 typedef uint32_t FS_FATEntry;
 typedef uint32_t FS_Cluster;
 
+struct FS_IndexHeader_struct;
+struct FS_NameIndex_struct;
+struct FS_Overlay_struct;
+struct FS_FATOps_struct;
+struct FS_DirCache_struct;
+
 struct FS_Instance_struct {
-	FILE * disk;
+	int disk;
+	char * imagePath;
 	fs_type type;
 	fatBS * bootsect;
 	fatBS16 * bootsect16;
 	fatBS32 * bootsect32;
 	fat32FSInfo * fsInfo;
+	uint8_t fsInfoDirty;																	// FSI_Free_Count changed since the last flush
 	uint32_t FATsz;
 	uint32_t numSectors;
 	uint64_t totalSize;
@@ -50,12 +66,32 @@ struct FS_Instance_struct {
 	uint64_t dataSec;
 	uint64_t countOfClusters;
 	FS_Directory rootDirPos;
+	uint8_t useIndex;
+	struct FS_IndexHeader_struct * index;
+	uint64_t indexSize;
+	uint64_t indexGeneration;
+	uint32_t readAheadClusters;
+	struct FS_Overlay_struct * overlay;															// writes land here instead of the read-only base when set
+	uint8_t punchHoles;																			// give freed clusters back to the host filesystem
+	const struct FS_FATOps_struct * ops;														// entry handling for this FAT width
+	uint8_t activeFAT;																			// the copy read and written, 0 unless FAT32 mirroring is off
+	uint8_t mirrorFATs;																			// copy changes to the other FATs at the next flush
+	uint64_t * dirtyFATSectors;																	// bitmap of active FAT sectors changed since the last flush
+	uint32_t numDirtyFATSectors;
+	fs_alloc_policy allocPolicy;
+	FS_Cluster allocCursor;																		// where the next-fit search resumes
+	struct FS_DirCache_struct * dirCache;													// recently looked up directories, see openDir
+	struct FS_NameIndex_struct * names;															// every name on the volume, built by the first FIND
+	FILE * trace;																				// every public call is logged here while set, see fat_trace.c
 };
 
 struct FS_DirEntryInfo_struct {
 	FS_Cluster cluster;
 	uint32_t index;
 	uint8_t numEntries;
+	uint8_t lfnChecksum;
+	uint64_t lfnOffset;
+	uint64_t entryOffset;
 };
 
 struct FS_Entry_struct {
@@ -69,22 +105,125 @@ struct FS_EntryList_struct {
 	struct FS_EntryList_struct * next;
 };
 
+#define FRAG_HISTOGRAM_BUCKETS 16
+#define FRAG_WORST_COUNT 10
+
+struct FS_FragFile_struct {
+	char * path;
+	uint8_t isDirectory;
+	uint32_t size;
+	uint32_t clusters;
+	uint32_t extents;
+};
+
+struct FS_FragReport_struct {
+	struct FS_FragFile_struct * files;
+	uint32_t numFiles;
+	uint32_t allocFiles;
+	uint32_t fragmentedFiles;
+	uint64_t usedClusters;
+	uint64_t usedExtents;
+	uint64_t freeClusters;
+	uint64_t freeRuns;
+	uint64_t freeRunHistogram[FRAG_HISTOGRAM_BUCKETS];									// bucket i counts free runs of 2^i to 2^(i+1)-1 clusters
+};
+
+typedef enum {
+	DIR_SORT_NONE,
+	DIR_SORT_NAME,
+	DIR_SORT_SIZE,
+	DIR_SORT_DATE
+} fs_dir_sort;
+
+#define DIR_ARG_SORT "--sort"
+#define DIR_ARG_REVERSE "--reverse"
+#define DIR_ARG_LIMIT "--limit"
+#define DIR_ARG_OFFSET "--offset"
+#define DIR_ARG_RAW "--raw"
+#define DIR_OUTPUT_BYTES (64 * 1024)
+#define DIR_LINE_BYTES 512																		// longest formatted line, a 255 character LFN included
+
+struct FS_DirOptions_struct {
+	char * pattern;																				// NULL lists everything
+	fs_dir_sort sort;
+	uint8_t reverse;
+	uint32_t offset;
+	uint32_t limit;																				// 0 for no limit
+	uint8_t machineReadable;
+};
+
+#define FILE_CHECKPOINT_INTERVAL 64
+#define PUT_BUFFER_BYTES (64 * 1024)
+#define PUT_RESERVE_MAX_BYTES (32 * 1024 * 1024)												// largest run a streamed PUT reserves at once
+#define PUT_STDIN "-"																			// local path that stands for standard input
+#define GET_STDOUT "-"																			// GET destination that stands for standard output
+#define GET_FD_PREFIX "&"																		// GET destination '&n' writes to descriptor n
+#define GET_STREAM_BYTES (1024 * 1024)															// largest run GET moves to a stream at once
+
+struct FS_File_struct {
+	struct FS_Instance_struct * fsi;
+	fatEntry entry;
+	struct FS_DirEntryInfo_struct info;
+	FS_Cluster parentDir;																	// directory the entry is in, 0 for a FAT12/16 root
+	uint64_t position;
+	uint32_t bytesPerCluster;
+	FS_Cluster lastCluster;																	// most recently resolved cluster, 0 if none
+	uint32_t lastIndex;
+	FS_Cluster * checkpoints;																	// cluster at every FILE_CHECKPOINT_INTERVAL'th index
+	uint32_t numCheckpoints;
+	uint32_t allocCheckpoints;
+	uint32_t reservedClusters;																	// chain length fs_reserve made sure of, 0 if never called
+	uint8_t dirty;
+};
+
 typedef struct FS_Instance_struct FS_Instance;
 typedef struct FS_DirEntryInfo_struct FS_DirEntryInfo;
 typedef struct FS_Entry_struct FS_Entry;
 typedef struct FS_EntryList_struct FS_EntryList;
+typedef struct FS_File_struct FS_File;
+typedef struct FS_FragFile_struct FS_FragFile;
+typedef struct FS_FragReport_struct FS_FragReport;
+typedef struct FS_DirOptions_struct FS_DirOptions;
 
-FS_Instance * fs_create_instance(char * imagePath);
+FS_Instance * fs_create_instance(char * imagePath, char * overlayPath);
 FS_Directory fs_get_root(FS_Instance * fsi);
+void fs_enable_index(FS_Instance * fsi, uint8_t enable);
+void fs_set_readahead(FS_Instance * fsi, uint32_t clusters);
+void fs_set_punch_holes(FS_Instance * fsi, uint8_t enable);
+void fs_set_alloc_policy(FS_Instance * fsi, fs_alloc_policy policy);
+void fs_flush(FS_Instance * fsi);
 
 void print_info(FS_Instance * fsi);
-void print_dir(FS_Instance * fsi, FS_Directory currDir);
+uint8_t parse_dir_options(char * args, FS_DirOptions * options);
+void print_dir(FS_Instance * fsi, FS_Directory currDir, FS_DirOptions * options);
+void fprint_dir(FILE * stream, FS_Instance * fsi, FS_Directory currDir, FS_DirOptions * options);
 FS_Directory change_dir(FS_Instance * fsi, FS_Directory currDir, char * path);
 fs_result get_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath);
 fs_result put_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath);
+fs_result append_file(FS_Instance * fsi, FS_Directory currDir, char * path, char * localPath);
 fs_result make_dir(FS_Instance * fsi, FS_Directory currDir, char * path);
-FS_Directory delete_file(FS_Instance * fsi, FS_Directory currDir, char * path);
+fs_result delete_file(FS_Instance * fsi, FS_Directory currDir, char * path);
+fs_result fs_open(FS_Instance * fsi, FS_Directory currDir, char * path, FS_File ** file);
+fs_result fs_create(FS_Instance * fsi, FS_Directory currDir, char * path, FS_File ** file);
+ssize_t fs_read(FS_File * file, void * buf, size_t len);
+ssize_t fs_pread(FS_File * file, void * buf, size_t len, uint64_t offset);
+ssize_t fs_write(FS_File * file, const void * buf, size_t len);
+ssize_t fs_pwrite(FS_File * file, const void * buf, size_t len, uint64_t offset);
+int64_t fs_seek(FS_File * file, int64_t offset, int whence);
+fs_result fs_truncate(FS_File * file, uint32_t size);
+fs_result fs_reserve(FS_File * file, uint32_t len);
+uint32_t fs_size(FS_File * file);
+fs_result fs_close(FS_File * file);
+fs_result defrag(FS_Instance * fsi, FS_Directory currDir, char * path);
+FS_FragReport * get_frag_report(FS_Instance * fsi);
+void free_frag_report(FS_FragReport * report);
+void print_frag(FS_Instance * fsi);
 
+fs_result flatten_image(FS_Instance * fsi, char * outPath);
 void fs_cleanup(FS_Instance * fsi);
 
+/* change_dir and delete_file without the trace line, for lookups and cleanup nobody asked for */
+FS_Directory findDir(FS_Instance * fsi, FS_Directory currDir, char * path);
+fs_result deleteItems(FS_Instance * fsi, FS_Directory currDir, char * path);
+
 #endif
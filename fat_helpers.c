@@ -1,122 +1,241 @@
+#define _GNU_SOURCE																				// FNM_CASEFOLD
+#include <fcntl.h>
+#include <fnmatch.h>
 #include "fat_helpers.h"
+#include "fat_index.h"
+#include "fat_names.h"
+#include "fat_overlay.h"
+#include "fat_ops.h"
 
 uint64_t calcFATOffset(FS_Cluster cluster, FS_Instance * fsi) {
-	switch (fsi->type) {
-		case FS_FAT12:
-			return cluster + (cluster / 2);
-		case FS_FAT16:
-			return cluster * 2;
-		case FS_FAT32:
-			return cluster * 4;
+	return ((uint64_t)cluster * fsi->ops->bits) / 8;
+}
+
+uint64_t getFATCopyOffset(uint8_t copy, FS_Instance * fsi) {
+	return ((uint64_t)fsi->bootsect->BPB_RsvdSecCnt + ((uint64_t)copy * fsi->FATsz)) * fsi->bootsect->BPB_BytsPerSec;
+}
+
+uint64_t getFATStart(FS_Instance * fsi) {
+	return getFATCopyOffset(fsi->activeFAT, fsi);
+}
+
+/*
+ * Entry updates only go to the active FAT; the sectors they touch are
+ * recorded here and copied to the other FATs by syncFATMirrors. Returns 0 if
+ * there is nowhere to record them, in which case the caller mirrors the
+ * write itself.
+ */
+uint8_t markFATDirty(uint64_t entOffset, uint64_t len, FS_Instance * fsi) {
+	if (!fsi->mirrorFATs)
+		return 1;
+	if (NULL == fsi->dirtyFATSectors) {
+		fsi->dirtyFATSectors = calloc(((uint64_t)fsi->FATsz + 63) / 64, sizeof(uint64_t));
+		if (NULL == fsi->dirtyFATSectors)
+			return 0;
+	}
+	uint16_t bps = fsi->bootsect->BPB_BytsPerSec;
+	for (uint64_t sector = entOffset / bps; (sector <= ((entOffset + len - 1) / bps)) && (sector < fsi->FATsz); sector++) {
+		uint64_t bit = 1ULL << (sector % 64);
+		if (0 == (fsi->dirtyFATSectors[sector / 64] & bit)) {
+			fsi->dirtyFATSectors[sector / 64] |= bit;
+			fsi->numDirtyFATSectors++;
+		}
+	}
+	return 1;
+}
+
+void clearFATDirty(FS_Instance * fsi) {
+	if (NULL != fsi->dirtyFATSectors)
+		memset(fsi->dirtyFATSectors, 0, (((uint64_t)fsi->FATsz + 63) / 64) * sizeof(uint64_t));
+	fsi->numDirtyFATSectors = 0;
+}
+
+/*
+ * Copies every dirty sector of the active FAT to the other copies, walking
+ * the bitmap in order so each run of adjacent sectors is read once and
+ * written to each mirror as one request.
+ */
+void syncFATMirrors(FS_Instance * fsi) {
+	if (0 == fsi->numDirtyFATSectors)
+		return;
+	uint16_t bps = fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * run = malloc((uint64_t)FAT_SYNC_BATCH_SECTORS * bps);
+	if (NULL == run)
+		return;																					// still dirty, tried again at the next flush
+	for (uint64_t sector = 0; sector < fsi->FATsz; ) {
+		uint64_t word = fsi->dirtyFATSectors[sector / 64] >> (sector % 64);
+		if (0 == word) {
+			sector = ((sector / 64) + 1) * 64;
+			continue;
+		}
+		sector += __builtin_ctzll(word);
+		uint64_t start = sector;
+		while ((sector < fsi->FATsz) && ((sector - start) < FAT_SYNC_BATCH_SECTORS) && (0 != (fsi->dirtyFATSectors[sector / 64] & (1ULL << (sector % 64))))) {
+			fsi->dirtyFATSectors[sector / 64] &= ~(1ULL << (sector % 64));
+			sector++;
+		}
+		uint64_t bytes = (sector - start) * bps;
+		readDisk(run, bytes, getFATStart(fsi) + (start * bps), fsi);
+		for (uint8_t i = 0; i < fsi->bootsect->BPB_NumFATs; i++)
+			if (i != fsi->activeFAT)
+				writeDisk(run, bytes, getFATCopyOffset(i, fsi) + (start * bps), fsi);
 	}
-	return 0xFFFFFFFFFFFFFFFF;
+	fsi->numDirtyFATSectors = 0;
+	free(run);
 }
 
-uint32_t getFATSectorNum(FS_Cluster cluster, FS_Instance * fsi) {
-	return (fsi->bootsect->BPB_RsvdSecCnt + (calcFATOffset(cluster, fsi) / fsi->bootsect->BPB_BytsPerSec));
+size_t readFully(int fd, void * buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t bytesRead = pread(fd, ((uint8_t *)buf) + done, len - done, offset + done);
+		if (0 >= bytesRead)
+			break;
+		done += bytesRead;
+	}
+	return done;
 }
 
-uint32_t getFATEntryOffset(FS_Cluster cluster, FS_Instance * fsi) {
-	return (calcFATOffset(cluster, fsi) % fsi->bootsect->BPB_BytsPerSec);
+size_t writeFully(int fd, const void * buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t bytesWritten = pwrite(fd, ((const uint8_t *)buf) + done, len - done, offset + done);
+		if (0 >= bytesWritten)
+			break;
+		done += bytesWritten;
+	}
+	return done;
+}
+
+size_t readDisk(void * buf, size_t len, uint64_t offset, FS_Instance * fsi) {
+	if (NULL != fsi->overlay)
+		return readOverlay(buf, len, offset, fsi);
+	size_t done = readFully(fsi->disk, buf, len, offset);
+	if (done < len)
+		memset(((uint8_t *)buf) + done, 0, len - done);									// past the end of the image reads as zeros
+	return done;
+}
+
+size_t writeDisk(const void * buf, size_t len, uint64_t offset, FS_Instance * fsi) {
+	if (NULL != fsi->overlay)
+		return writeOverlay(buf, len, offset, fsi);
+	return writeFully(fsi->disk, buf, len, offset);
+}
+
+uint8_t isZeroFilled(const uint8_t * buf, size_t len) {
+	return (0 == len) || ((0 == buf[0]) && (0 == memcmp(buf, buf + 1, len - 1)));
+}
+
+int getImageDescriptor(FS_Instance * fsi) {
+	return (NULL != fsi->overlay) ? fsi->overlay->fd : fsi->disk;						// the file whose changes track the image's
 }
 
 uint64_t getFirstSectorOfCluster(FS_Cluster cluster, FS_Instance * fsi) {
-	return (((cluster - 2) * fsi->bootsect->BPB_SecPerClus) + fsi->dataSec);
+	return (((uint64_t)(cluster - 2) * fsi->bootsect->BPB_SecPerClus) + fsi->dataSec);
+}
+
+uint64_t getClusterOffset(FS_Cluster cluster, FS_Instance * fsi) {
+	return getFirstSectorOfCluster(cluster, fsi) * fsi->bootsect->BPB_BytsPerSec;
 }
 
+FS_FATEntry decodeFATEntry(uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster, FS_Instance * fsi) {
+	return fsi->ops->decode(FAT, entOffset, cluster);
+}
+
+/*
+ * Single entries are read and written in place, only the two or four bytes
+ * that hold them; a FAT12 entry straddling two sectors needs no special case.
+ */
 FS_FATEntry getFATEntryForCluster(FS_Cluster cluster, FS_Instance * fsi) {
-	uint32_t sectorNum = getFATSectorNum(cluster, fsi);
-	uint32_t entOffset = getFATEntryOffset(cluster, fsi);
-	uint32_t bytesToRead = fsi->bootsect->BPB_BytsPerSec;
-	if ((fsi->type == FS_FAT12) && (entOffset == (fsi->bootsect->BPB_BytsPerSec - 1)) && !((sectorNum - fsi->bootsect->BPB_RsvdSecCnt) == (fsi->FATsz - 1))) {
-		bytesToRead *= 2;
-	}
-	uint8_t * FATSector = malloc(bytesToRead);
-	if (NULL == FATSector)
-		return 0;
-	fseek(fsi->disk, (sectorNum * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-	fread(FATSector, bytesToRead, 1, fsi->disk);
-	FS_FATEntry entry = 0xFFFFFFFF;
-	switch (fsi->type) {
-		case FS_FAT12:
-			if (cluster % 2)
-				entry = ((*((uint16_t *)&FATSector[entOffset])) >> 4);
-			else
-				entry = ((*((uint16_t *)&FATSector[entOffset])) & 0x0FFF);
-			break;
-		case FS_FAT16:
-			entry = (*((uint16_t *)&FATSector[entOffset]));
-			break;
-		case FS_FAT32:
-			entry = ((*((uint32_t *)&FATSector[entOffset])) & 0x0FFFFFFF);
-			break;
+	uint64_t entOffset = calcFATOffset(cluster, fsi);
+	uint64_t FATStart = getFATStart(fsi);
+	uint8_t bytes[4];
+	readDisk(bytes, fsi->ops->entryBytes, FATStart + entOffset, fsi);
+	return fsi->ops->decode(bytes, 0, cluster);
+}
+
+/*
+ * Chain walks read the whole FAT sector holding the first entry and follow
+ * the links that stay inside it, up to max of them. Returns how many
+ * successors were stored in next, at least one.
+ */
+uint32_t walkFATChain(FS_Cluster cluster, FS_Cluster * next, uint32_t max, FS_Instance * fsi) {
+	uint64_t bytesPerSector = fsi->bootsect->BPB_BytsPerSec;
+	if (bytesPerSector > FAT_WALK_MAX_SECTOR) {
+		next[0] = getFATEntryForCluster(cluster, fsi);
+		return 1;
 	}
-	free(FATSector);
-	return entry;
+	uint8_t sector[FAT_WALK_MAX_SECTOR + 4];
+	uint64_t base = (calcFATOffset(cluster, fsi) / bytesPerSector) * bytesPerSector;
+	uint64_t len = bytesPerSector + fsi->ops->entryBytes;									// a FAT12 entry can run into the next sector
+	readDisk(sector, len, getFATStart(fsi) + base, fsi);
+	return fsi->ops->walk(sector, base, len, cluster, fsi->countOfClusters + 2, next, max);
 }
 
-void setFATEntryForCluster(FS_Cluster cluster, FS_FATEntry entry, FS_Instance * fsi) {
-	uint32_t sectorNum = getFATSectorNum(cluster, fsi);
-	uint32_t entOffset = getFATEntryOffset(cluster, fsi);
-	uint32_t bytesToRead = fsi->bootsect->BPB_BytsPerSec;
-	if ((fsi->type == FS_FAT12) && (entOffset == (fsi->bootsect->BPB_BytsPerSec - 1)) && !((sectorNum - fsi->bootsect->BPB_RsvdSecCnt) == (fsi->FATsz - 1))) {
-		bytesToRead *= 2;
-	}
-	uint8_t * FATSector = malloc(bytesToRead);
-	if (NULL == FATSector)
+void encodeFATEntry(uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster, FS_FATEntry entry, FS_Instance * fsi) {
+	fsi->ops->encode(FAT, entOffset, cluster, entry);
+}
+
+/*
+ * Keeps a FAT32 volume's FSInfo free cluster count in step with a FAT entry
+ * going from free to used or back. A count of 0xFFFFFFFF means unknown and is
+ * left that way; the sector itself is written at the next flush.
+ */
+void adjustFreeCount(FS_FATEntry old, FS_FATEntry entry, FS_Instance * fsi) {
+	if ((NULL == fsi->fsInfo) || (0x41615252 != fsi->fsInfo->FSI_LeadSig) || (0xFFFFFFFF == fsi->fsInfo->FSI_Free_Count) || ((0 == old) == (0 == entry)))
 		return;
-	fseek(fsi->disk, (sectorNum * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-	fread(FATSector, bytesToRead, 1, fsi->disk);
-	switch (fsi->type) {
-		case FS_FAT12:
-			if (cluster % 2) {
-				(*((uint16_t *)&FATSector[entOffset])) &= 0x000F;
-				entry <<= 4;
-			} else {
-				(*((uint16_t *)&FATSector[entOffset])) &= 0xF000;
-				entry &= 0x0FFF;
-			}
-			(*((uint16_t *)&FATSector[entOffset])) |= entry;
-			break;
-		case FS_FAT16:
-			(*((uint16_t *)&FATSector[entOffset])) = entry;
-			break;
-		case FS_FAT32:
-			(*((uint32_t *)&FATSector[entOffset])) &= 0xF0000000;
-			(*((uint32_t *)&FATSector[entOffset])) |= entry & 0x0FFFFFFF;
-			break;
-	}
-	fseek(fsi->disk, (sectorNum * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-	fwrite(FATSector, bytesToRead, 1, fsi->disk);
-	free(FATSector);
+	if (0 == entry)
+		fsi->fsInfo->FSI_Free_Count++;
+	else
+		fsi->fsInfo->FSI_Free_Count--;
+	fsi->fsInfoDirty = 1;
+}
+
+void syncFSInfo(FS_Instance * fsi) {
+	if (!fsi->fsInfoDirty)
+		return;
+	writeDisk(fsi->fsInfo, sizeof(fat32FSInfo), (uint64_t)fsi->bootsect32->BPB_FSInfo * fsi->bootsect->BPB_BytsPerSec, fsi);
+	fsi->fsInfoDirty = 0;
+}
+
+void setFATEntryForCluster(FS_Cluster cluster, FS_FATEntry entry, FS_Instance * fsi) {
+	uint64_t entOffset = calcFATOffset(cluster, fsi);
+	uint64_t FATStart = getFATStart(fsi);
+	uint8_t bytes[4];
+	readDisk(bytes, fsi->ops->entryBytes, FATStart + entOffset, fsi);
+	adjustFreeCount(fsi->ops->decode(bytes, 0, cluster), entry, fsi);
+	fsi->ops->encode(bytes, 0, cluster, entry);
+	invalidateIndex(fsi);
+	dropDirCache(fsi);
+	writeDisk(bytes, fsi->ops->entryBytes, FATStart + entOffset, fsi);
+	if (!markFATDirty(entOffset, fsi->ops->entryBytes, fsi))
+		for (uint8_t i = 0; i < fsi->bootsect->BPB_NumFATs; i++)
+			if (i != fsi->activeFAT)
+				writeDisk(bytes, fsi->ops->entryBytes, getFATCopyOffset(i, fsi) + entOffset, fsi);
 }
 
 FS_FATEntry getEOFMarker(FS_Instance * fsi) {
-	switch (fsi->type) {
-		case FS_FAT12:
-			return 0x00000FF8;
-		case FS_FAT16:
-			return 0x0000FFF8;
-		case FS_FAT32:
-			return 0x0FFFFFF8;
-	}
-	return 0xFFFFFFFF;
+	return fsi->ops->eofMarker;
 }
 
 uint8_t isFATEntryEOF(FS_FATEntry entry, FS_Instance * fsi) {
-	return (entry >= getEOFMarker(fsi));
+	return (entry >= fsi->ops->eofMarker);
 }
 
 uint8_t isFATEntryBad(FS_FATEntry entry, FS_Instance * fsi) {
-	switch (fsi->type) {
-		case FS_FAT12:
-			return (entry == 0x0FF7);
-		case FS_FAT16:
-			return (entry == 0xFFF7);
-		case FS_FAT32:
-			return (entry == 0x0FFFFFF7);
-	}
-	return 0xFF;
+	return (entry == fsi->ops->badMarker);
+}
+
+uint8_t isDataCluster(FS_Cluster cluster, FS_Instance * fsi) {
+	return (cluster >= 2) && (cluster < (fsi->countOfClusters + 2));
+}
+
+FS_Cluster getClusterForEntry(fatEntry * entry) {
+	return ((((FS_Cluster)entry->DIR_FstClusHI) << 16) | entry->DIR_FstClusLO) & 0x0FFFFFFF;		// FAT32 cluster numbers are 28 bits
+}
+
+void setClusterForEntry(fatEntry * entry, FS_Cluster cluster) {
+	entry->DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+	entry->DIR_FstClusLO = cluster & 0xFFFF;
 }
 
 uint8_t maskAndTest(uint8_t val, uint8_t mask) { return (val & mask) == mask; }
@@ -170,6 +289,257 @@ uint8_t isValidFilenameChar(char c, uint8_t isLongFilename) {
 	}
 }
 
+char * getFilenameForEntry(fatEntry * ent) {
+	char * filename = malloc(sizeof(char) * (DIR_Name_LENGTH + 2));
+	if (NULL != filename)
+		formatShortName(ent, filename);
+	return filename;
+}
+
+void formatShortName(fatEntry * ent, char * filename) {
+	int i = 0, j = 0;
+	while (j < DIR_Name_LENGTH) {
+		if (0x20 <= ent->DIR_Name[j]) {
+			uint8_t isPadding = 1;
+			for (int k = j; k < ((j < 8) ? 8 : 11); k++) {
+				if (' ' != ent->DIR_Name[k]) {
+					isPadding = 0;
+					break;
+				}
+			}
+			if (!isPadding)
+				filename[i++] = ent->DIR_Name[j];
+		}
+		if ((7 == j) && (' ' != ent->DIR_Name[8]))
+			filename[i++] = '.';
+		j++;
+	}
+	filename[i] = '\0';
+}
+
+char * getDisplayNameForEntry(FS_Entry * ent) {
+	if (NULL == ent->filename)
+		return getFilenameForEntry(ent->entry);
+	uint32_t length = 0;
+	while (0x0000 != ent->filename[length])
+		length++;
+	char * filename = malloc(sizeof(char) * (length + 1));
+	if (NULL != filename) {
+		for (uint32_t i = 0; i < length; i++)
+			filename[i] = ent->filename[i] & 0x00FF;
+		filename[length] = '\0';
+	}
+	return filename;
+}
+
+uint8_t hasWildcards(char * pattern) {
+	return (NULL != strpbrk(pattern, "*?["));
+}
+
+uint8_t entryMatchesPattern(FS_Entry * ent, char * pattern) {
+	char * filename = getFilenameForEntry(ent->entry);
+	uint8_t matches = (NULL != filename) && (0 == fnmatch(pattern, filename, FNM_CASEFOLD));
+	free(filename);
+	if (!matches && (NULL != ent->filename)) {
+		filename = getDisplayNameForEntry(ent);
+		matches = (NULL != filename) && (0 == fnmatch(pattern, filename, FNM_CASEFOLD));
+		free(filename);
+	}
+	return matches;
+}
+
+uint8_t packShortName(char * name, uint8_t * shortName) {
+	memset(shortName, ' ', DIR_Name_LENGTH);
+	if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+		memcpy(shortName, name, strlen(name));
+		return 1;
+	}
+	uint8_t j = 0, inExtension = 0;
+	for (char * c = name; '\0' != *c; c++) {
+		if ('.' == *c) {
+			if (inExtension || (0 == j))
+				return 0;
+			inExtension = 1;
+			j = 8;
+			continue;
+		}
+		char upper = toupper(*c);
+		if ((' ' == upper) || !isValidFilenameChar(upper, 0) || (j == (inExtension ? DIR_Name_LENGTH : 8)))
+			return 0;																			// not a plain 8.3 name
+		shortName[j++] = upper;
+	}
+	return (0 < j);
+}
+
+uint32_t hashDirName(const uint8_t * name, uint32_t length, uint8_t fold) {
+	uint32_t hash = 0x811C9DC5;
+	for (uint32_t i = 0; i < length; i++) {
+		hash ^= fold ? tolower(name[i]) : name[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+uint32_t hashLongName(uint16_t * filename) {
+	uint32_t hash = 0x811C9DC5;
+	for (uint32_t i = 0; 0x0000 != filename[i]; i++) {
+		hash ^= tolower(filename[i] & 0x00FF);
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+uint8_t longNameEquals(uint16_t * filename, char * name) {
+	uint32_t i = 0;
+	while ((0x0000 != filename[i]) && (tolower(filename[i] & 0x00FF) == tolower((uint8_t)name[i])))
+		i++;
+	return (0x0000 == filename[i]) && ('\0' == name[i]);
+}
+
+FS_DirHash * buildDirHash(FS_EntryList * listing) {
+	FS_DirHash * hash = calloc(1, sizeof(FS_DirHash));
+	if (NULL == hash)
+		return NULL;
+	uint32_t count = 0;
+	for (FS_EntryList * item = listing; NULL != item; item = item->next)
+		count++;
+	hash->size = 16;
+	while (hash->size < (count * 2))															// keep the load factor at or under a half
+		hash->size *= 2;
+	hash->longSlots = calloc(hash->size, sizeof(FS_Entry *));
+	hash->shortSlots = calloc(hash->size, sizeof(FS_Entry *));
+	if ((NULL == hash->longSlots) || (NULL == hash->shortSlots)) {
+		freeDirHash(hash);
+		return NULL;
+	}
+	uint32_t mask = hash->size - 1;
+	for (FS_EntryList * item = listing; NULL != item; item = item->next) {
+		FS_Entry * ent = item->node;
+		if (maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID))
+			continue;
+		uint32_t slot = hashDirName(ent->entry->DIR_Name, DIR_Name_LENGTH, 0) & mask;
+		while ((NULL != hash->shortSlots[slot]) && (0 != memcmp(hash->shortSlots[slot]->entry->DIR_Name, ent->entry->DIR_Name, DIR_Name_LENGTH)))
+			slot = (slot + 1) & mask;
+		if (NULL == hash->shortSlots[slot])
+			hash->shortSlots[slot] = ent;														// the first of any duplicates wins, as a linear scan would
+		if (NULL == ent->filename)
+			continue;
+		slot = hashLongName(ent->filename) & mask;
+		while (NULL != hash->longSlots[slot])
+			slot = (slot + 1) & mask;
+		hash->longSlots[slot] = ent;
+	}
+	return hash;
+}
+
+FS_Entry * findEntryByShortName(FS_DirHash * hash, uint8_t * shortName) {
+	uint32_t mask = hash->size - 1;
+	for (uint32_t slot = hashDirName(shortName, DIR_Name_LENGTH, 0) & mask; NULL != hash->shortSlots[slot]; slot = (slot + 1) & mask) {
+		if (0 == memcmp(hash->shortSlots[slot]->entry->DIR_Name, shortName, DIR_Name_LENGTH))
+			return hash->shortSlots[slot];
+	}
+	return NULL;
+}
+
+FS_Entry * findEntryByName(FS_DirHash * hash, char * name) {
+	uint32_t mask = hash->size - 1;
+	for (uint32_t slot = hashDirName((uint8_t *)name, strlen(name), 1) & mask; NULL != hash->longSlots[slot]; slot = (slot + 1) & mask) {
+		if (longNameEquals(hash->longSlots[slot]->filename, name))
+			return hash->longSlots[slot];
+	}
+	uint8_t shortName[DIR_Name_LENGTH];
+	if (packShortName(name, shortName))
+		return findEntryByShortName(hash, shortName);
+	return NULL;
+}
+
+void freeDirHash(FS_DirHash * hash) {
+	if (NULL != hash) {
+		free(hash->longSlots);
+		free(hash->shortSlots);
+	}
+	free(hash);
+}
+
+void freeDirCacheItem(FS_DirCache * dc) {
+	freeDirHash(dc->hash);
+	while (NULL != dc->listing) {
+		FS_EntryList * toFree = dc->listing;
+		dc->listing = dc->listing->next;
+		freeFSEntryListItem(toFree);
+	}
+	free(dc);
+}
+
+/* Frees the idle cached directories after the first keep, leaving busy ones to their last closeDir */
+void trimDirCache(uint32_t keep, FS_Instance * fsi) {
+	FS_DirCache ** link = &(fsi->dirCache);
+	for (uint32_t seen = 0; NULL != *link; seen++) {
+		FS_DirCache * dc = *link;
+		if (seen < keep) {
+			link = &(dc->next);
+		} else if (0 < dc->users) {
+			dc->stale = 1;
+			link = &(dc->next);
+		} else {
+			*link = dc->next;
+			freeDirCacheItem(dc);
+		}
+	}
+}
+
+/*
+ * Listing and name hash of dir, reused from an earlier lookup when nothing
+ * has been written since. The entries stay valid until the matching closeDir
+ * even if a write drops the cache in the meantime.
+ */
+FS_DirCache * openDir(FS_Cluster dir, FS_Instance * fsi) {
+	FS_DirCache ** link = &(fsi->dirCache);
+	while ((NULL != *link) && ((*link)->stale || ((*link)->dir != dir)))
+		link = &((*link)->next);
+	FS_DirCache * dc = *link;
+	if (NULL != dc) {
+		*link = dc->next;																		// back to the front, the tail goes first
+	} else {
+		dc = calloc(1, sizeof(FS_DirCache));
+		if (NULL == dc)
+			return NULL;
+		dc->dir = dir;
+		dc->listing = getDirListing(dir, fsi);
+		dc->hash = buildDirHash(dc->listing);
+		if (NULL == dc->hash) {
+			freeDirCacheItem(dc);
+			return NULL;
+		}
+	}
+	dc->next = fsi->dirCache;
+	fsi->dirCache = dc;
+	dc->users++;
+	trimDirCache(DIR_CACHE_SIZE, fsi);
+	return dc;
+}
+
+void closeDir(FS_DirCache * dc, FS_Instance * fsi) {
+	if ((NULL == dc) || (0 < --(dc->users)) || !dc->stale)
+		return;
+	FS_DirCache ** link = &(fsi->dirCache);
+	while (*link != dc)
+		link = &((*link)->next);
+	*link = dc->next;
+	freeDirCacheItem(dc);
+}
+
+void dropDirCache(FS_Instance * fsi) {
+	trimDirCache(0, fsi);
+}
+
+char * joinPath(char * parent, char * name) {
+	char * path = malloc(strlen(parent) + strlen(name) + 2);
+	if (NULL != path)
+		sprintf(path, "%s/%s", parent, name);
+	return path;
+}
+
 uint16_t getLongNameLetterAtPos(int pos, fatLongName * ln) {
 	uint16_t letter = 0x0000;
 	if (pos < LDIR_Name1_LENGTH) {
@@ -212,6 +582,13 @@ uint8_t isSpecialRootDir(FS_Cluster dir, FS_Instance * fsi) {
 }
 
 FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi) {
+	FS_EntryList * listing;
+	if (getDirListingFromIndex(dir, &listing, fsi))
+		return listing;
+	return getDirListingWithFAT(dir, NULL, fsi);
+}
+
+FS_EntryList * getDirListingWithFAT(FS_Cluster dir, FS_FATEntry * FAT, FS_Instance * fsi) {
 	uint8_t specialRootDir = isSpecialRootDir(dir, fsi);
 	uint32_t bytesPerCluster = ((!specialRootDir) ? fsi->bootsect->BPB_SecPerClus : 1) * fsi->bootsect->BPB_BytsPerSec;
 	uint32_t entriesPerCluster = bytesPerCluster / sizeof(fatEntry);
@@ -222,14 +599,23 @@ FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi) {
 	FS_DirEntryInfo * info = NULL;
 	FS_EntryList * listHead = NULL;
 	FS_EntryList * listTail = NULL;
-	if (specialRootDir)
+	FS_ChainReader * chain = NULL;
+	if (specialRootDir) {
 		dir = fsi->rootDirPos;
-	do {
+		adviseDisk((uint64_t)dir * fsi->bootsect->BPB_BytsPerSec, fsi->rootDirSectors * fsi->bootsect->BPB_BytsPerSec, fsi);
+	} else {
+		chain = openChainReader(dir, FAT, fsi);
+		if (NULL == chain) {
+			free(entries);
+			return NULL;
+		}
+		dir = nextChainCluster(chain, fsi);
+	}
+	while (specialRootDir ? (dir < (fsi->rootDirPos + fsi->rootDirSectors)) : isDataCluster(dir, fsi)) {
 		uint64_t seekTo = dir;
 		if (!specialRootDir)
 			seekTo = getFirstSectorOfCluster(dir, fsi);
-		fseek(fsi->disk, (seekTo * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-		fread(entries, sizeof(fatEntry), entriesPerCluster, fsi->disk);
+		readDisk(entries, bytesPerCluster, seekTo * fsi->bootsect->BPB_BytsPerSec, fsi);
 		for (int i = 0; i < entriesPerCluster; i++) {
 			fatEntry * entry = &(entries[i]);
 			if (0x00 == entry->DIR_Name[0])
@@ -246,6 +632,8 @@ FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi) {
 					info->cluster = dir;
 					info->index = i;
 					info->numEntries = (ln->LDIR_Ord & ~(LAST_LONG_ENTRY)) + 1;
+					info->lfnChecksum = ln->LDIR_Chksum;
+					info->lfnOffset = (seekTo * fsi->bootsect->BPB_BytsPerSec) + (i * sizeof(fatEntry));
 				}
 				if ((NULL == longName) || (NULL == info))
 					return NULL;															// should do some cleanup here
@@ -292,9 +680,12 @@ FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi) {
 					info->cluster = dir;
 					info->index = i;
 					info->numEntries = 1;
+					info->lfnChecksum = 0;
+					info->lfnOffset = 0;
 				}
 				if (NULL == info)
 					return NULL;															// should do some cleanup here
+				info->entryOffset = (seekTo * fsi->bootsect->BPB_BytsPerSec) + (i * sizeof(fatEntry));
 				listEntry->node->info = info;
 				info = NULL;
 				listEntry->next = NULL;
@@ -305,11 +696,12 @@ FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi) {
 					listHead = listEntry;
 			}
 		}
-		if (!specialRootDir)
-			dir = getFATEntryForCluster(dir, fsi);
-		else
+		if (specialRootDir)
 			dir++;
-	} while (specialRootDir ? (dir < (fsi->rootDirPos + fsi->rootDirSectors)) : !isFATEntryEOF(dir, fsi));
+		else
+			dir = nextChainCluster(chain, fsi);
+	}
+	closeChainReader(chain);
 	free(entries);
 	return listHead;
 }
@@ -322,13 +714,104 @@ void freeFSEntryListItem(FS_EntryList * toFree) {
 	free(toFree);
 }
 
-FS_Cluster getNextFreeCluster(FS_Instance * fsi) {
-	for (FS_Cluster i = 0; i < fsi->countOfClusters; i++) {
-		if (getFATEntryForCluster(i+2, fsi) == 0) {
-			return i+2;
+/* Lowest free cluster in [first, end), or 0x00000001 if there is none */
+FS_Cluster findFreeCluster(FS_Cluster first, uint64_t end, FS_Instance * fsi) {
+	if (NULL != fsi->index)
+		return getNextFreeClusterFromIndex(first, end, fsi);
+	uint64_t chunkBytes = (uint64_t)FREE_SCAN_SECTORS * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * chunk = malloc(chunkBytes);
+	if (NULL == chunk)
+		return 0x00000001;
+	uint64_t FATStart = getFATStart(fsi);
+	FS_Cluster found = 0x00000001;
+	for (uint64_t chunkStart = (calcFATOffset(first, fsi) / chunkBytes) * chunkBytes; (chunkStart * 8 / fsi->ops->bits) < end; chunkStart += chunkBytes) {	// a chunk at a time rather than a sector per cluster
+		uint64_t chunkFirst = chunkStart * 8 / fsi->ops->bits;
+		uint64_t last = (chunkStart + chunkBytes) * 8 / fsi->ops->bits;
+		readDisk(chunk, chunkBytes, FATStart + chunkStart, fsi);
+		FS_Cluster candidate = fsi->ops->findFree(chunk, chunkStart, (first > chunkFirst) ? first : chunkFirst, (last < end) ? last : end);
+		if (0 != candidate) {
+			found = candidate;
+			break;
+		}
+	}
+	free(chunk);
+	return found;
+}
+
+/*
+ * Start of the first run of count free clusters inside [first, end), or
+ * 0x00000001 if there is none. Runs may cross chunk boundaries.
+ */
+FS_Cluster scanFreeRun(FS_Cluster first, uint64_t end, uint32_t count, FS_Instance * fsi) {
+	uint64_t chunkBytes = (uint64_t)FREE_SCAN_SECTORS * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * chunk = malloc(chunkBytes);
+	if (NULL == chunk)
+		return 0x00000001;
+	if (2 > first)
+		first = 2;
+	uint64_t FATStart = getFATStart(fsi);
+	FS_Cluster runStart = 0x00000001;
+	uint32_t runLength = 0;
+	for (uint64_t chunkStart = (calcFATOffset(first, fsi) / chunkBytes) * chunkBytes; (runLength < count) && ((chunkStart * 8 / fsi->ops->bits) < end); chunkStart += chunkBytes) {
+		uint64_t chunkFirst = chunkStart * 8 / fsi->ops->bits;
+		uint64_t last = (chunkStart + chunkBytes) * 8 / fsi->ops->bits;
+		readDisk(chunk, chunkBytes, FATStart + chunkStart, fsi);
+		for (uint64_t cluster = (first > chunkFirst) ? first : chunkFirst; (runLength < count) && (cluster < last) && (cluster < end); cluster++) {
+			if (0 != fsi->ops->decode(chunk, calcFATOffset(cluster, fsi) - chunkStart, cluster)) {
+				runLength = 0;
+			} else if (0 == runLength++) {
+				runStart = cluster;
+			}
 		}
 	}
-	return 0x00000001;
+	free(chunk);
+	return (runLength == count) ? runStart : 0x00000001;
+}
+
+void zeroClusters(FS_Cluster first, uint32_t count, FS_Instance * fsi) {
+	uint64_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	uint64_t batch = (DEFRAG_BATCH_BYTES / bytesPerCluster) * bytesPerCluster;
+	if (0 == batch)
+		batch = bytesPerCluster;
+	uint8_t * zeros = calloc(batch, sizeof(uint8_t));
+	if (NULL == zeros)
+		return;
+	uint64_t total = count * bytesPerCluster;
+	for (uint64_t done = 0; done < total; done += batch)										// the run is contiguous on disk too
+		writeDisk(zeros, ((total - done) < batch) ? (total - done) : batch, getClusterOffset(first, fsi) + done, fsi);
+	free(zeros);
+}
+
+/*
+ * Where the search for a free cluster starts under the instance's allocation
+ * policy. near is the caller's locality hint: the parent directory for a new
+ * item, or the cluster the chain being grown ends at.
+ */
+FS_Cluster getAllocationStart(FS_Cluster near, FS_Instance * fsi) {
+	switch (fsi->allocPolicy) {
+		case FS_ALLOC_NEXT_FIT:
+			return isDataCluster(fsi->allocCursor, fsi) ? fsi->allocCursor : 2;
+		case FS_ALLOC_NEAR_DIR:
+			return isDataCluster(near, fsi) ? near : 2;											// a FAT12/16 root directory is 0, the start of the data region
+		default:
+			return 2;
+	}
+}
+
+/*
+ * The search runs from the policy's starting point to the end of the volume
+ * and then wraps around to cluster 2. The cluster returned is not yet marked
+ * in the FAT, so the next-fit cursor stays on it rather than past it: a caller
+ * that asks again before using it gets the same one back.
+ */
+FS_Cluster getNextFreeCluster(FS_Cluster near, FS_Instance * fsi) {
+	FS_Cluster start = getAllocationStart(near, fsi);
+	FS_Cluster found = findFreeCluster(start, fsi->countOfClusters + 2, fsi);
+	if ((1 == found) && (2 < start))
+		found = findFreeCluster(2, start, fsi);
+	if ((FS_ALLOC_NEXT_FIT == fsi->allocPolicy) && (1 != found))
+		fsi->allocCursor = found;
+	return found;
 }
 
 uint8_t getNumberOfLongEntriesForFilename(char * filename) {
@@ -423,53 +906,27 @@ fs_result fillShortNameFromLongName(FS_Cluster dir, fatEntry * entry, char * fil
 	while (DIR_Name_LENGTH > j) { entry->DIR_Name[j++] = ' '; }
 	free(name);
 
-	FS_EntryList * el = getDirListing((FS_Cluster)dir, fsi);
-	FS_EntryList * curr = el;
+	FS_DirCache * dc = openDir((FS_Cluster)dir, fsi);
 	uint8_t found = 0;
-	while (NULL != curr) {
-		FS_Entry * currEntry = curr->node;
-		if (NULL != currEntry->filename) {
-			found = 1;
-			uint8_t idx = 0;
-			while ((0x0000 != currEntry->filename[idx]) && (idx < strlen(filename))) {
-				if ((currEntry->filename[idx] & 0x00FF) != filename[idx]) {
-					found = 0;
-					break;
-				}
-				idx++;
-			}
-			if ((currEntry->filename[idx] & 0x00FF) != filename[idx])
-				found = 0;
-			if (found)
-				break;
-		}
-		found = 1;
-		for (uint8_t i = 0; i < DIR_Name_LENGTH; i++) {
-			if (currEntry->entry->DIR_Name[i] != entry->DIR_Name[i]) {
-				found = 0;
+	fs_result result = ERR_SUCCESS;
+	if (NULL == dc) {
+		result = ERR_MALLOCFAILED;
+	} else if (NULL != findEntryByName(dc->hash, filename)) {
+		found = 1;																				// the long name is taken, whatever its case
+	} else {
+		while (NULL != findEntryByShortName(dc->hash, entry->DIR_Name)) {
+			if (!wasLossy) {
+				found = 1;
 				break;
 			}
+			setNumericTail(entry, ++currTail);
 		}
-		if (found) {
-			if (wasLossy) {
-				setNumericTail(entry, ++currTail);
-				curr = el;
-			} else {
-				break;
-			}
-		} else {
-			curr = curr->next;
-		}
-	}
-	while (NULL != el) {
-		FS_EntryList * toFree = el;
-		el = el->next;
-		freeFSEntryListItem(toFree);
 	}
+	closeDir(dc, fsi);
 	if (found) {
 		return ERR_FILENAMEEXISTS;
 	}
-	return ERR_SUCCESS;
+	return result;
 }
 
 void getLongNameSection(fatEntry * entry, fatLongName * ln, uint8_t section, uint8_t entries, char * filename) {
@@ -512,7 +969,7 @@ void getLongNameSection(fatEntry * entry, fatLongName * ln, uint8_t section, uin
 
 fs_result getNContiguousDirEntries(FS_DirEntryInfo * dirEntry, FS_Cluster dir, FS_Instance * fsi) {
 	uint8_t found = 0;
-	uint8_t freeEntriesFound = 0;
+	uint32_t freeEntriesFound = 0;
 	FS_Cluster lastDir;
 	uint8_t specialRootDir = isSpecialRootDir(dir, fsi);
 	uint32_t bytesPerCluster = ((!specialRootDir) ? fsi->bootsect->BPB_SecPerClus : 1) * fsi->bootsect->BPB_BytsPerSec;
@@ -527,17 +984,18 @@ fs_result getNContiguousDirEntries(FS_DirEntryInfo * dirEntry, FS_Cluster dir, F
 		uint64_t seekTo = dir;
 		if (!specialRootDir)
 			seekTo = getFirstSectorOfCluster(dir, fsi);
-		fseek(fsi->disk, (seekTo * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-		fread(entries, sizeof(fatEntry), entriesPerCluster, fsi->disk);
+		readDisk(entries, bytesPerCluster, seekTo * fsi->bootsect->BPB_BytsPerSec, fsi);
 		for (int i = 0; i < entriesPerCluster; i++) {
 			fatEntry * entry = &(entries[i]);
 			if (0 == freeEntriesFound) {
 				dirEntry->cluster = dir;
 				dirEntry->index = i;
 			}
-			if (0x00 == entry->DIR_Name[0])
-				freeEntriesFound += entriesPerCluster - i;
-			else if (0xE5 == entry->DIR_Name[0])
+			if (0x00 == entry->DIR_Name[0]) {
+				freeEntriesFound += entriesPerCluster - i;										// the rest of the cluster is free, count it once
+				found = (freeEntriesFound >= dirEntry->numEntries);
+				break;
+			} else if (0xE5 == entry->DIR_Name[0])
 				freeEntriesFound++;
 			else
 				freeEntriesFound = 0;
@@ -559,11 +1017,12 @@ fs_result getNContiguousDirEntries(FS_DirEntryInfo * dirEntry, FS_Cluster dir, F
 		return ERR_SUCCESS;
 	if (specialRootDir)
 		return ERR_ROOTDIRFULL;
-	FS_Cluster nextCluster = getNextFreeCluster(fsi);
+	FS_Cluster nextCluster = getNextFreeCluster(lastDir, fsi);
 	if (1 == nextCluster)
 		return ERR_NOFREESPACE;
 	setFATEntryForCluster(lastDir, nextCluster, fsi);
 	setFATEntryForCluster(nextCluster, getEOFMarker(fsi), fsi);
+	zeroCluster(nextCluster, fsi);																// a reused cluster's old data would read as entries
 	dirEntry->cluster = nextCluster;
 	dirEntry->index = 0;
 	return ERR_SUCCESS;
@@ -586,51 +1045,368 @@ fs_result addDirListing(FS_Cluster dir, char * filename, fatEntry * entry, uint8
 	uint64_t seekTo = entryPos->cluster;
 	if (!isSpecialRootDir(dir, fsi))
 		seekTo = getFirstSectorOfCluster(entryPos->cluster, fsi);
-	fseek(fsi->disk, (seekTo * fsi->bootsect->BPB_BytsPerSec) + (entryPos->index * sizeof(fatEntry)), SEEK_SET);
+	uint64_t offset = (seekTo * fsi->bootsect->BPB_BytsPerSec) + (entryPos->index * sizeof(fatEntry));
 	free(entryPos);
-	fatLongName * ln = malloc(sizeof(fatLongName));
-	if (NULL == ln)
+	fatLongName * run = malloc((LFNentries + 1) * sizeof(fatLongName));						// the run never straddles clusters, write it at once
+	if (NULL == run)
 		return ERR_MALLOCFAILED;
-	for (uint8_t i = 0; i < LFNentries; i++) {
-		getLongNameSection(entry, ln, i, LFNentries, filename);
-		fwrite(ln, sizeof(fatLongName), 1, fsi->disk);
-	}
-	fwrite(entry, sizeof(fatEntry), 1, fsi->disk);
+	for (uint8_t i = 0; i < LFNentries; i++)
+		getLongNameSection(entry, &(run[i]), i, LFNentries, filename);
+	memcpy(&(run[LFNentries]), entry, sizeof(fatEntry));
+	invalidateIndex(fsi);
+	dropDirCache(fsi);
+	writeDisk(run, (LFNentries + 1) * sizeof(fatLongName), offset, fsi);
+	free(run);
+	if (!isSpecialEntry)
+		addNameToIndex(dir, (0 < LFNentries) ? filename : NULL, entry, offset + (LFNentries * sizeof(fatEntry)), fsi);
 	return ERR_SUCCESS;
 }
 
-void deleteDirListing(FS_Cluster dir, FS_Entry * ent, FS_Instance * fsi) {
-	FS_Cluster cluster = (ent->entry->DIR_FstClusHI << 8) + ent->entry->DIR_FstClusLO;
-	if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY)) {
+void punchClusters(FS_Cluster start, uint32_t count, FS_Instance * fsi) {
+	if (!fsi->punchHoles || (NULL != fsi->overlay) || (0 == count))						// an overlay's base is never written
+		return;
+	uint64_t bytesPerCluster = (uint64_t)fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	fallocate(fsi->disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, getClusterOffset(start, fsi), count * bytesPerCluster);
+}
+
+/*
+ * Marks every cluster from first to the end of its chain free, punching a
+ * hole for each contiguous run once the run ends.
+ */
+void freeChain(FS_Cluster first, FS_Instance * fsi) {
+	FS_Cluster runStart = first;
+	uint32_t runLength = 0;
+	FS_Cluster walked[FAT_WALK_BATCH];
+	uint32_t numWalked = 0, walkPos = 0;
+	for (FS_Cluster cluster = first; isDataCluster(cluster, fsi); ) {
+		if (walkPos == numWalked) {
+			numWalked = walkFATChain(cluster, walked, FAT_WALK_BATCH, fsi);						// clearing an entry never changes the ones after it
+			walkPos = 0;
+		}
+		FS_Cluster next = walked[walkPos++];
+		setFATEntryForCluster(cluster, 0, fsi);
+		if (cluster != (runStart + runLength)) {
+			punchClusters(runStart, runLength, fsi);
+			runStart = cluster;
+			runLength = 0;
+		}
+		runLength++;
+		cluster = next;
+	}
+	punchClusters(runStart, runLength, fsi);
+}
+
+void freeEntryClusters(FS_Entry * ent, FS_Instance * fsi) {
+	FS_Cluster cluster = getClusterForEntry(ent->entry);
+	if (maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && isDataCluster(cluster, fsi)) {
 		FS_EntryList * el = getDirListing(cluster, fsi);
 		while (NULL != el) {
 			if (el->node->entry->DIR_Name[0] != '.')
-				deleteDirListing(cluster, el->node, fsi);
+				freeEntryClusters(el->node, fsi);											// the directory goes with its children, no need to mark them
 			FS_EntryList * toFree = el;
 			el = el->next;
 			freeFSEntryListItem(toFree);
 		}
-	} else {
-		FS_Cluster next;
-		do {
-			next = getFATEntryForCluster(cluster, fsi);
-			setFATEntryForCluster(cluster, 0, fsi);
-			cluster = next;
-		} while (!isFATEntryEOF(next, fsi));
 	}
-	ent->entry->DIR_Name[0] = 0xE5;
-	uint64_t seekTo = ent->info->cluster;
-	if (!isSpecialRootDir(dir, fsi))
-		seekTo = getFirstSectorOfCluster(ent->info->cluster, fsi);
-	fseek(fsi->disk, (seekTo * fsi->bootsect->BPB_BytsPerSec) + (ent->info->index * sizeof(fatEntry)), SEEK_SET);
-	for (int i = 0; i < ent->info->numEntries; i++)
-		fwrite(ent->entry, sizeof(fatEntry), 1, fsi->disk);
+	freeChain(cluster, fsi);
+}
+
+int compareOffsets(const void * a, const void * b) {
+	uint64_t x = *((const uint64_t *)a), y = *((const uint64_t *)b);
+	return (x > y) - (x < y);
+}
+
+void markEntriesDeleted(FS_Cluster dir, FS_Entry ** ents, uint32_t numEnts, FS_Instance * fsi) {
+	uint8_t specialRootDir = isSpecialRootDir(dir, fsi);
+	uint64_t blockBytes = (uint64_t)((!specialRootDir) ? fsi->bootsect->BPB_SecPerClus : 1) * fsi->bootsect->BPB_BytsPerSec;
+	uint64_t base = (uint64_t)((specialRootDir) ? fsi->rootDirPos : fsi->dataSec) * fsi->bootsect->BPB_BytsPerSec;
+	uint64_t numSlots = 0;
+	for (uint32_t i = 0; i < numEnts; i++)
+		numSlots += ents[i]->info->numEntries;
+	uint64_t * slots = malloc(numSlots * sizeof(uint64_t));
+	uint8_t * block = malloc(blockBytes);
+	if ((NULL == slots) || (NULL == block)) {
+		free(slots);
+		free(block);
+		return;
+	}
+	numSlots = 0;
+	for (uint32_t i = 0; i < numEnts; i++) {
+		FS_DirEntryInfo * info = ents[i]->info;
+		for (uint8_t k = 0; (k + 1) < info->numEntries; k++) {
+			uint64_t offset = info->lfnOffset + (k * sizeof(fatEntry));
+			if (((offset - base) / blockBytes) != ((info->lfnOffset - base) / blockBytes))
+				offset = info->entryOffset - ((info->numEntries - 1 - k) * sizeof(fatEntry));	// the rest of the run sits before the short entry
+			slots[numSlots++] = offset;
+		}
+		slots[numSlots++] = info->entryOffset;
+	}
+	qsort(slots, numSlots, sizeof(uint64_t), compareOffsets);
+	invalidateIndex(fsi);
+	dropDirCache(fsi);
+	for (uint32_t i = 0; i < numEnts; i++)
+		removeNameFromIndex(ents[i]->info->entryOffset, fsi);
+	for (uint64_t i = 0; i < numSlots; ) {
+		uint64_t blockStart = base + (((slots[i] - base) / blockBytes) * blockBytes);
+		readDisk(block, blockBytes, blockStart, fsi);
+		for (; (i < numSlots) && (slots[i] < (blockStart + blockBytes)); i++)
+			block[slots[i] - blockStart] = 0xE5;
+		writeDisk(block, blockBytes, blockStart, fsi);
+	}
+	free(slots);
+	free(block);
 }
 
 void zeroCluster(FS_Cluster cluster, FS_Instance * fsi) {
-	uint8_t zero = 0;
-	fseek(fsi->disk, (getFirstSectorOfCluster(cluster, fsi) * fsi->bootsect->BPB_BytsPerSec), SEEK_SET);
-	for (int i = 0; i < (fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec); i++) {
-		fwrite(&zero, sizeof(uint8_t), 1, fsi->disk);
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * zeros = calloc(bytesPerCluster, sizeof(uint8_t));
+	if (NULL == zeros)
+		return;
+	writeDisk(zeros, bytesPerCluster, getClusterOffset(cluster, fsi), fsi);
+	free(zeros);
+}
+
+void updateDirEntry(FS_Entry * ent, FS_Instance * fsi) {
+	fatEntry onDisk = *(ent->entry);
+	if (0xE5 == onDisk.DIR_Name[0])
+		onDisk.DIR_Name[0] = 0x05;
+	invalidateIndex(fsi);
+	dropDirCache(fsi);
+	writeDisk(&onDisk, sizeof(fatEntry), ent->info->entryOffset, fsi);
+	updateNameInIndex(ent->entry, ent->info->entryOffset, fsi);
+}
+
+FS_FATEntry * decodeFATTable(uint8_t * FAT, FS_Instance * fsi) {
+	uint64_t FATBytes = (uint64_t)fsi->FATsz * fsi->bootsect->BPB_BytsPerSec;
+	uint64_t numEntries = fsi->countOfClusters + 2;
+	FS_FATEntry * table = malloc(numEntries * sizeof(FS_FATEntry));
+	if (NULL == table)
+		return NULL;
+	uint64_t fits = (FATBytes * 8) / fsi->ops->bits;
+	if (fits > numEntries)
+		fits = numEntries;
+	fsi->ops->unpack(FAT, table, 0, fits);
+	for (uint64_t i = fits; i < numEntries; i++)
+		table[i] = getEOFMarker(fsi);													// entry doesn't fit in the FAT, never hand it out
+	return table;
+}
+
+FS_FATEntry * loadFATTable(FS_Instance * fsi) {
+	uint64_t FATBytes = (uint64_t)fsi->FATsz * fsi->bootsect->BPB_BytsPerSec;
+	uint8_t * FAT = malloc(FATBytes);
+	if (NULL == FAT)
+		return NULL;
+	readDisk(FAT, FATBytes, getFATStart(fsi), fsi);
+	FS_FATEntry * table = decodeFATTable(FAT, fsi);
+	free(FAT);
+	return table;
+}
+
+void getChainStats(FS_Cluster cluster, FS_FATEntry * FAT, uint32_t * length, uint32_t * extents, FS_Instance * fsi) {
+	FS_Cluster prev = 0;
+	*length = 0;
+	*extents = 0;
+	while (isDataCluster(cluster, fsi) && (*length <= fsi->countOfClusters)) {
+		if (cluster != (prev + 1))
+			(*extents)++;
+		(*length)++;
+		prev = cluster;
+		cluster = FAT[cluster];
+	}
+}
+
+uint32_t getChainLength(FS_Cluster cluster, FS_FATEntry * FAT, FS_Instance * fsi) {
+	uint32_t length, extents;
+	getChainStats(cluster, FAT, &length, &extents, fsi);
+	return length;
+}
+
+uint32_t countChainExtents(FS_Cluster cluster, FS_FATEntry * FAT, FS_Instance * fsi) {
+	uint32_t length, extents;
+	getChainStats(cluster, FAT, &length, &extents, fsi);
+	return extents;
+}
+
+FS_Cluster findFreeRun(uint32_t numClusters, FS_FATEntry * FAT, FS_Instance * fsi) {
+	uint32_t runLength = 0;
+	for (FS_Cluster i = 2; i < (fsi->countOfClusters + 2); i++) {
+		if (0 == FAT[i]) {
+			if (++runLength == numClusters)
+				return i - (numClusters - 1);
+		} else {
+			runLength = 0;
+		}
+	}
+	return 0x00000001;
+}
+
+void copyClusterRun(FS_Cluster from, FS_Cluster to, uint32_t numClusters, uint8_t * buf, uint32_t bufClusters, FS_Instance * fsi) {
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	while (numClusters > 0) {
+		uint32_t batch = (numClusters < bufClusters) ? numClusters : bufClusters;
+		readDisk(buf, (size_t)bytesPerCluster * batch, getClusterOffset(from, fsi), fsi);
+		writeDisk(buf, (size_t)bytesPerCluster * batch, getClusterOffset(to, fsi), fsi);
+		from += batch;
+		to += batch;
+		numClusters -= batch;
+	}
+}
+
+fs_result relocateChain(FS_Entry * ent, FS_FATEntry * FAT, FS_Instance * fsi) {
+	FS_Cluster first = getClusterForEntry(ent->entry);
+	uint32_t numClusters = getChainLength(first, FAT, fsi);
+	FS_Cluster dest = findFreeRun(numClusters, FAT, fsi);
+	if (1 == dest)
+		return ERR_NOFREESPACE;
+	uint32_t bytesPerCluster = fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	uint32_t bufClusters = DEFRAG_BATCH_BYTES / bytesPerCluster;
+	if (0 == bufClusters)
+		bufClusters = 1;
+	if (bufClusters > numClusters)
+		bufClusters = numClusters;
+	uint8_t * buf = malloc(bufClusters * bytesPerCluster);
+	if (NULL == buf)
+		return ERR_MALLOCFAILED;
+																										// copy every extent of the old chain into the new run
+	FS_Cluster cluster = first, to = dest;
+	while (isDataCluster(cluster, fsi) && (to < (dest + numClusters))) {
+		FS_Cluster extentStart = cluster;
+		uint32_t extentLength = 0;
+		do {
+			extentLength++;
+			cluster = FAT[cluster];
+		} while ((cluster == (extentStart + extentLength)) && ((to + extentLength) < (dest + numClusters)));
+		copyClusterRun(extentStart, to, extentLength, buf, bufClusters, fsi);
+		to += extentLength;
+	}
+	free(buf);
+																										// link the new run before pointing the entry at it
+	for (uint32_t i = 0; i < numClusters; i++) {
+		FS_FATEntry next = ((i + 1) == numClusters) ? getEOFMarker(fsi) : (dest + i + 1);
+		setFATEntryForCluster(dest + i, next, fsi);
+		FAT[dest + i] = next;
+	}
+	setClusterForEntry(ent->entry, dest);
+	updateDirEntry(ent, fsi);
+																										// only release the old chain once nothing references it
+	cluster = first;
+	for (uint32_t i = 0; (i < numClusters) && isDataCluster(cluster, fsi); i++) {
+		FS_Cluster next = FAT[cluster];
+		FAT[cluster] = 0;
+		cluster = next;
 	}
-}
\ No newline at end of file
+	freeChain(first, fsi);
+	return ERR_SUCCESS;
+}
+
+void writeFATTable(FS_FATEntry * table, FS_Instance * fsi) {
+	uint64_t FATBytes = (uint64_t)fsi->FATsz * fsi->bootsect->BPB_BytsPerSec;
+	uint64_t numEntries = fsi->countOfClusters + 2;
+	uint8_t * FAT = malloc(FATBytes);
+	if (NULL == FAT)
+		return;
+	uint64_t FATStart = getFATStart(fsi);
+	readDisk(FAT, FATBytes, FATStart, fsi);
+	uint64_t fits = (FATBytes * 8) / fsi->ops->bits;
+	if (fits > numEntries)
+		fits = numEntries;
+	fsi->ops->pack(FAT, table, 2, fits);
+	invalidateIndex(fsi);
+	dropDirCache(fsi);
+	for (uint8_t i = 0; i < fsi->bootsect->BPB_NumFATs; i++)
+		if ((i == fsi->activeFAT) || fsi->mirrorFATs)
+			writeDisk(FAT, FATBytes, getFATCopyOffset(i, fsi), fsi);
+	clearFATDirty(fsi);																			// every copy is current now
+	free(FAT);
+}
+
+void adviseDisk(uint64_t offset, uint64_t len, FS_Instance * fsi) {
+	if (0 == fsi->readAheadClusters)
+		return;
+	if (NULL != fsi->overlay)
+		adviseOverlay(offset, len, fsi);														// blocks already written live in the overlay
+	else
+		posix_fadvise(fsi->disk, offset, len, POSIX_FADV_WILLNEED);
+}
+
+FS_Cluster getChainSuccessor(FS_ChainReader * cr, FS_Cluster cluster, FS_Instance * fsi) {
+	if (NULL != cr->extents) {
+		if (++(cr->extentPos) < cr->extents[cr->extent].length)
+			return cluster + 1;
+		cr->extentPos = 0;
+		return (++(cr->extent) < cr->numExtents) ? cr->extents[cr->extent].start : 0;
+	}
+	if (NULL != cr->FAT)
+		return cr->FAT[cluster];
+	if (cr->walkPos == cr->numWalked) {
+		cr->numWalked = walkFATChain(cluster, cr->walked, cr->size, fsi);
+		cr->walkPos = 0;
+	}
+	return cr->walked[cr->walkPos++];
+}
+
+void fillChainReader(FS_ChainReader * cr, FS_Instance * fsi) {
+	FS_Cluster runStart = 0;
+	uint32_t runLength = 0;
+	uint64_t bytesPerCluster = (uint64_t)fsi->bootsect->BPB_SecPerClus * fsi->bootsect->BPB_BytsPerSec;
+	cr->numWalked = cr->walkPos = 0;															// links are read afresh each time the window is topped up
+	while ((cr->count < cr->size) && isDataCluster(cr->tail, fsi) && (cr->queued < fsi->countOfClusters)) {	// bounded in case the chain loops
+		FS_Cluster cluster = cr->tail;
+		cr->ring[(cr->head + cr->count++) % cr->size] = cluster;
+		cr->queued++;
+		if ((0 < runLength) && (cluster != (runStart + runLength))) {
+			adviseDisk(getClusterOffset(runStart, fsi), runLength * bytesPerCluster, fsi);	// hint each contiguous run once
+			runLength = 0;
+		}
+		if (0 == runLength)
+			runStart = cluster;
+		runLength++;
+		cr->tail = getChainSuccessor(cr, cluster, fsi);
+	}
+	if (0 < runLength)
+		adviseDisk(getClusterOffset(runStart, fsi), runLength * bytesPerCluster, fsi);
+}
+
+FS_ChainReader * openChainReader(FS_Cluster first, FS_FATEntry * FAT, FS_Instance * fsi) {
+	FS_ChainReader * cr = calloc(1, sizeof(FS_ChainReader));
+	if (NULL == cr)
+		return NULL;
+	cr->size = (0 < fsi->readAheadClusters) ? fsi->readAheadClusters : 1;
+	cr->ring = malloc(cr->size * sizeof(FS_Cluster));
+	cr->walked = malloc(cr->size * sizeof(FS_Cluster));
+	if ((NULL == cr->ring) || (NULL == cr->walked)) {
+		closeChainReader(cr);
+		return NULL;
+	}
+	cr->FAT = FAT;
+	cr->tail = first;
+	return cr;
+}
+
+FS_ChainReader * openExtentReader(FS_IndexExtent * extents, uint32_t numExtents, FS_Instance * fsi) {
+	FS_ChainReader * cr = openChainReader((0 < numExtents) ? extents[0].start : 0, NULL, fsi);
+	if (NULL == cr)
+		return NULL;
+	cr->extents = extents;
+	cr->numExtents = numExtents;
+	return cr;
+}
+
+FS_Cluster nextChainCluster(FS_ChainReader * cr, FS_Instance * fsi) {
+	if (cr->count <= (cr->size / 2))
+		fillChainReader(cr, fsi);															// top the window up before it runs dry
+	if (0 == cr->count)
+		return 0;
+	FS_Cluster cluster = cr->ring[cr->head];
+	cr->head = (cr->head + 1) % cr->size;
+	cr->count--;
+	return cluster;
+}
+
+void closeChainReader(FS_ChainReader * cr) {
+	if (NULL != cr) {
+		free(cr->ring);
+		free(cr->walked);
+	}
+	free(cr);
+}
@@ -9,19 +9,122 @@
 #include "fat_fs.h"
 #include "fat.h"
 
+#define DEFRAG_BATCH_BYTES (1024 * 1024)
+#define READAHEAD_CLUSTERS 32
+#define FAT_SYNC_BATCH_SECTORS 256
+#define FAT_WALK_MAX_SECTOR 4096
+#define FAT_WALK_BATCH 64
+#define DIR_CACHE_SIZE 64
+#define FREE_SCAN_SECTORS 48																// divisible by 3 so FAT12 pairs never straddle a chunk
+
+struct FS_IndexExtent_struct;
+
+struct FS_ChainReader_struct {
+	FS_FATEntry * FAT;																			// optional in-memory FAT to follow instead of the disk
+	struct FS_IndexExtent_struct * extents;													// optional extent list to follow instead of the FAT
+	uint32_t numExtents;
+	uint32_t extent;
+	uint32_t extentPos;
+	FS_Cluster * walked;																		// successors walkFATChain found ahead, not yet followed
+	uint32_t numWalked;
+	uint32_t walkPos;
+	FS_Cluster * ring;																			// clusters already looked up and advised, not yet consumed
+	uint32_t size;
+	uint32_t head;
+	uint32_t count;
+	FS_Cluster tail;																			// next cluster to look up
+	uint64_t queued;
+};
+
+typedef struct FS_ChainReader_struct FS_ChainReader;
+
+struct FS_DirHash_struct {
+	FS_Entry ** longSlots;																		// keyed on the case-folded long name
+	FS_Entry ** shortSlots;																		// keyed on the 11 byte short name
+	uint32_t size;																				// slots per table, a power of two
+};
+
+typedef struct FS_DirHash_struct FS_DirHash;
+
+struct FS_DirCache_struct {
+	FS_Cluster dir;
+	FS_EntryList * listing;
+	FS_DirHash * hash;
+	uint32_t users;																				// openDir calls not yet matched by closeDir
+	uint8_t stale;																				// dropped by a write while in use, the last closeDir frees it
+	struct FS_DirCache_struct * next;
+};
+
+typedef struct FS_DirCache_struct FS_DirCache;
+
+size_t readFully(int fd, void * buf, size_t len, uint64_t offset);
+size_t writeFully(int fd, const void * buf, size_t len, uint64_t offset);
+size_t readDisk(void * buf, size_t len, uint64_t offset, FS_Instance * fsi);
+size_t writeDisk(const void * buf, size_t len, uint64_t offset, FS_Instance * fsi);
+uint8_t isZeroFilled(const uint8_t * buf, size_t len);
+int getImageDescriptor(FS_Instance * fsi);
 uint64_t getFirstSectorOfCluster(FS_Cluster cluster, FS_Instance * fsi);
+uint64_t getClusterOffset(FS_Cluster cluster, FS_Instance * fsi);
+uint64_t getFATCopyOffset(uint8_t copy, FS_Instance * fsi);
+uint64_t getFATStart(FS_Instance * fsi);
+uint8_t markFATDirty(uint64_t entOffset, uint64_t len, FS_Instance * fsi);
+void clearFATDirty(FS_Instance * fsi);
+void syncFATMirrors(FS_Instance * fsi);
+void syncFSInfo(FS_Instance * fsi);
 FS_FATEntry getFATEntryForCluster(FS_Cluster cluster, FS_Instance * fsi);
+uint32_t walkFATChain(FS_Cluster cluster, FS_Cluster * next, uint32_t max, FS_Instance * fsi);
 void setFATEntryForCluster(FS_Cluster cluster, FS_FATEntry entry, FS_Instance * fsi);
 FS_FATEntry getEOFMarker(FS_Instance * fsi);
 uint8_t isFATEntryEOF(FS_FATEntry entry, FS_Instance * fsi);
 uint8_t isFATEntryBad(FS_FATEntry entry, FS_Instance * fsi);
+uint8_t isSpecialRootDir(FS_Cluster dir, FS_Instance * fsi);
 FS_EntryList * getDirListing(FS_Cluster dir, FS_Instance * fsi);
+FS_EntryList * getDirListingWithFAT(FS_Cluster dir, FS_FATEntry * FAT, FS_Instance * fsi);
 void freeFSEntryListItem(FS_EntryList * toFree);
-FS_Cluster getNextFreeCluster(FS_Instance * fsi);
+FS_Cluster findFreeCluster(FS_Cluster first, uint64_t end, FS_Instance * fsi);
+FS_Cluster scanFreeRun(FS_Cluster first, uint64_t end, uint32_t count, FS_Instance * fsi);
+FS_Cluster getAllocationStart(FS_Cluster near, FS_Instance * fsi);
+FS_Cluster getNextFreeCluster(FS_Cluster near, FS_Instance * fsi);
 uint8_t getNumberOfLongEntriesForFilename(char * filename);
 fs_result addDirListing(FS_Cluster dir, char * filename, fatEntry * entry, uint8_t isSpecialEntry, FS_Instance * fsi);
 void zeroCluster(FS_Cluster cluster, FS_Instance * fsi);
+void zeroClusters(FS_Cluster first, uint32_t count, FS_Instance * fsi);
 uint8_t maskAndTest(uint8_t val, uint8_t mask);
-void deleteDirListing(FS_Cluster dir, FS_Entry * ent, FS_Instance * fsi);
+char * getFilenameForEntry(fatEntry * ent);
+void formatShortName(fatEntry * ent, char * filename);
+char * joinPath(char * parent, char * name);
+char * getDisplayNameForEntry(FS_Entry * ent);
+uint8_t hasWildcards(char * pattern);
+uint8_t entryMatchesPattern(FS_Entry * ent, char * pattern);
+uint8_t packShortName(char * name, uint8_t * shortName);
+FS_DirHash * buildDirHash(FS_EntryList * listing);
+FS_Entry * findEntryByShortName(FS_DirHash * hash, uint8_t * shortName);
+FS_Entry * findEntryByName(FS_DirHash * hash, char * name);
+void freeDirHash(FS_DirHash * hash);
+FS_DirCache * openDir(FS_Cluster dir, FS_Instance * fsi);
+void closeDir(FS_DirCache * dc, FS_Instance * fsi);
+void dropDirCache(FS_Instance * fsi);
+void punchClusters(FS_Cluster start, uint32_t count, FS_Instance * fsi);
+void freeChain(FS_Cluster first, FS_Instance * fsi);
+void freeEntryClusters(FS_Entry * ent, FS_Instance * fsi);
+void markEntriesDeleted(FS_Cluster dir, FS_Entry ** ents, uint32_t numEnts, FS_Instance * fsi);
+uint8_t isDataCluster(FS_Cluster cluster, FS_Instance * fsi);
+FS_Cluster getClusterForEntry(fatEntry * entry);
+void setClusterForEntry(fatEntry * entry, FS_Cluster cluster);
+void updateDirEntry(FS_Entry * ent, FS_Instance * fsi);
+FS_FATEntry * decodeFATTable(uint8_t * FAT, FS_Instance * fsi);
+FS_FATEntry * loadFATTable(FS_Instance * fsi);
+void writeFATTable(FS_FATEntry * table, FS_Instance * fsi);
+uint8_t getLongNameChecksum(fatEntry * entry);
+void getChainStats(FS_Cluster cluster, FS_FATEntry * FAT, uint32_t * length, uint32_t * extents, FS_Instance * fsi);
+uint32_t getChainLength(FS_Cluster cluster, FS_FATEntry * FAT, FS_Instance * fsi);
+uint32_t countChainExtents(FS_Cluster cluster, FS_FATEntry * FAT, FS_Instance * fsi);
+FS_Cluster findFreeRun(uint32_t numClusters, FS_FATEntry * FAT, FS_Instance * fsi);
+fs_result relocateChain(FS_Entry * ent, FS_FATEntry * FAT, FS_Instance * fsi);
+void adviseDisk(uint64_t offset, uint64_t len, FS_Instance * fsi);
+FS_ChainReader * openChainReader(FS_Cluster first, FS_FATEntry * FAT, FS_Instance * fsi);
+FS_ChainReader * openExtentReader(struct FS_IndexExtent_struct * extents, uint32_t numExtents, FS_Instance * fsi);
+FS_Cluster nextChainCluster(FS_ChainReader * cr, FS_Instance * fsi);
+void closeChainReader(FS_ChainReader * cr);
 
 #endif
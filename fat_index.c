@@ -0,0 +1,343 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "fat_index.h"
+#include "fat_helpers.h"
+
+#define INDEX_ALIGN(x) (((x) + 7) & ~((uint64_t)7))
+
+char * getIndexPath(FS_Instance * fsi, char * extra) {
+	char * path = malloc(strlen(fsi->imagePath) + strlen(INDEX_SUFFIX) + strlen(extra) + 1);
+	if (NULL != path)
+		sprintf(path, "%s%s%s", fsi->imagePath, INDEX_SUFFIX, extra);
+	return path;
+}
+
+uint64_t getIndexChecksum(uint8_t * data, uint64_t len) {
+	uint64_t hash = 0xCBF29CE484222325;
+	for (uint64_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x00000100000001B3;
+	}
+	return hash;
+}
+
+uint8_t isIndexSectionValid(uint64_t offset, uint64_t count, uint64_t size, uint64_t indexSize) {
+	return (offset <= indexSize) && ((count * size) <= (indexSize - offset));
+}
+
+uint64_t getIndexBitmapWords(FS_Instance * fsi) {
+	return ((fsi->countOfClusters + 2) / 32) + 1;
+}
+
+void loadIndex(FS_Instance * fsi) {
+	fsi->index = NULL;
+	fsi->indexSize = 0;
+	char * path = getIndexPath(fsi, "");
+	if (NULL == path)
+		return;
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (0 > fd)
+		return;
+	struct stat indexStats, imageStats;
+	if ((0 != fstat(fd, &indexStats)) || (0 != fstat(getImageDescriptor(fsi), &imageStats)) || (indexStats.st_size < sizeof(FS_IndexHeader))) {
+		close(fd);
+		return;
+	}
+	FS_IndexHeader * header = mmap(NULL, indexStats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == header)
+		return;
+	uint64_t indexSize = indexStats.st_size;
+	uint8_t valid = (INDEX_MAGIC == header->magic) && (INDEX_VERSION == header->version);
+	if (valid) {
+		fsi->useIndex = 1;																		// a sidecar exists, keep it maintained
+		fsi->indexGeneration = header->generation;
+	}
+	valid = valid && (header->imageSize == imageStats.st_size);
+	valid = valid && (header->imageMtimeSec == imageStats.st_mtim.tv_sec) && (header->imageMtimeNsec == imageStats.st_mtim.tv_nsec);
+	valid = valid && (header->countOfClusters == fsi->countOfClusters);
+	valid = valid && isIndexSectionValid(header->bitmapOffset, getIndexBitmapWords(fsi), sizeof(uint32_t), indexSize);
+	valid = valid && isIndexSectionValid(header->dirsOffset, header->numDirs, sizeof(FS_IndexDir), indexSize);
+	valid = valid && isIndexSectionValid(header->entriesOffset, header->numEntries, sizeof(FS_IndexEntry), indexSize);
+	valid = valid && isIndexSectionValid(header->extentsOffset, header->numExtents, sizeof(FS_IndexExtent), indexSize);
+	valid = valid && isIndexSectionValid(header->namesOffset, header->numNameChars, sizeof(uint16_t), indexSize);
+	valid = valid && (header->checksum == getIndexChecksum(((uint8_t *)header) + sizeof(FS_IndexHeader), indexSize - sizeof(FS_IndexHeader)));
+	if (!valid) {
+		munmap(header, indexSize);
+		return;
+	}
+	fsi->index = header;
+	fsi->indexSize = indexSize;
+}
+
+void unloadIndex(FS_Instance * fsi) {
+	if (NULL != fsi->index)
+		munmap(fsi->index, fsi->indexSize);
+	fsi->index = NULL;
+	fsi->indexSize = 0;
+}
+
+void invalidateIndex(FS_Instance * fsi) {
+	unloadIndex(fsi);
+}
+
+struct FS_IndexBuilder_struct {
+	FS_IndexDir * dirs;
+	FS_IndexEntry * entries;
+	FS_IndexExtent * extents;
+	uint16_t * names;
+	uint32_t numDirs, allocDirs;
+	uint32_t numEntries, allocEntries;
+	uint32_t numExtents, allocExtents;
+	uint32_t numNameChars, allocNameChars;
+};
+
+typedef struct FS_IndexBuilder_struct FS_IndexBuilder;
+
+uint8_t growIndexArray(void ** array, uint32_t * alloc, uint32_t needed, size_t size) {
+	if (needed <= *alloc)
+		return 1;
+	uint32_t newAlloc = (0 == *alloc) ? 256 : *alloc;
+	while (newAlloc < needed)
+		newAlloc *= 2;
+	void * grown = realloc(*array, newAlloc * size);
+	if (NULL == grown)
+		return 0;
+	*array = grown;
+	*alloc = newAlloc;
+	return 1;
+}
+
+uint8_t addIndexDir(FS_IndexBuilder * ib, FS_Cluster cluster) {
+	if (!growIndexArray((void **)&(ib->dirs), &(ib->allocDirs), ib->numDirs + 1, sizeof(FS_IndexDir)))
+		return 0;
+	ib->dirs[ib->numDirs].cluster = cluster;
+	ib->dirs[ib->numDirs].firstEntry = 0;
+	ib->dirs[ib->numDirs].numEntries = 0;
+	ib->numDirs++;
+	return 1;
+}
+
+uint8_t addIndexEntry(FS_IndexBuilder * ib, FS_Entry * ent, FS_FATEntry * FAT, FS_Instance * fsi) {
+	if (!growIndexArray((void **)&(ib->entries), &(ib->allocEntries), ib->numEntries + 1, sizeof(FS_IndexEntry)))
+		return 0;
+	FS_IndexEntry * ie = &(ib->entries[ib->numEntries++]);
+	memset(ie, 0, sizeof(FS_IndexEntry));
+	ie->entry = *(ent->entry);
+	ie->cluster = ent->info->cluster;
+	ie->index = ent->info->index;
+	ie->entryOffset = ent->info->entryOffset;
+	ie->lfnOffset = ent->info->lfnOffset;
+	ie->numEntries = ent->info->numEntries;
+	ie->lfnChecksum = ent->info->lfnChecksum;
+	ie->nameOffset = ib->numNameChars;
+	if (NULL != ent->filename) {
+		while (0x0000 != ent->filename[ie->nameLength])
+			ie->nameLength++;
+		if (!growIndexArray((void **)&(ib->names), &(ib->allocNameChars), ib->numNameChars + ie->nameLength + 1, sizeof(uint16_t)))
+			return 0;
+		memcpy(&(ib->names[ib->numNameChars]), ent->filename, (ie->nameLength + 1) * sizeof(uint16_t));
+		ib->numNameChars += ie->nameLength + 1;
+	}
+	ie->firstExtent = ib->numExtents;
+	FS_Cluster cluster = getClusterForEntry(ent->entry);
+	for (uint64_t steps = 0; isDataCluster(cluster, fsi) && (steps <= fsi->countOfClusters); steps++) {
+		if ((0 < ie->numExtents) && (cluster == (ib->extents[ib->numExtents - 1].start + ib->extents[ib->numExtents - 1].length))) {
+			ib->extents[ib->numExtents - 1].length++;
+		} else {
+			if (!growIndexArray((void **)&(ib->extents), &(ib->allocExtents), ib->numExtents + 1, sizeof(FS_IndexExtent)))
+				return 0;
+			ib->extents[ib->numExtents].start = cluster;
+			ib->extents[ib->numExtents].length = 1;
+			ib->numExtents++;
+			ie->numExtents++;
+		}
+		cluster = FAT[cluster];
+	}
+	return 1;
+}
+
+int compareIndexDirs(const void * a, const void * b) {
+	FS_Cluster ca = ((const FS_IndexDir *)a)->cluster;
+	FS_Cluster cb = ((const FS_IndexDir *)b)->cluster;
+	return (ca < cb) ? -1 : ((ca > cb) ? 1 : 0);
+}
+
+uint8_t buildIndex(FS_IndexBuilder * ib, FS_FATEntry * FAT, FS_Instance * fsi) {
+	uint32_t * visited = calloc(getIndexBitmapWords(fsi), sizeof(uint32_t));
+	if (NULL == visited)
+		return 0;
+	uint8_t ok = addIndexDir(ib, fs_get_root(fsi));
+	for (uint32_t d = 0; ok && (d < ib->numDirs); d++) {
+		FS_Cluster dir = ib->dirs[d].cluster;
+		ib->dirs[d].firstEntry = ib->numEntries;
+		FS_EntryList * el = getDirListingWithFAT(dir, FAT, fsi);
+		while (NULL != el) {
+			FS_Entry * ent = el->node;
+			FS_Cluster cluster = getClusterForEntry(ent->entry);
+			ok = ok && addIndexEntry(ib, ent, FAT, fsi);
+			if (ok && maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && ('.' != ent->entry->DIR_Name[0]) && isDataCluster(cluster, fsi) && !((visited[cluster / 32] >> (cluster % 32)) & 1)) {
+				visited[cluster / 32] |= 1U << (cluster % 32);
+				ok = addIndexDir(ib, cluster);
+			}
+			FS_EntryList * toFree = el;
+			el = el->next;
+			freeFSEntryListItem(toFree);
+		}
+		ib->dirs[d].numEntries = ib->numEntries - ib->dirs[d].firstEntry;
+	}
+	free(visited);
+	qsort(ib->dirs, ib->numDirs, sizeof(FS_IndexDir), compareIndexDirs);
+	return ok;
+}
+
+void saveIndex(FS_Instance * fsi) {
+	if (!fsi->useIndex || (NULL != fsi->index))
+		return;																					// nothing changed since the sidecar was loaded
+	FS_FATEntry * FAT = loadFATTable(fsi);
+	if (NULL == FAT)
+		return;
+	FS_IndexBuilder ib;
+	memset(&ib, 0, sizeof(FS_IndexBuilder));
+	uint8_t * buf = NULL;
+	if (buildIndex(&ib, FAT, fsi)) {
+		FS_IndexHeader header;
+		memset(&header, 0, sizeof(FS_IndexHeader));
+		header.magic = INDEX_MAGIC;
+		header.version = INDEX_VERSION;
+		header.generation = fsi->indexGeneration + 1;
+		header.countOfClusters = fsi->countOfClusters;
+		header.numDirs = ib.numDirs;
+		header.numEntries = ib.numEntries;
+		header.numExtents = ib.numExtents;
+		header.numNameChars = ib.numNameChars;
+		header.bitmapOffset = INDEX_ALIGN(sizeof(FS_IndexHeader));
+		header.dirsOffset = INDEX_ALIGN(header.bitmapOffset + (getIndexBitmapWords(fsi) * sizeof(uint32_t)));
+		header.entriesOffset = INDEX_ALIGN(header.dirsOffset + (ib.numDirs * sizeof(FS_IndexDir)));
+		header.extentsOffset = INDEX_ALIGN(header.entriesOffset + (ib.numEntries * sizeof(FS_IndexEntry)));
+		header.namesOffset = INDEX_ALIGN(header.extentsOffset + (ib.numExtents * sizeof(FS_IndexExtent)));
+		uint64_t indexSize = header.namesOffset + (ib.numNameChars * sizeof(uint16_t));
+		buf = calloc(1, indexSize);
+		if (NULL != buf) {
+			uint32_t * bitmap = (uint32_t *)(buf + header.bitmapOffset);
+			for (FS_Cluster i = 0; i < (fsi->countOfClusters + 2); i++)
+				if ((2 > i) || (0 != FAT[i]))
+					bitmap[i / 32] |= 1U << (i % 32);
+			memcpy(buf + header.dirsOffset, ib.dirs, ib.numDirs * sizeof(FS_IndexDir));
+			memcpy(buf + header.entriesOffset, ib.entries, ib.numEntries * sizeof(FS_IndexEntry));
+			memcpy(buf + header.extentsOffset, ib.extents, ib.numExtents * sizeof(FS_IndexExtent));
+			memcpy(buf + header.namesOffset, ib.names, ib.numNameChars * sizeof(uint16_t));
+			struct stat imageStats;
+			fstat(getImageDescriptor(fsi), &imageStats);
+			header.imageSize = imageStats.st_size;
+			header.imageMtimeSec = imageStats.st_mtim.tv_sec;
+			header.imageMtimeNsec = imageStats.st_mtim.tv_nsec;
+			header.checksum = getIndexChecksum(buf + sizeof(FS_IndexHeader), indexSize - sizeof(FS_IndexHeader));
+			memcpy(buf, &header, sizeof(FS_IndexHeader));
+			char * tmpPath = getIndexPath(fsi, ".tmp");
+			char * path = getIndexPath(fsi, "");
+			FILE * out = (NULL != tmpPath) ? fopen(tmpPath, "wb") : NULL;
+			if (NULL != out) {
+				size_t written = fwrite(buf, indexSize, 1, out);
+				if ((0 == fclose(out)) && (1 == written) && (NULL != path))
+					rename(tmpPath, path);
+				else
+					remove(tmpPath);
+			}
+			free(tmpPath);
+			free(path);
+		}
+	}
+	free(buf);
+	free(ib.dirs);
+	free(ib.entries);
+	free(ib.extents);
+	free(ib.names);
+	free(FAT);
+}
+
+FS_IndexDir * findIndexDir(FS_Cluster dir, FS_Instance * fsi) {
+	if (NULL == fsi->index)
+		return NULL;
+	FS_IndexDir key;
+	key.cluster = dir;
+	return bsearch(&key, ((uint8_t *)fsi->index) + fsi->index->dirsOffset, fsi->index->numDirs, sizeof(FS_IndexDir), compareIndexDirs);
+}
+
+uint8_t getDirListingFromIndex(FS_Cluster dir, FS_EntryList ** listing, FS_Instance * fsi) {
+	FS_IndexDir * id = findIndexDir(dir, fsi);
+	if (NULL == id)
+		return 0;
+	FS_IndexEntry * entries = (FS_IndexEntry *)(((uint8_t *)fsi->index) + fsi->index->entriesOffset);
+	uint16_t * names = (uint16_t *)(((uint8_t *)fsi->index) + fsi->index->namesOffset);
+	FS_EntryList * listHead = NULL;
+	FS_EntryList * listTail = NULL;
+	for (uint32_t i = 0; i < id->numEntries; i++) {
+		FS_IndexEntry * ie = &(entries[id->firstEntry + i]);
+		FS_EntryList * listEntry = malloc(sizeof(FS_EntryList));
+		if (NULL == listEntry)
+			break;
+		listEntry->node = calloc(1, sizeof(FS_Entry));
+		if (NULL == listEntry->node) {
+			free(listEntry);
+			break;
+		}
+		listEntry->node->entry = malloc(sizeof(fatEntry));
+		listEntry->node->info = malloc(sizeof(FS_DirEntryInfo));
+		if (0 < ie->nameLength)
+			listEntry->node->filename = calloc(ie->nameLength + 1, sizeof(uint16_t));
+		listEntry->next = NULL;
+		if ((NULL == listEntry->node->entry) || (NULL == listEntry->node->info) || ((0 < ie->nameLength) && (NULL == listEntry->node->filename))) {
+			freeFSEntryListItem(listEntry);
+			break;
+		}
+		*(listEntry->node->entry) = ie->entry;
+		if (0 < ie->nameLength)
+			memcpy(listEntry->node->filename, &(names[ie->nameOffset]), ie->nameLength * sizeof(uint16_t));
+		listEntry->node->info->cluster = ie->cluster;
+		listEntry->node->info->index = ie->index;
+		listEntry->node->info->numEntries = ie->numEntries;
+		listEntry->node->info->lfnChecksum = ie->lfnChecksum;
+		listEntry->node->info->lfnOffset = ie->lfnOffset;
+		listEntry->node->info->entryOffset = ie->entryOffset;
+		if (NULL != listTail)
+			listTail->next = listEntry;
+		listTail = listEntry;
+		if (NULL == listHead)
+			listHead = listEntry;
+	}
+	*listing = listHead;
+	return 1;
+}
+
+FS_Cluster getNextFreeClusterFromIndex(FS_Cluster first, uint64_t end, FS_Instance * fsi) {
+	uint32_t * bitmap = (uint32_t *)(((uint8_t *)fsi->index) + fsi->index->bitmapOffset);
+	uint64_t numWords = getIndexBitmapWords(fsi);
+	for (uint64_t w = first / 32; (w < numWords) && ((w * 32) < end); w++) {
+		if (0xFFFFFFFF == bitmap[w])
+			continue;
+		for (uint8_t b = 0; b < 32; b++) {
+			uint64_t cluster = (w * 32) + b;
+			if ((cluster >= first) && (cluster < end) && !((bitmap[w] >> b) & 1) && isDataCluster(cluster, fsi))
+				return cluster;
+		}
+	}
+	return 0x00000001;
+}
+
+FS_IndexExtent * getExtentsFromIndex(FS_Cluster dir, FS_Cluster first, uint32_t * numExtents, FS_Instance * fsi) {
+	FS_IndexDir * id = findIndexDir(dir, fsi);
+	if (NULL == id)
+		return NULL;
+	FS_IndexEntry * entries = (FS_IndexEntry *)(((uint8_t *)fsi->index) + fsi->index->entriesOffset);
+	FS_IndexExtent * extents = (FS_IndexExtent *)(((uint8_t *)fsi->index) + fsi->index->extentsOffset);
+	for (uint32_t i = 0; i < id->numEntries; i++) {
+		FS_IndexEntry * ie = &(entries[id->firstEntry + i]);
+		if (getClusterForEntry(&(ie->entry)) == first) {
+			*numExtents = ie->numExtents;
+			return &(extents[ie->firstExtent]);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef FAT_INDEX_H
+#define FAT_INDEX_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+#include "fat.h"
+
+#define INDEX_MAGIC 0x58444946																	// "FIDX"
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".idx"
+
+#pragma pack(push)
+#pragma pack(1)
+
+struct FS_IndexHeader_struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t generation;
+	uint64_t imageSize;
+	int64_t imageMtimeSec;
+	int64_t imageMtimeNsec;
+	uint64_t countOfClusters;
+	uint64_t checksum;																			// FNV-1a over everything after the header
+	uint32_t numDirs;
+	uint32_t numEntries;
+	uint32_t numExtents;
+	uint32_t numNameChars;
+	uint64_t bitmapOffset;
+	uint64_t dirsOffset;
+	uint64_t entriesOffset;
+	uint64_t extentsOffset;
+	uint64_t namesOffset;
+};
+
+struct FS_IndexDir_struct {
+	FS_Cluster cluster;
+	uint32_t firstEntry;
+	uint32_t numEntries;
+};
+
+struct FS_IndexEntry_struct {
+	fatEntry entry;
+	FS_Cluster cluster;
+	uint32_t index;
+	uint64_t entryOffset;
+	uint64_t lfnOffset;
+	uint32_t nameOffset;
+	uint32_t nameLength;
+	uint32_t firstExtent;
+	uint32_t numExtents;
+	uint8_t numEntries;
+	uint8_t lfnChecksum;
+};
+
+struct FS_IndexExtent_struct {
+	FS_Cluster start;
+	uint32_t length;
+};
+
+#pragma pack(pop)
+
+typedef struct FS_IndexHeader_struct FS_IndexHeader;
+typedef struct FS_IndexDir_struct FS_IndexDir;
+typedef struct FS_IndexEntry_struct FS_IndexEntry;
+typedef struct FS_IndexExtent_struct FS_IndexExtent;
+
+void loadIndex(FS_Instance * fsi);
+void invalidateIndex(FS_Instance * fsi);
+void saveIndex(FS_Instance * fsi);
+void unloadIndex(FS_Instance * fsi);
+uint8_t getDirListingFromIndex(FS_Cluster dir, FS_EntryList ** listing, FS_Instance * fsi);
+FS_Cluster getNextFreeClusterFromIndex(FS_Cluster first, uint64_t end, FS_Instance * fsi);
+FS_IndexExtent * getExtentsFromIndex(FS_Cluster dir, FS_Cluster first, uint32_t * numExtents, FS_Instance * fsi);
+uint8_t growIndexArray(void ** array, uint32_t * alloc, uint32_t needed, size_t size);
+
+#endif
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <fcntl.h>
+#include "fat_mkfs.h"
+#include "fat_helpers.h"
+
+struct FS_Geometry_struct {
+	uint8_t fatBits;
+	uint32_t totalSectors;
+	uint8_t sectorsPerCluster;
+	uint16_t reservedSectors;
+	uint16_t rootEntries;
+	uint32_t rootDirSectors;
+	uint32_t FATsz;
+	uint32_t countOfClusters;
+};
+
+typedef struct FS_Geometry_struct FS_Geometry;
+
+/*
+ * Smallest FAT that covers the clusters left over once it and its copies are
+ * taken out of the volume.
+ */
+void sizeFAT(FS_Geometry * geo) {
+	uint32_t overhead = geo->reservedSectors + geo->rootDirSectors;
+	geo->FATsz = 1;
+	while (1) {
+		uint64_t dataSectors = (geo->totalSectors > (overhead + (MKFS_NUM_FATS * (uint64_t)geo->FATsz))) ? (geo->totalSectors - overhead - (MKFS_NUM_FATS * (uint64_t)geo->FATsz)) : 0;
+		geo->countOfClusters = dataSectors / geo->sectorsPerCluster;
+		uint64_t needed = ((((uint64_t)geo->countOfClusters + 2) * geo->fatBits) + ((8 * MKFS_BYTES_PER_SECTOR) - 1)) / (8 * MKFS_BYTES_PER_SECTOR);
+		if (needed <= geo->FATsz)
+			break;
+		geo->FATsz = needed;
+	}
+}
+
+void getClusterLimits(uint8_t fatBits, uint32_t * minClusters, uint32_t * maxClusters) {
+	switch (fatBits) {
+		case 12:
+			*minClusters = 1;
+			*maxClusters = 4084;
+			break;
+		case 16:
+			*minClusters = 4085;
+			*maxClusters = 65524;
+			break;
+		default:
+			*minClusters = 65525;
+			*maxClusters = 0x0FFFFFF4;
+			break;
+	}
+}
+
+uint32_t getDefaultSectorsPerCluster(FS_Geometry * geo) {
+	if (32 != geo->fatBits)
+		return 1;																				// doubled by the caller until the count fits
+	uint64_t size = (uint64_t)geo->totalSectors * MKFS_BYTES_PER_SECTOR;
+	if (size <= (8ULL << 30))
+		return 8;
+	if (size <= (16ULL << 30))
+		return 16;
+	if (size <= (32ULL << 30))
+		return 32;
+	return 64;
+}
+
+/*
+ * Fills in the layout for the requested size, picking the FAT width and
+ * cluster size when they were left at 0. A fixed cluster size must give a
+ * cluster count in range for the FAT width; otherwise the nearest cluster
+ * size that does is used.
+ */
+uint8_t planGeometry(FS_FormatOptions * options, FS_Geometry * geo) {
+	memset(geo, 0, sizeof(FS_Geometry));
+	if ((options->size / MKFS_BYTES_PER_SECTOR) > 0xFFFFFFFF)
+		return 0;
+	geo->totalSectors = options->size / MKFS_BYTES_PER_SECTOR;
+	geo->fatBits = options->fatBits;
+	if (0 == geo->fatBits) {
+		if (options->size <= (16ULL << 20))
+			geo->fatBits = 12;
+		else if (options->size <= (512ULL << 20))
+			geo->fatBits = 16;
+		else
+			geo->fatBits = 32;
+	}
+	if ((12 != geo->fatBits) && (16 != geo->fatBits) && (32 != geo->fatBits))
+		return 0;
+	geo->reservedSectors = (32 == geo->fatBits) ? MKFS_FAT32_RESERVED_SECTORS : 1;
+	geo->rootEntries = (32 == geo->fatBits) ? 0 : ((12 == geo->fatBits) ? MKFS_FAT12_ROOT_ENTRIES : MKFS_FAT16_ROOT_ENTRIES);
+	geo->rootDirSectors = ((geo->rootEntries * sizeof(fatEntry)) + (MKFS_BYTES_PER_SECTOR - 1)) / MKFS_BYTES_PER_SECTOR;
+
+	uint32_t minClusters, maxClusters;
+	getClusterLimits(geo->fatBits, &minClusters, &maxClusters);
+	uint32_t maxSectorsPerCluster = MKFS_MAX_CLUSTER_BYTES / MKFS_BYTES_PER_SECTOR;
+	if (0 != options->bytesPerCluster) {
+		uint32_t spc = options->bytesPerCluster / MKFS_BYTES_PER_SECTOR;
+		if ((0 == spc) || ((spc * MKFS_BYTES_PER_SECTOR) != options->bytesPerCluster) || (0 != (spc & (spc - 1))) || (spc > maxSectorsPerCluster))
+			return 0;
+		geo->sectorsPerCluster = spc;
+		sizeFAT(geo);
+		return (minClusters <= geo->countOfClusters) && (geo->countOfClusters <= maxClusters);
+	}
+	geo->sectorsPerCluster = getDefaultSectorsPerCluster(geo);
+	sizeFAT(geo);
+	while ((geo->countOfClusters < minClusters) || (geo->countOfClusters > maxClusters)) {	// the range is wide enough that one step never overshoots it
+		if ((geo->countOfClusters < minClusters) && (1 < geo->sectorsPerCluster))
+			geo->sectorsPerCluster /= 2;
+		else if ((geo->countOfClusters > maxClusters) && (geo->sectorsPerCluster < maxSectorsPerCluster))
+			geo->sectorsPerCluster *= 2;
+		else
+			return 0;
+		sizeFAT(geo);
+	}
+	return 1;
+}
+
+void fillBootSector(uint8_t * sector, FS_Geometry * geo, char * label) {
+	fatBS * bs = (fatBS *)sector;
+	bs->BS_jmpBoot[0] = 0xEB;
+	bs->BS_jmpBoot[1] = (32 == geo->fatBits) ? 0x58 : 0x3C;
+	bs->BS_jmpBoot[2] = 0x90;
+	memcpy(bs->BS_OEMName, "FATSHELL", BS_OEMName_LENGTH);
+	bs->BPB_BytsPerSec = MKFS_BYTES_PER_SECTOR;
+	bs->BPB_SecPerClus = geo->sectorsPerCluster;
+	bs->BPB_RsvdSecCnt = geo->reservedSectors;
+	bs->BPB_NumFATs = MKFS_NUM_FATS;
+	bs->BPB_RootEntCnt = geo->rootEntries;
+	bs->BPB_Media = MKFS_MEDIA;
+	bs->BPB_SecPerTrk = 63;
+	bs->BPB_NumHeads = 255;
+	if ((32 != geo->fatBits) && (geo->totalSectors < 0x10000))
+		bs->BPB_TotSec16 = geo->totalSectors;
+	else
+		bs->BPB_TotSec32 = geo->totalSectors;
+
+	uint8_t * volLab;
+	uint8_t * fsType;
+	uint32_t volID = (uint32_t)time(NULL);
+	if (32 == geo->fatBits) {
+		fatBS32 * bs32 = (fatBS32 *)(sector + sizeof(fatBS));
+		bs32->BPB_FATSz32 = geo->FATsz;
+		bs32->BPB_RootClus = 2;
+		bs32->BPB_FSInfo = 1;
+		bs32->BPB_BkBootSec = MKFS_FAT32_BACKUP_BOOT;
+		bs32->BPB_DrvNum = 0x80;
+		bs32->BS_BootSig = 0x29;
+		bs32->BS_VolID = volID;
+		volLab = bs32->BS_VolLab;
+		fsType = bs32->BS_FilSysType;
+		bs32->BS_SigA = 0x55;
+		bs32->BS_SigB = 0xAA;
+	} else {
+		fatBS16 * bs16 = (fatBS16 *)(sector + sizeof(fatBS));
+		bs->BPB_FATSz16 = geo->FATsz;
+		bs16->BPB_DrvNum = 0x80;
+		bs16->BS_BootSig = 0x29;
+		bs16->BS_VolID = volID;
+		volLab = bs16->BS_VolLab;
+		fsType = bs16->BS_FilSysType;
+		bs16->BS_SigA = 0x55;
+		bs16->BS_SigB = 0xAA;
+	}
+	memset(volLab, ' ', BS_VolLab_LENGTH);
+	if (NULL == label)
+		label = "NO NAME";
+	for (int i = 0; (i < BS_VolLab_LENGTH) && ('\0' != label[i]); i++)
+		volLab[i] = toupper((unsigned char)label[i]);
+	memcpy(fsType, (12 == geo->fatBits) ? "FAT12   " : ((16 == geo->fatBits) ? "FAT16   " : "FAT32   "), BS_FilSysType_LENGTH);
+}
+
+/*
+ * Only the first sector of each FAT is written: the reserved entries and, on
+ * FAT32, the end of the root directory's chain. Every other entry is free,
+ * which is the zero a sparse file already reads as.
+ */
+void fillFirstFATSector(uint8_t * sector, FS_Geometry * geo) {
+	switch (geo->fatBits) {
+		case 12:
+			sector[0] = MKFS_MEDIA;
+			sector[1] = 0xFF;
+			sector[2] = 0xFF;
+			break;
+		case 16:
+			((uint16_t *)sector)[0] = 0xFF00 | MKFS_MEDIA;
+			((uint16_t *)sector)[1] = 0xFFFF;
+			break;
+		default:
+			((uint32_t *)sector)[0] = 0x0FFFFF00 | MKFS_MEDIA;
+			((uint32_t *)sector)[1] = 0x0FFFFFFF;
+			((uint32_t *)sector)[2] = 0x0FFFFFFF;												// root directory, one cluster
+			break;
+	}
+}
+
+fs_result format_image(char * imagePath, FS_FormatOptions * options) {
+	FS_Geometry geo;
+	if (!planGeometry(options, &geo))
+		return ERR_INVALIDGEOMETRY;
+	int fd = open(imagePath, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (0 > fd)
+		return (EEXIST == errno) ? ERR_FILENAMEEXISTS : ERR_FOPENFAILEDWRITE;
+	uint8_t ok = (0 == ftruncate(fd, (uint64_t)geo.totalSectors * MKFS_BYTES_PER_SECTOR));	// everything not written below stays a hole
+
+	uint8_t boot[MKFS_BYTES_PER_SECTOR];
+	memset(boot, 0, sizeof(boot));
+	fillBootSector(boot, &geo, options->label);
+	ok = ok && (writeFully(fd, boot, sizeof(boot), 0) == sizeof(boot));
+	if (32 == geo.fatBits) {
+		fat32FSInfo fsInfo;
+		memset(&fsInfo, 0, sizeof(fsInfo));
+		fsInfo.FSI_LeadSig = 0x41615252;
+		fsInfo.FSI_StrucSig = 0x61417272;
+		fsInfo.FSI_Free_Count = geo.countOfClusters - 1;
+		fsInfo.FSI_Nxt_Free = 3;
+		fsInfo.FSI_TrailSig = 0xAA550000;
+		ok = ok && (writeFully(fd, &fsInfo, sizeof(fsInfo), MKFS_BYTES_PER_SECTOR) == sizeof(fsInfo));
+		ok = ok && (writeFully(fd, boot, sizeof(boot), MKFS_FAT32_BACKUP_BOOT * MKFS_BYTES_PER_SECTOR) == sizeof(boot));
+		ok = ok && (writeFully(fd, &fsInfo, sizeof(fsInfo), (MKFS_FAT32_BACKUP_BOOT + 1) * MKFS_BYTES_PER_SECTOR) == sizeof(fsInfo));
+	}
+
+	uint8_t FATSector[MKFS_BYTES_PER_SECTOR];
+	memset(FATSector, 0, sizeof(FATSector));
+	fillFirstFATSector(FATSector, &geo);
+	for (int i = 0; i < MKFS_NUM_FATS; i++) {
+		uint64_t offset = ((uint64_t)geo.reservedSectors + ((uint64_t)i * geo.FATsz)) * MKFS_BYTES_PER_SECTOR;
+		ok = ok && (writeFully(fd, FATSector, sizeof(FATSector), offset) == sizeof(FATSector));
+	}
+
+	if (0 != close(fd))
+		ok = 0;
+	if (!ok) {
+		unlink(imagePath);
+		return ERR_FOPENFAILEDWRITE;
+	}
+	return ERR_SUCCESS;
+}
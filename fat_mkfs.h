@@ -0,0 +1,27 @@
+#ifndef FAT_MKFS_H
+#define FAT_MKFS_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define MKFS_BYTES_PER_SECTOR 512
+#define MKFS_NUM_FATS 2
+#define MKFS_MAX_CLUSTER_BYTES (32 * 1024)
+#define MKFS_FAT12_ROOT_ENTRIES 224
+#define MKFS_FAT16_ROOT_ENTRIES 512
+#define MKFS_FAT32_RESERVED_SECTORS 32
+#define MKFS_FAT32_BACKUP_BOOT 6
+#define MKFS_MEDIA 0xF8
+
+struct FS_FormatOptions_struct {
+	uint64_t size;																				// bytes, rounded down to whole sectors
+	uint32_t bytesPerCluster;																	// 0 to pick one from the size
+	uint8_t fatBits;																			// 12, 16 or 32, 0 to pick from the size
+	char * label;																				// NULL for "NO NAME"
+};
+
+typedef struct FS_FormatOptions_struct FS_FormatOptions;
+
+fs_result format_image(char * imagePath, FS_FormatOptions * options);
+
+#endif
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE																				// FNM_CASEFOLD, strcasestr
+#include <fnmatch.h>
+#include "fat_names.h"
+#include "fat_helpers.h"
+#include "fat_index.h"
+
+struct FS_NameHash_struct {
+	uint64_t * keys;
+	FS_NameEntry ** values;																		// NULL marks a free slot
+	uint32_t numSlots;																			// always a power of two
+	uint32_t count;
+};
+
+typedef struct FS_NameHash_struct FS_NameHash;
+
+struct FS_NameIndex_struct {
+	FS_NameEntry ** entries;
+	uint32_t numEntries;
+	uint32_t allocEntries;
+	FS_NameHash byOffset;
+	FS_NameHash byDirCluster;																	// the entry of each directory, found by its first cluster
+};
+
+typedef struct FS_NameIndex_struct FS_NameIndex;
+
+uint32_t getNameHashSlot(FS_NameHash * hash, uint64_t key) {
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (hash->numSlots - 1);
+}
+
+FS_NameEntry * findInNameHash(FS_NameHash * hash, uint64_t key) {
+	if (0 == hash->numSlots)
+		return NULL;
+	for (uint32_t i = getNameHashSlot(hash, key); NULL != hash->values[i]; i = (i + 1) & (hash->numSlots - 1))
+		if (hash->keys[i] == key)
+			return hash->values[i];
+	return NULL;
+}
+
+uint8_t putInNameHash(FS_NameHash * hash, uint64_t key, FS_NameEntry * value) {
+	if ((2 * (hash->count + 1)) > hash->numSlots) {											// kept at most half full
+		FS_NameHash grown;
+		grown.numSlots = (0 == hash->numSlots) ? 256 : (hash->numSlots * 2);
+		grown.count = 0;
+		grown.keys = malloc(grown.numSlots * sizeof(uint64_t));
+		grown.values = calloc(grown.numSlots, sizeof(FS_NameEntry *));
+		if ((NULL == grown.keys) || (NULL == grown.values)) {
+			free(grown.keys);
+			free(grown.values);
+			return 0;
+		}
+		for (uint32_t i = 0; i < hash->numSlots; i++)
+			if (NULL != hash->values[i])
+				putInNameHash(&grown, hash->keys[i], hash->values[i]);
+		free(hash->keys);
+		free(hash->values);
+		*hash = grown;
+	}
+	uint32_t i = getNameHashSlot(hash, key);
+	while ((NULL != hash->values[i]) && (hash->keys[i] != key))
+		i = (i + 1) & (hash->numSlots - 1);
+	if (NULL == hash->values[i])
+		hash->count++;
+	hash->keys[i] = key;
+	hash->values[i] = value;
+	return 1;
+}
+
+/*
+ * Linear probing with no tombstones: every entry after the removed one in the
+ * same cluster of slots is moved back if its home slot no longer lets a
+ * lookup reach it.
+ */
+void removeFromNameHash(FS_NameHash * hash, uint64_t key) {
+	if (0 == hash->numSlots)
+		return;
+	uint32_t mask = hash->numSlots - 1;
+	uint32_t i = getNameHashSlot(hash, key);
+	while ((NULL != hash->values[i]) && (hash->keys[i] != key))
+		i = (i + 1) & mask;
+	if (NULL == hash->values[i])
+		return;
+	hash->values[i] = NULL;
+	hash->count--;
+	for (uint32_t j = (i + 1) & mask; NULL != hash->values[j]; j = (j + 1) & mask) {
+		uint32_t home = getNameHashSlot(hash, hash->keys[j]);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			hash->keys[i] = hash->keys[j];
+			hash->values[i] = hash->values[j];
+			hash->values[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+void freeNameHash(FS_NameHash * hash) {
+	free(hash->keys);
+	free(hash->values);
+}
+
+void dropNameIndex(FS_Instance * fsi) {
+	FS_NameIndex * index = fsi->names;
+	if (NULL == index)
+		return;
+	for (uint32_t i = 0; i < index->numEntries; i++) {
+		free(index->entries[i]->path);
+		free(index->entries[i]);
+	}
+	free(index->entries);
+	freeNameHash(&(index->byOffset));
+	freeNameHash(&(index->byDirCluster));
+	free(index);
+	fsi->names = NULL;
+}
+
+void fillNameEntry(FS_NameEntry * ne, fatEntry * entry) {
+	formatShortName(entry, ne->shortName);
+	ne->attr = entry->DIR_Attr;
+	ne->size = entry->DIR_FileSize;
+	ne->cluster = getClusterForEntry(entry);
+	ne->date = entry->DIR_WrtDate;
+	ne->time = entry->DIR_WrtTime;
+}
+
+uint8_t isIndexedDir(FS_NameEntry * ne, FS_Instance * fsi) {
+	return maskAndTest(ne->attr, ATTR_DIRECTORY) && isDataCluster(ne->cluster, fsi);
+}
+
+FS_NameEntry * insertName(FS_NameIndex * index, char * dirPath, char * name, fatEntry * entry, uint64_t entryOffset, FS_Instance * fsi) {
+	if ((index->numEntries == index->allocEntries) && !growIndexArray((void **)&(index->entries), &(index->allocEntries), index->numEntries + 1, sizeof(FS_NameEntry *)))
+		return NULL;
+	FS_NameEntry * ne = calloc(1, sizeof(FS_NameEntry));
+	if ((NULL == ne) || (NULL == (ne->path = joinPath(dirPath, name)))) {
+		free(ne);
+		return NULL;
+	}
+	ne->name = ne->path + strlen(dirPath) + 1;
+	fillNameEntry(ne, entry);
+	ne->entryOffset = entryOffset;
+	ne->slot = index->numEntries;
+	index->entries[index->numEntries++] = ne;
+	if (!putInNameHash(&(index->byOffset), entryOffset, ne))
+		return NULL;
+	if (isIndexedDir(ne, fsi) && (NULL == findInNameHash(&(index->byDirCluster), ne->cluster)) && !putInNameHash(&(index->byDirCluster), ne->cluster, ne))
+		return NULL;
+	return ne;
+}
+
+void deleteNameEntry(FS_NameIndex * index, FS_NameEntry * ne, FS_Instance * fsi) {
+	if (findInNameHash(&(index->byOffset), ne->entryOffset) == ne)
+		removeFromNameHash(&(index->byOffset), ne->entryOffset);
+	if (isIndexedDir(ne, fsi) && (findInNameHash(&(index->byDirCluster), ne->cluster) == ne))
+		removeFromNameHash(&(index->byDirCluster), ne->cluster);
+	FS_NameEntry * last = index->entries[--index->numEntries];
+	index->entries[ne->slot] = last;
+	last->slot = ne->slot;
+	free(ne->path);
+	free(ne);
+}
+
+/* Path of an indexed directory, "" for the root, NULL if it is not known */
+char * getIndexedDirPath(FS_NameIndex * index, FS_Cluster dir, FS_Instance * fsi) {
+	if (fs_get_root(fsi) == dir)
+		return "";
+	FS_NameEntry * ne = findInNameHash(&(index->byDirCluster), dir);
+	return (NULL != ne) ? ne->path : NULL;
+}
+
+/*
+ * Walks the whole tree once, breadth first, reading cluster chains from one
+ * copy of the FAT. The entry array doubles as the queue: every directory is
+ * appended to it when found and listed when the walk reaches it.
+ */
+uint8_t buildNameIndex(FS_Instance * fsi) {
+	dropNameIndex(fsi);
+	FS_NameIndex * index = calloc(1, sizeof(FS_NameIndex));
+	FS_FATEntry * FAT = loadFATTable(fsi);
+	if ((NULL == index) || (NULL == FAT)) {
+		free(index);
+		free(FAT);
+		return 0;
+	}
+	fsi->names = index;
+	uint8_t ok = 1;
+	FS_Cluster dir = fs_get_root(fsi);
+	char * dirPath = "";
+	for (uint32_t next = 0; ok; next++) {
+		FS_EntryList * el = getDirListingWithFAT(dir, FAT, fsi);
+		while (NULL != el) {
+			FS_Entry * ent = el->node;
+			if (ok && ('.' != ent->entry->DIR_Name[0]) && !maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID)) {
+				char * name = getDisplayNameForEntry(ent);
+				ok = (NULL != name) && (NULL != insertName(index, dirPath, name, ent->entry, ent->info->entryOffset, fsi));
+				free(name);
+			}
+			FS_EntryList * toFree = el;
+			el = el->next;
+			freeFSEntryListItem(toFree);
+		}
+		while ((next < index->numEntries) && (!isIndexedDir(index->entries[next], fsi) || (findInNameHash(&(index->byDirCluster), index->entries[next]->cluster) != index->entries[next])))
+			next++;																				// a directory reached twice is only listed once
+		if (next >= index->numEntries)
+			break;
+		dir = index->entries[next]->cluster;
+		dirPath = index->entries[next]->path;
+	}
+	free(FAT);
+	if (!ok)
+		dropNameIndex(fsi);
+	return ok;
+}
+
+/*
+ * The hooks below keep a built index in step with the entries written by
+ * addDirListing, markEntriesDeleted and updateDirEntry. Anything they cannot
+ * follow drops the index, and the next query builds it again.
+ */
+void addNameToIndex(FS_Cluster dir, char * longName, fatEntry * entry, uint64_t entryOffset, FS_Instance * fsi) {
+	FS_NameIndex * index = fsi->names;
+	if (NULL == index)
+		return;
+	char * dirPath = getIndexedDirPath(index, dir, fsi);
+	char shortName[DIR_Name_LENGTH + 2];
+	formatShortName(entry, shortName);
+	if ((NULL == dirPath) || (NULL == insertName(index, dirPath, (NULL != longName) ? longName : shortName, entry, entryOffset, fsi)))
+		dropNameIndex(fsi);
+}
+
+void removeNameFromIndex(uint64_t entryOffset, FS_Instance * fsi) {
+	FS_NameIndex * index = fsi->names;
+	if (NULL == index)
+		return;
+	FS_NameEntry * ne = findInNameHash(&(index->byOffset), entryOffset);
+	if (NULL == ne)
+		return;
+	if (maskAndTest(ne->attr, ATTR_DIRECTORY)) {
+		size_t prefixLength = strlen(ne->path);
+		for (uint32_t i = 0; i < index->numEntries; ) {
+			FS_NameEntry * below = index->entries[i];
+			if ((0 == strncmp(below->path, ne->path, prefixLength)) && ('/' == below->path[prefixLength]))
+				deleteNameEntry(index, below, fsi);											// the last entry moves into slot i
+			else
+				i++;
+		}
+	}
+	deleteNameEntry(index, ne, fsi);
+}
+
+void updateNameInIndex(fatEntry * entry, uint64_t entryOffset, FS_Instance * fsi) {
+	FS_NameIndex * index = fsi->names;
+	if (NULL == index)
+		return;
+	FS_NameEntry * ne = findInNameHash(&(index->byOffset), entryOffset);
+	if (NULL == ne)
+		return;
+	FS_Cluster oldCluster = ne->cluster;
+	fillNameEntry(ne, entry);
+	if (isIndexedDir(ne, fsi) && (oldCluster != ne->cluster))
+		dropNameIndex(fsi);																		// directory chains never move today, but its path lookup would go stale
+}
+
+uint64_t getNameDateKey(FS_NameEntry * ne) {
+	return ((uint64_t)ne->date.year << 25) | ((uint64_t)ne->date.month << 21) | ((uint64_t)ne->date.day << 16) |
+		((uint64_t)ne->time.hour << 11) | ((uint64_t)ne->time.min << 5) | ne->time.sec;
+}
+
+uint8_t nameMatchesQuery(FS_NameEntry * ne, FS_NameQuery * query, uint8_t isGlob) {
+	if ((ne->size < query->minSize) || ((0 != query->maxSize) && (ne->size > query->maxSize)))
+		return 0;
+	uint64_t key = getNameDateKey(ne);
+	if (((0 != query->after) && (key < query->after)) || ((0 != query->before) && (key >= query->before)))
+		return 0;
+	if (NULL == query->pattern)
+		return 1;
+	if (isGlob)
+		return (0 == fnmatch(query->pattern, ne->name, FNM_CASEFOLD)) || (0 == fnmatch(query->pattern, ne->shortName, FNM_CASEFOLD));
+	return (NULL != strcasestr(ne->name, query->pattern)) || (NULL != strcasestr(ne->shortName, query->pattern));
+}
+
+int compareNamePaths(const void * a, const void * b) {
+	return strcasecmp((*(FS_NameEntry * const *)a)->path, (*(FS_NameEntry * const *)b)->path);
+}
+
+/*
+ * Answers a query from the name index, building it first if there is none.
+ * The matches, sorted by path, stay valid until the volume next changes; only
+ * the array itself is the caller's to free.
+ */
+fs_result find_names(FS_Instance * fsi, FS_NameQuery * query, FS_NameEntry *** matches, uint32_t * numMatches) {
+	*matches = NULL;
+	*numMatches = 0;
+	if ((NULL == fsi->names) && !buildNameIndex(fsi))
+		return ERR_MALLOCFAILED;
+	FS_NameIndex * index = fsi->names;
+	uint8_t isGlob = (NULL != query->pattern) && hasWildcards(query->pattern);
+	uint32_t allocMatches = 0;
+	for (uint32_t i = 0; i < index->numEntries; i++) {
+		if (!nameMatchesQuery(index->entries[i], query, isGlob))
+			continue;
+		if (!growIndexArray((void **)matches, &allocMatches, *numMatches + 1, sizeof(FS_NameEntry *))) {
+			free(*matches);
+			*matches = NULL;
+			*numMatches = 0;
+			return ERR_MALLOCFAILED;
+		}
+		(*matches)[(*numMatches)++] = index->entries[i];
+	}
+	if (0 < *numMatches)
+		qsort(*matches, *numMatches, sizeof(FS_NameEntry *), compareNamePaths);
+	return ERR_SUCCESS;
+}
+
+uint8_t parseFindDate(char * value, uint64_t * key) {
+	int year, month, day;
+	char sep1, sep2, extra;
+	if ((NULL == value) || (5 != sscanf(value, "%d%c%d%c%d%c", &year, &sep1, &month, &sep2, &day, &extra)))
+		return 0;
+	if ((sep1 != sep2) || (('-' != sep1) && ('/' != sep1)) || (year < 1980) || (year > 2107) || (month < 1) || (month > 12) || (day < 1) || (day > 31))
+		return 0;
+	*key = ((uint64_t)(year - 1980) << 25) | ((uint64_t)month << 21) | ((uint64_t)day << 16);
+	return 1;
+}
+
+uint8_t parse_find_options(char * args, FS_NameQuery * query) {
+	memset(query, 0, sizeof(FS_NameQuery));
+	char * toke = (NULL != args) ? strtok(args, " ") : NULL;
+	while (NULL != toke) {
+		if ((strcmp(toke, FIND_ARG_MIN_SIZE) == 0) || (strcmp(toke, FIND_ARG_MAX_SIZE) == 0)) {
+			char * value = strtok(NULL, " ");
+			char * end = NULL;
+			long long size = (NULL != value) ? strtoll(value, &end, 10) : -1;
+			if ((size < 0) || (end == value) || ('\0' != *end))
+				return 0;
+			if (strcmp(toke, FIND_ARG_MIN_SIZE) == 0)
+				query->minSize = size;
+			else
+				query->maxSize = size;
+		} else if (strcmp(toke, FIND_ARG_AFTER) == 0) {
+			if (!parseFindDate(strtok(NULL, " "), &(query->after)))
+				return 0;
+		} else if (strcmp(toke, FIND_ARG_BEFORE) == 0) {
+			if (!parseFindDate(strtok(NULL, " "), &(query->before)))
+				return 0;
+		} else if ((('-' == toke[0]) && ('-' == toke[1])) || (NULL != query->pattern)) {
+			return 0;
+		} else {
+			query->pattern = toke;
+		}
+		toke = strtok(NULL, " ");
+	}
+	return 1;
+}
+
+fs_result print_find(FS_Instance * fsi, FS_NameQuery * query) {
+	FS_NameEntry ** matches;
+	uint32_t numMatches;
+	fs_result result = find_names(fsi, query, &matches, &numMatches);
+	if (ERR_SUCCESS != result)
+		return result;
+	for (uint32_t i = 0; i < numMatches; i++) {
+		FS_NameEntry * ne = matches[i];
+		if (maskAndTest(ne->attr, ATTR_DIRECTORY))
+			printf("%12s", "");
+		else
+			printf("%12u", ne->size);
+		printf(" %04d/%02d/%02d %02d:%02d:%02d  %s%s\n", ne->date.year + 1980, ne->date.month, ne->date.day, ne->time.hour, ne->time.min, ne->time.sec * 2,
+			ne->path, maskAndTest(ne->attr, ATTR_DIRECTORY) ? "/" : "");
+	}
+	printf("%u match(es)\n", numMatches);
+	free(matches);
+	return ERR_SUCCESS;
+}
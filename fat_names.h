@@ -0,0 +1,47 @@
+#ifndef FAT_NAMES_H
+#define FAT_NAMES_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+#include "fat.h"
+
+#define FIND_ARG_MIN_SIZE "--min-size"
+#define FIND_ARG_MAX_SIZE "--max-size"
+#define FIND_ARG_AFTER "--after"
+#define FIND_ARG_BEFORE "--before"
+
+struct FS_NameEntry_struct {
+	char * path;																				// from the root, long names where there are any
+	char * name;																				// the last part of path
+	char shortName[DIR_Name_LENGTH + 2];
+	uint8_t attr;
+	uint32_t size;
+	FS_Cluster cluster;
+	fatDate date;
+	fatTime time;
+	uint64_t entryOffset;																		// of the short entry, which is what identifies it
+	uint32_t slot;																				// its position in the index's entry array
+};
+
+struct FS_NameQuery_struct {
+	char * pattern;																				// glob if it has wildcards, otherwise a substring; NULL for any
+	uint64_t minSize;
+	uint64_t maxSize;																			// 0 for no limit, likewise below
+	uint64_t after;																				// the date and time packed the way DIR --sort date compares them
+	uint64_t before;
+};
+
+typedef struct FS_NameEntry_struct FS_NameEntry;
+typedef struct FS_NameQuery_struct FS_NameQuery;
+
+uint8_t buildNameIndex(FS_Instance * fsi);
+void dropNameIndex(FS_Instance * fsi);
+void addNameToIndex(FS_Cluster dir, char * longName, fatEntry * entry, uint64_t entryOffset, FS_Instance * fsi);
+void removeNameFromIndex(uint64_t entryOffset, FS_Instance * fsi);
+void updateNameInIndex(fatEntry * entry, uint64_t entryOffset, FS_Instance * fsi);
+
+fs_result find_names(FS_Instance * fsi, FS_NameQuery * query, FS_NameEntry *** matches, uint32_t * numMatches);
+uint8_t parse_find_options(char * args, FS_NameQuery * query);
+fs_result print_find(FS_Instance * fsi, FS_NameQuery * query);
+
+#endif
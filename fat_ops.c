@@ -0,0 +1,25 @@
+#include "fat_ops.h"
+
+#define FAT_BITS 12
+#include "fat_ops_template.h"
+#undef FAT_BITS
+
+#define FAT_BITS 16
+#include "fat_ops_template.h"
+#undef FAT_BITS
+
+#define FAT_BITS 32
+#include "fat_ops_template.h"
+#undef FAT_BITS
+
+const FS_FATOps * getFATOps(fs_type type) {
+	switch (type) {
+		case FS_FAT12:
+			return &ops12;
+		case FS_FAT16:
+			return &ops16;
+		case FS_FAT32:
+			return &ops32;
+	}
+	return NULL;
+}
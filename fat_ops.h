@@ -0,0 +1,28 @@
+#ifndef FAT_OPS_H
+#define FAT_OPS_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+/*
+ * Per-width FAT entry handling, picked once at mount so the hot loops never
+ * switch on the FAT type. Offsets are in bytes from the start of a FAT copy.
+ */
+struct FS_FATOps_struct {
+	uint8_t bits;
+	uint8_t entryBytes;																			// bytes touched to read or write one entry
+	FS_FATEntry eofMarker;
+	FS_FATEntry badMarker;
+	FS_FATEntry (*decode)(const uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster);
+	void (*encode)(uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster, FS_FATEntry entry);
+	void (*unpack)(const uint8_t * FAT, FS_FATEntry * table, FS_Cluster first, FS_Cluster end);
+	void (*pack)(uint8_t * FAT, const FS_FATEntry * table, FS_Cluster first, FS_Cluster end);
+	FS_Cluster (*findFree)(const uint8_t * FAT, uint64_t base, FS_Cluster first, FS_Cluster end);
+	uint32_t (*walk)(const uint8_t * FAT, uint64_t base, uint64_t len, FS_Cluster cluster, FS_Cluster end, FS_Cluster * next, uint32_t max);
+};
+
+typedef struct FS_FATOps_struct FS_FATOps;
+
+const FS_FATOps * getFATOps(fs_type type);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Included once per FAT width by fat_ops.c with FAT_BITS set to 12, 16 or 32.
+ * Every function gets the width appended to its name, e.g. decode12.
+ */
+
+#define FAT_PASTE2(a, b) a##b
+#define FAT_PASTE(a, b) FAT_PASTE2(a, b)
+#define FAT_NAME(name) FAT_PASTE(name, FAT_BITS)
+
+static inline FS_FATEntry FAT_NAME(decode)(const uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster) {
+#if FAT_BITS == 12
+	return ((*((uint16_t *)&FAT[entOffset])) >> ((cluster & 1) << 2)) & 0x0FFF;			// odd entries sit in the high 12 bits
+#elif FAT_BITS == 16
+	return (*((uint16_t *)&FAT[entOffset]));
+#else
+	return ((*((uint32_t *)&FAT[entOffset])) & 0x0FFFFFFF);
+#endif
+}
+
+static inline void FAT_NAME(encode)(uint8_t * FAT, uint64_t entOffset, FS_Cluster cluster, FS_FATEntry entry) {
+#if FAT_BITS == 12
+	uint8_t shift = (cluster & 1) << 2;
+	uint16_t * pair = (uint16_t *)&FAT[entOffset];
+	*pair = (*pair & ~(0x0FFF << shift)) | ((entry & 0x0FFF) << shift);
+#elif FAT_BITS == 16
+	(*((uint16_t *)&FAT[entOffset])) = entry;
+#else
+	uint32_t * slot = (uint32_t *)&FAT[entOffset];
+	*slot = (*slot & 0xF0000000) | (entry & 0x0FFFFFFF);										// the top four bits are reserved
+#endif
+}
+
+/* Decodes entries first..end-1 of a whole FAT into table; first must be even */
+static void FAT_NAME(unpack)(const uint8_t * FAT, FS_FATEntry * table, FS_Cluster first, FS_Cluster end) {
+	FS_Cluster i = first;
+#if FAT_BITS == 12
+	for (const uint8_t * b = FAT + ((uint64_t)i * 3 / 2); (i + 1) < end; i += 2, b += 3) {	// three bytes hold a pair
+		table[i] = b[0] | ((b[1] & 0x0F) << 8);
+		table[i + 1] = (b[1] >> 4) | (b[2] << 4);
+	}
+#endif
+	for (; i < end; i++)
+		table[i] = FAT_NAME(decode)(FAT, ((uint64_t)i * FAT_BITS) / 8, i);
+}
+
+/* Encodes entries first..end-1 of table back into a whole FAT; first must be even */
+static void FAT_NAME(pack)(uint8_t * FAT, const FS_FATEntry * table, FS_Cluster first, FS_Cluster end) {
+	FS_Cluster i = first;
+#if FAT_BITS == 12
+	for (uint8_t * b = FAT + ((uint64_t)i * 3 / 2); (i + 1) < end; i += 2, b += 3) {
+		b[0] = table[i] & 0xFF;
+		b[1] = ((table[i] >> 8) & 0x0F) | ((table[i + 1] & 0x0F) << 4);
+		b[2] = (table[i + 1] >> 4) & 0xFF;
+	}
+#endif
+	for (; i < end; i++)
+		FAT_NAME(encode)(FAT, ((uint64_t)i * FAT_BITS) / 8, i, table[i]);
+}
+
+/* First free cluster in first..end-1, whose entries start at FAT offset base in FAT; 0 if none */
+static FS_Cluster FAT_NAME(findFree)(const uint8_t * FAT, uint64_t base, FS_Cluster first, FS_Cluster end) {
+	for (FS_Cluster i = first; i < end; i++)
+		if (0 == FAT_NAME(decode)(FAT, (((uint64_t)i * FAT_BITS) / 8) - base, i))
+			return i;
+	return 0;
+}
+
+/*
+ * Follows the chain from cluster through the len bytes of FAT read from FAT
+ * offset base, storing each successor in next until one is not a cluster
+ * below end, the next entry lies outside those bytes, or max are stored
+ */
+static uint32_t FAT_NAME(walk)(const uint8_t * FAT, uint64_t base, uint64_t len, FS_Cluster cluster, FS_Cluster end, FS_Cluster * next, uint32_t max) {
+	uint32_t n = 0;
+	while (n < max) {
+		uint64_t entOffset = ((uint64_t)cluster * FAT_BITS) / 8;
+		if ((entOffset < base) || ((entOffset - base + ((FAT_BITS == 32) ? 4 : 2)) > len))
+			break;
+		cluster = FAT_NAME(decode)(FAT, entOffset - base, cluster);
+		next[n++] = cluster;
+		if ((2 > cluster) || (cluster >= end))
+			break;																				// end of chain, free or bad, the caller sorts it out
+	}
+	return n;
+}
+
+static const FS_FATOps FAT_NAME(ops) = {
+	FAT_BITS,
+	(FAT_BITS == 32) ? 4 : 2,
+#if FAT_BITS == 12
+	0x00000FF8, 0x00000FF7,
+#elif FAT_BITS == 16
+	0x0000FFF8, 0x0000FFF7,
+#else
+	0x0FFFFFF8, 0x0FFFFFF7,
+#endif
+	FAT_NAME(decode),
+	FAT_NAME(encode),
+	FAT_NAME(unpack),
+	FAT_NAME(pack),
+	FAT_NAME(findFree),
+	FAT_NAME(walk)
+};
+
+#undef FAT_NAME
+#undef FAT_PASTE
+#undef FAT_PASTE2
@@ -0,0 +1,278 @@
+#include <fcntl.h>
+#include "fat_overlay.h"
+#include "fat_helpers.h"
+
+uint64_t getOverlayHash(uint64_t key, uint64_t tableSize) {
+	return (key * 0x9E3779B97F4A7C15) & (tableSize - 1);
+}
+
+int64_t findOverlaySlot(FS_Overlay * ov, uint64_t block) {
+	if (0 == ov->tableSize)
+		return -1;
+	uint64_t key = block + 1;
+	for (uint64_t i = getOverlayHash(key, ov->tableSize); 0 != ov->keys[i]; i = (i + 1) & (ov->tableSize - 1))
+		if (key == ov->keys[i])
+			return ov->slots[i];
+	return -1;
+}
+
+uint8_t insertOverlaySlot(FS_Overlay * ov, uint64_t block, uint32_t slot) {
+	if ((2 * (ov->numBlocks + 1)) > ov->tableSize) {										// keep the table at most half full
+		uint64_t size = (0 == ov->tableSize) ? 1024 : (2 * ov->tableSize);
+		uint64_t * keys = calloc(size, sizeof(uint64_t));
+		uint32_t * slots = malloc(size * sizeof(uint32_t));
+		if ((NULL == keys) || (NULL == slots)) {
+			free(keys);
+			free(slots);
+			return 0;
+		}
+		for (uint64_t i = 0; i < ov->tableSize; i++) {
+			if (0 == ov->keys[i])
+				continue;
+			uint64_t j = getOverlayHash(ov->keys[i], size);
+			while (0 != keys[j])
+				j = (j + 1) & (size - 1);
+			keys[j] = ov->keys[i];
+			slots[j] = ov->slots[i];
+		}
+		free(ov->keys);
+		free(ov->slots);
+		ov->keys = keys;
+		ov->slots = slots;
+		ov->tableSize = size;
+	}
+	uint64_t key = block + 1;
+	uint64_t i = getOverlayHash(key, ov->tableSize);
+	while (0 != ov->keys[i])
+		i = (i + 1) & (ov->tableSize - 1);
+	ov->keys[i] = key;
+	ov->slots[i] = slot;
+	return 1;
+}
+
+uint64_t getOverlaySlotOffset(FS_Overlay * ov, uint32_t slot) {
+	return ((uint64_t)slot + 1) * ov->blockSize;
+}
+
+void writeOverlayHeader(FS_Overlay * ov, uint32_t clean, uint64_t tableOffset) {
+	FS_OverlayHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = OVERLAY_MAGIC;
+	header.version = OVERLAY_VERSION;
+	header.blockSize = ov->blockSize;
+	header.clean = clean;
+	header.baseSize = ov->baseSize;
+	header.numBlocks = ov->numBlocks;
+	header.tableOffset = tableOffset;
+	writeFully(ov->fd, &header, sizeof(header), 0);
+}
+
+uint8_t loadOverlayTable(FS_Overlay * ov, FS_OverlayHeader * header) {
+	if (0 == header->numBlocks)
+		return 1;
+	FS_OverlayMapping * table = malloc(header->numBlocks * sizeof(FS_OverlayMapping));
+	if (NULL == table)
+		return 0;
+	size_t tableBytes = header->numBlocks * sizeof(FS_OverlayMapping);
+	uint8_t valid = (readFully(ov->fd, table, tableBytes, header->tableOffset) == tableBytes);
+	for (uint64_t i = 0; valid && (i < header->numBlocks); i++) {
+		valid = (table[i].slot < header->numBlocks) && insertOverlaySlot(ov, table[i].block, table[i].slot);
+		ov->numBlocks++;
+	}
+	free(table);
+	return valid;
+}
+
+uint8_t openOverlay(FS_Instance * fsi, char * overlayPath) {
+	struct stat baseStats;
+	fatBS bootsect;
+	if ((0 != fstat(fsi->disk, &baseStats)) || (readFully(fsi->disk, &bootsect, sizeof(fatBS), 0) != sizeof(fatBS)))
+		return 0;
+	FS_Overlay * ov = calloc(1, sizeof(FS_Overlay));
+	if (NULL == ov)
+		return 0;
+	fsi->overlay = ov;
+	ov->baseSize = baseStats.st_size;
+	ov->fd = open(overlayPath, O_RDWR | O_CREAT, 0644);
+	if (0 > ov->fd)
+		return 0;
+	FS_OverlayHeader header;
+	if (readFully(ov->fd, &header, sizeof(header), 0) == 0) {								// a new overlay, blocks match the base's clusters
+		ov->blockSize = bootsect.BPB_BytsPerSec * bootsect.BPB_SecPerClus;
+		if ((0 == ov->blockSize) || (0 != (ov->blockSize & (ov->blockSize - 1))))
+			return 0;
+		writeOverlayHeader(ov, 1, getOverlaySlotOffset(ov, 0));
+		return 1;
+	}
+	if ((OVERLAY_MAGIC != header.magic) || (OVERLAY_VERSION != header.version) || (header.baseSize != ov->baseSize)) {
+		fprintf(stderr, "%s is not an overlay of this image.\n", overlayPath);
+		return 0;
+	}
+	if (!header.clean) {
+		fprintf(stderr, "Overlay %s was not closed cleanly.\n", overlayPath);
+		return 0;
+	}
+	ov->blockSize = header.blockSize;
+	return loadOverlayTable(ov, &header);
+}
+
+void syncOverlay(FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	if ((NULL == ov) || (0 > ov->fd) || !ov->dirty)
+		return;
+	FS_OverlayMapping * table = malloc(ov->numBlocks * sizeof(FS_OverlayMapping) + 1);
+	if (NULL == table)
+		return;																					// left unclean, so the next open refuses it
+	uint64_t n = 0;
+	for (uint64_t i = 0; i < ov->tableSize; i++) {
+		if (0 != ov->keys[i]) {
+			table[n].block = ov->keys[i] - 1;
+			table[n].slot = ov->slots[i];
+			n++;
+		}
+	}
+	uint64_t tableOffset = getOverlaySlotOffset(ov, ov->numBlocks);
+	size_t tableBytes = n * sizeof(FS_OverlayMapping);
+	if (writeFully(ov->fd, table, tableBytes, tableOffset) == tableBytes) {
+		ftruncate(ov->fd, tableOffset + tableBytes);
+		fdatasync(ov->fd);																		// table before the header that points at it
+		writeOverlayHeader(ov, 1, tableOffset);
+		ov->dirty = 0;
+	}
+	free(table);
+}
+
+void closeOverlay(FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	if (NULL == ov)
+		return;
+	if (0 <= ov->fd) {
+		syncOverlay(fsi);
+		close(ov->fd);
+	}
+	free(ov->keys);
+	free(ov->slots);
+	free(ov);
+	fsi->overlay = NULL;
+}
+
+size_t readOverlay(void * buf, size_t len, uint64_t offset, FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	size_t done = 0;
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint64_t within = pos % ov->blockSize;
+		size_t piece = ov->blockSize - within;
+		if (piece > (len - done))
+			piece = len - done;
+		int64_t slot = findOverlaySlot(ov, pos / ov->blockSize);
+		size_t got;
+		if (0 <= slot)
+			got = readFully(ov->fd, ((uint8_t *)buf) + done, piece, getOverlaySlotOffset(ov, slot) + within);
+		else
+			got = readFully(fsi->disk, ((uint8_t *)buf) + done, piece, pos);
+		if (got < piece)
+			memset(((uint8_t *)buf) + done + got, 0, piece - got);
+		done += piece;
+	}
+	return done;
+}
+
+/* Read-ahead hint for a range of the image, sent wherever readOverlay would read each block from */
+void adviseOverlay(uint64_t offset, uint64_t len, FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	int runFd = -1;
+	uint64_t runStart = 0, runLength = 0;
+	for (uint64_t done = 0; done < len; ) {
+		uint64_t pos = offset + done;
+		uint64_t within = pos % ov->blockSize;
+		uint64_t piece = ov->blockSize - within;
+		if (piece > (len - done))
+			piece = len - done;
+		int64_t slot = findOverlaySlot(ov, pos / ov->blockSize);
+		int fd = (0 <= slot) ? ov->fd : fsi->disk;
+		uint64_t at = (0 <= slot) ? (getOverlaySlotOffset(ov, slot) + within) : pos;
+		if ((fd != runFd) || (at != (runStart + runLength))) {
+			if (0 < runLength)
+				posix_fadvise(runFd, runStart, runLength, POSIX_FADV_WILLNEED);					// one hint per run contiguous in one file
+			runFd = fd;
+			runStart = at;
+			runLength = 0;
+		}
+		runLength += piece;
+		done += piece;
+	}
+	if (0 < runLength)
+		posix_fadvise(runFd, runStart, runLength, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * The first write to a block copies it into the next overlay slot, reading
+ * the rest of the block from the base when the write only covers part of it.
+ */
+size_t writeOverlay(const void * buf, size_t len, uint64_t offset, FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	uint8_t * block = NULL;
+	size_t done = 0;
+	if (!ov->dirty) {
+		writeOverlayHeader(ov, 0, 0);
+		fdatasync(ov->fd);
+		ov->dirty = 1;
+	}
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint64_t within = pos % ov->blockSize;
+		size_t piece = ov->blockSize - within;
+		if (piece > (len - done))
+			piece = len - done;
+		int64_t slot = findOverlaySlot(ov, pos / ov->blockSize);
+		const uint8_t * data = ((const uint8_t *)buf) + done;
+		size_t step = piece;
+		if (0 > slot) {
+			if (0xFFFFFFFF == ov->numBlocks)
+				break;
+			slot = ov->numBlocks;
+			if (piece < ov->blockSize) {
+				if ((NULL == block) && (NULL == (block = malloc(ov->blockSize))))
+					break;
+				size_t got = readFully(fsi->disk, block, ov->blockSize, pos - within);
+				memset(block + got, 0, ov->blockSize - got);
+				memcpy(block + within, data, piece);
+				data = block;
+			}
+			if (writeFully(ov->fd, data, ov->blockSize, getOverlaySlotOffset(ov, slot)) < ov->blockSize)
+				break;
+			if (!insertOverlaySlot(ov, pos / ov->blockSize, slot))
+				break;
+			ov->numBlocks++;
+			done += step;
+			continue;
+		}
+		size_t written = writeFully(ov->fd, data, piece, getOverlaySlotOffset(ov, slot) + within);
+		done += written;
+		if (written < piece)
+			break;
+	}
+	free(block);
+	return done;
+}
+
+uint8_t copyOverlayBlocks(int out, uint64_t size, FS_Instance * fsi) {
+	FS_Overlay * ov = fsi->overlay;
+	uint8_t * block = malloc(ov->blockSize);
+	if (NULL == block)
+		return 0;
+	uint8_t ok = 1;
+	for (uint64_t i = 0; ok && (i < ov->tableSize); i++) {
+		uint64_t offset = (ov->keys[i] - 1) * ov->blockSize;
+		if ((0 == ov->keys[i]) || (offset >= size))
+			continue;
+		size_t len = ((size - offset) < ov->blockSize) ? (size - offset) : ov->blockSize;
+		size_t got = readFully(ov->fd, block, len, getOverlaySlotOffset(ov, ov->slots[i]));
+		memset(block + got, 0, len - got);
+		if (!isZeroFilled(block, len))															// the output starts as one big hole
+			ok = (writeFully(out, block, len, offset) == len);
+	}
+	free(block);
+	return ok;
+}
@@ -0,0 +1,58 @@
+#ifndef FAT_OVERLAY_H
+#define FAT_OVERLAY_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define OVERLAY_MAGIC 0x4C564F46																	// "FOVL"
+#define OVERLAY_VERSION 1
+
+#pragma pack(push)
+#pragma pack(1)
+
+/*
+ * Overlay file layout, in units of the block size (the base image's cluster
+ * size): block 0 holds this header, blocks 1..numBlocks hold copies of base
+ * blocks that have been written, and the remap table follows them.
+ */
+struct FS_OverlayHeader_struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t blockSize;
+	uint32_t clean;																				// 0 while the table on disk is out of date
+	uint64_t baseSize;
+	uint64_t numBlocks;
+	uint64_t tableOffset;
+};
+
+struct FS_OverlayMapping_struct {
+	uint64_t block;																				// block number in the base image
+	uint32_t slot;																				// block number in the overlay, less the header
+};
+
+#pragma pack(pop)
+
+struct FS_Overlay_struct {
+	int fd;
+	uint32_t blockSize;
+	uint64_t baseSize;
+	uint64_t numBlocks;
+	uint64_t * keys;																			// open addressing, base block + 1, 0 when empty
+	uint32_t * slots;
+	uint64_t tableSize;																			// a power of two
+	uint8_t dirty;
+};
+
+typedef struct FS_OverlayHeader_struct FS_OverlayHeader;
+typedef struct FS_OverlayMapping_struct FS_OverlayMapping;
+typedef struct FS_Overlay_struct FS_Overlay;
+
+uint8_t openOverlay(FS_Instance * fsi, char * overlayPath);
+void syncOverlay(FS_Instance * fsi);
+void closeOverlay(FS_Instance * fsi);
+size_t readOverlay(void * buf, size_t len, uint64_t offset, FS_Instance * fsi);
+void adviseOverlay(uint64_t offset, uint64_t len, FS_Instance * fsi);
+size_t writeOverlay(const void * buf, size_t len, uint64_t offset, FS_Instance * fsi);
+uint8_t copyOverlayBlocks(int out, uint64_t size, FS_Instance * fsi);
+
+#endif
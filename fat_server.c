@@ -0,0 +1,665 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fat_server.h"
+#include "fat_helpers.h"
+#include "fat_trace.h"
+
+struct FS_ServerConn_struct {
+	int fd;
+	uint32_t image;
+	FS_Directory * dirs;																		// current directory on each image
+	uint8_t * in;
+	size_t inStart;
+	size_t inUsed;
+	size_t inAlloc;
+	uint8_t * out;
+	size_t outSent;
+	size_t outUsed;
+	size_t outAlloc;
+	FS_File * upload;
+	uint8_t uploadReplace;																		// truncate to the bytes received once done
+	uint8_t uploadFailed;																		// keep draining data frames, then report the error
+	char * uploadPath;																			// name the client sent, for the trace and to undo a created file
+	uint8_t uploadCreated;																		// removed again if the upload fails
+	uint64_t uploadStarted;
+	uint64_t uploadBytes;
+	uint64_t uploadStart;																		// size before an APPEND, restored if it does not finish
+	uint64_t uploadReserved;																	// file offset the upload's clusters already reach
+	FS_File * download;
+	char * downloadPath;
+	uint64_t downloadStarted;
+	uint8_t closing;
+	struct FS_ServerConn_struct * prev;
+	struct FS_ServerConn_struct * next;
+};
+
+/*
+ * A file some connection has open. Uploads and downloads keep their handle
+ * across epoll turns, so whatever another connection does to the same entry
+ * in between would be overwritten or read back as freed clusters; DEL, PUT
+ * and APPEND are refused while it is open, and so is GET while it is being
+ * written.
+ */
+struct FS_OpenEntry_struct {
+	uint64_t entryOffset;																		// directory entry of the open file, unique on its image
+	uint32_t readers;
+	uint8_t writing;																			// an upload has it, so nobody else may
+};
+
+struct FS_OpenTable_struct {
+	struct FS_OpenEntry_struct * entries;
+	uint32_t num;
+	uint32_t alloc;
+};
+
+typedef struct FS_OpenEntry_struct FS_OpenEntry;
+typedef struct FS_OpenTable_struct FS_OpenTable;
+
+struct FS_Server_struct {
+	FS_Instance ** images;
+	uint32_t numImages;
+	FS_OpenTable * open;																		// files connections hold open, one table per image
+	int epfd;
+	int listenFd;
+	struct FS_ServerConn_struct * conns;
+};
+
+typedef struct FS_ServerConn_struct FS_ServerConn;
+typedef struct FS_Server_struct FS_Server;
+
+static volatile sig_atomic_t serverStopping = 0;
+
+static const char * resultNames[] = {
+	"SUCCESS",
+	"NOFREESPACE",
+	"FILENAMEEXISTS",
+	"FILENOTFOUND",
+	"FOPENFAILEDREAD",
+	"FOPENFAILEDWRITE",
+	"DELETESPECIALDIR",
+	"MALLOCFAILED",
+	"ROOTDIRFULL",
+	"INVALIDGEOMETRY",
+	"MULTIPLEMATCHES"
+};
+
+FS_OpenEntry * findOpenEntry(FS_OpenTable * table, uint64_t entryOffset) {
+	for (uint32_t i = 0; i < table->num; i++)
+		if (table->entries[i].entryOffset == entryOffset)
+			return &(table->entries[i]);
+	return NULL;
+}
+
+/* Records file as open on image for reading or writing; 0 if that clashes with how it is already open */
+uint8_t claimFile(FS_Server * server, uint32_t image, FS_File * file, uint8_t writing) {
+	FS_OpenTable * table = &(server->open[image]);
+	FS_OpenEntry * oe = findOpenEntry(table, file->info.entryOffset);
+	if (NULL != oe) {
+		if (writing || oe->writing)
+			return 0;
+		oe->readers++;
+		return 1;
+	}
+	if (table->num == table->alloc) {
+		uint32_t alloc = (0 == table->alloc) ? 16 : (table->alloc * 2);
+		FS_OpenEntry * entries = realloc(table->entries, alloc * sizeof(FS_OpenEntry));
+		if (NULL == entries)
+			return 0;
+		table->entries = entries;
+		table->alloc = alloc;
+	}
+	oe = &(table->entries[table->num++]);
+	oe->entryOffset = file->info.entryOffset;
+	oe->readers = writing ? 0 : 1;
+	oe->writing = writing;
+	return 1;
+}
+
+void releaseFile(FS_Server * server, uint32_t image, FS_File * file) {
+	FS_OpenTable * table = &(server->open[image]);
+	FS_OpenEntry * oe = findOpenEntry(table, file->info.entryOffset);
+	if (NULL == oe)
+		return;
+	if (oe->writing)
+		oe->writing = 0;
+	else
+		oe->readers--;
+	if ((0 == oe->writing) && (0 == oe->readers))
+		*oe = table->entries[--table->num];
+}
+
+/*
+ * Whether DEL path in conn's directory would remove a file someone has open.
+ * Files are matched the way delete_file matches them; removing a directory
+ * is refused while anything on the image is open, as working out what lies
+ * below it would mean walking the whole tree.
+ */
+uint8_t deleteTouchesOpenFile(FS_Server * server, FS_ServerConn * conn, char * path) {
+	FS_OpenTable * table = &(server->open[conn->image]);
+	if (0 == table->num)
+		return 0;
+	uint8_t busy = 0;
+	FS_DirCache * dc = openDir((FS_Cluster)conn->dirs[conn->image], server->images[conn->image]);
+	if (NULL == dc)
+		return 1;
+	if (hasWildcards(path)) {
+		for (FS_EntryList * item = dc->listing; (NULL != item) && !busy; item = item->next) {
+			FS_Entry * ent = item->node;
+			if (!maskAndTest(ent->entry->DIR_Attr, ATTR_VOLUME_ID) && !maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) && entryMatchesPattern(ent, path))
+				busy = (NULL != findOpenEntry(table, ent->info->entryOffset));
+		}
+	} else {
+		FS_Entry * ent = findEntryByName(dc->hash, path);
+		if (NULL != ent)
+			busy = maskAndTest(ent->entry->DIR_Attr, ATTR_DIRECTORY) || (NULL != findOpenEntry(table, ent->info->entryOffset));
+	}
+	closeDir(dc, server->images[conn->image]);
+	return busy;
+}
+
+void stopServer(int sig) {
+	serverStopping = 1;
+}
+
+uint8_t reserveOutput(FS_ServerConn * conn, size_t len) {
+	if (conn->outSent == conn->outUsed)
+		conn->outSent = conn->outUsed = 0;
+	if ((conn->outUsed + len) <= conn->outAlloc)
+		return 1;
+	size_t alloc = (0 == conn->outAlloc) ? SERVER_CHUNK_BYTES : conn->outAlloc;
+	while (alloc < (conn->outUsed + len))
+		alloc *= 2;
+	uint8_t * out = realloc(conn->out, alloc);
+	if (NULL == out)
+		return 0;
+	conn->out = out;
+	conn->outAlloc = alloc;
+	return 1;
+}
+
+uint8_t queueFrame(FS_ServerConn * conn, const void * payload, uint32_t len) {
+	if (!reserveOutput(conn, sizeof(uint32_t) + len)) {
+		conn->closing = 1;
+		return 0;
+	}
+	uint32_t netLen = htonl(len);
+	memcpy(conn->out + conn->outUsed, &netLen, sizeof(uint32_t));
+	if (0 < len)
+		memcpy(conn->out + conn->outUsed + sizeof(uint32_t), payload, len);
+	conn->outUsed += sizeof(uint32_t) + len;
+	return 1;
+}
+
+void queueReply(FS_ServerConn * conn, const char * format, ...) {
+	char reply[DIR_LINE_BYTES];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(reply, sizeof(reply), format, args);
+	va_end(args);
+	if (len >= (int)sizeof(reply))
+		len = sizeof(reply) - 1;
+	queueFrame(conn, reply, (0 < len) ? len : 0);
+}
+
+void queueResult(FS_ServerConn * conn, fs_result result) {
+	if (ERR_SUCCESS == result)
+		queueReply(conn, "OK");
+	else
+		queueReply(conn, "ERR %s", resultNames[result]);
+}
+
+void queueListing(FS_Server * server, FS_ServerConn * conn, char * args) {
+	FS_DirOptions options = { NULL, DIR_SORT_NONE, 0, 0, 0, 0 };
+	if (!parse_dir_options(args, &options)) {
+		queueReply(conn, "ERR BADARGS");
+		return;
+	}
+	char * listing = NULL;
+	size_t len = 0;
+	FILE * stream = open_memstream(&listing, &len);
+	if (NULL == stream) {
+		queueResult(conn, ERR_MALLOCFAILED);
+		return;
+	}
+	fputs("OK\n", stream);
+	fprint_dir(stream, server->images[conn->image], conn->dirs[conn->image], &options);
+	fclose(stream);
+	queueFrame(conn, listing, len);
+	free(listing);
+}
+
+/*
+ * PUT, APPEND and GET are traced here, where the client's request starts and
+ * ends, as the file itself goes through fs_open and fs_create. Transfers the
+ * client abandons midway are left out of the trace.
+ */
+void startUpload(FS_Server * server, FS_ServerConn * conn, char * path, uint8_t append) {
+	FS_Instance * fsi = server->images[conn->image];
+	FS_Directory dir = conn->dirs[conn->image];
+	uint64_t started = traceStart(fsi);
+	char * uploadPath = strdup(path);
+	if (NULL == uploadPath) {
+		queueResult(conn, ERR_MALLOCFAILED);
+		return;
+	}
+	FS_File * file = NULL;
+	uint8_t created = 0;
+	fs_result result = fs_open(fsi, dir, path, &file);
+	if ((ERR_FILENOTFOUND == result) && !append) {
+		created = 1;
+		result = fs_create(fsi, dir, path, &file);
+	}
+	if ((ERR_SUCCESS == result) && !claimFile(server, conn->image, file, 1)) {
+		fs_close(file);
+		if (created)
+			deleteItems(fsi, dir, path);
+		free(uploadPath);
+		queueReply(conn, "ERR BUSY");
+		return;
+	}
+	if (ERR_SUCCESS != result) {
+		traceCall(fsi, append ? TRACE_APPEND : TRACE_PUT, dir, path, NULL, result, 0, started);
+		free(uploadPath);
+		queueResult(conn, result);
+		return;
+	}
+	if (append)
+		fs_seek(file, 0, SEEK_END);
+	conn->upload = file;
+	conn->uploadPath = uploadPath;
+	conn->uploadCreated = created;
+	conn->uploadStarted = started;
+	conn->uploadReplace = !append;
+	conn->uploadFailed = 0;
+	conn->uploadBytes = 0;
+	conn->uploadStart = fs_size(file);
+	conn->uploadReserved = fs_size(file);
+	queueReply(conn, "OK");
+}
+
+/*
+ * Closes conn's upload. One that did not complete is undone as far as it can
+ * be: a file it created is deleted again and an APPEND is cut back to its old
+ * size. A PUT over an existing file has already overwritten the start of it,
+ * so it keeps just the bytes that arrived rather than the old tail after them.
+ */
+fs_result finishUpload(FS_Server * server, FS_ServerConn * conn, uint8_t complete) {
+	uint64_t keep = fs_size(conn->upload);
+	if (conn->uploadReplace)
+		keep = conn->uploadBytes;
+	else if (!complete)
+		keep = conn->uploadStart;
+	fs_result result = ERR_SUCCESS;
+	if (fs_size(conn->upload) > keep)
+		result = fs_truncate(conn->upload, keep);
+	releaseFile(server, conn->image, conn->upload);
+	fs_close(conn->upload);
+	conn->upload = NULL;
+	if ((!complete || (ERR_SUCCESS != result)) && conn->uploadCreated)
+		deleteItems(server->images[conn->image], conn->dirs[conn->image], conn->uploadPath);
+	return result;
+}
+
+void receiveUpload(FS_Server * server, FS_ServerConn * conn, uint8_t * data, uint32_t len) {
+	if (0 == len) {
+		fs_result result = finishUpload(server, conn, !conn->uploadFailed);
+		if (conn->uploadFailed)
+			result = ERR_NOFREESPACE;
+		traceCall(server->images[conn->image], conn->uploadReplace ? TRACE_PUT : TRACE_APPEND, conn->dirs[conn->image], conn->uploadPath, NULL,
+			result, conn->uploadBytes, conn->uploadStarted);
+		free(conn->uploadPath);
+		conn->uploadPath = NULL;
+		if (ERR_SUCCESS == result)
+			queueReply(conn, "OK %" PRIu64, conn->uploadBytes);
+		else
+			queueResult(conn, result);
+	} else if (!conn->uploadFailed) {
+		uint64_t end = fs_seek(conn->upload, 0, SEEK_CUR) + len;
+		if (end > conn->uploadReserved) {														// claim the next stretch in one run
+			fs_reserve(conn->upload, SERVER_RESERVE_BYTES);
+			conn->uploadReserved = fs_size(conn->upload) + SERVER_RESERVE_BYTES;
+		}
+		ssize_t written = fs_write(conn->upload, data, len);
+		if (0 < written)
+			conn->uploadBytes += written;
+		if (written != (ssize_t)len)
+			conn->uploadFailed = 1;
+	}
+}
+
+void startDownload(FS_Server * server, FS_ServerConn * conn, char * path) {
+	FS_Instance * fsi = server->images[conn->image];
+	uint64_t started = traceStart(fsi);
+	FS_File * file = NULL;
+	fs_result result = fs_open(fsi, conn->dirs[conn->image], path, &file);
+	if (ERR_SUCCESS != result) {
+		traceCall(fsi, TRACE_GET, conn->dirs[conn->image], path, NULL, result, 0, started);
+		queueResult(conn, result);
+		return;
+	}
+	conn->downloadPath = strdup(path);
+	if (NULL == conn->downloadPath) {
+		fs_close(file);
+		queueResult(conn, ERR_MALLOCFAILED);
+		return;
+	}
+	if (!claimFile(server, conn->image, file, 0)) {
+		fs_close(file);
+		free(conn->downloadPath);
+		conn->downloadPath = NULL;
+		queueReply(conn, "ERR BUSY");
+		return;
+	}
+	conn->download = file;
+	conn->downloadStarted = started;
+	queueReply(conn, "OK %" PRIu32, fs_size(file));
+}
+
+void continueDownload(FS_Server * server, FS_ServerConn * conn) {
+	if (!reserveOutput(conn, sizeof(uint32_t) + SERVER_CHUNK_BYTES)) {
+		conn->closing = 1;
+		return;
+	}
+	uint8_t * payload = conn->out + conn->outUsed + sizeof(uint32_t);
+	ssize_t bytesRead = fs_read(conn->download, payload, SERVER_CHUNK_BYTES);
+	if (0 >= bytesRead) {
+		traceCall(server->images[conn->image], TRACE_GET, conn->dirs[conn->image], conn->downloadPath, NULL, ERR_SUCCESS, fs_size(conn->download),
+			conn->downloadStarted);
+		free(conn->downloadPath);
+		conn->downloadPath = NULL;
+		releaseFile(server, conn->image, conn->download);
+		fs_close(conn->download);																// an empty frame ends the payload
+		conn->download = NULL;
+		bytesRead = 0;
+	}
+	uint32_t netLen = htonl(bytesRead);
+	memcpy(conn->out + conn->outUsed, &netLen, sizeof(uint32_t));
+	conn->outUsed += sizeof(uint32_t) + bytesRead;
+}
+
+void runCommand(FS_Server * server, FS_ServerConn * conn, char * command) {
+	char * args = strchr(command, ' ');
+	if (NULL != args)
+		*(args++) = '\0';
+	FS_Instance * fsi = server->images[conn->image];
+	if (strcasecmp(command, "PING") == 0) {
+		queueReply(conn, "OK");
+	} else if (strcasecmp(command, "DIR") == 0) {
+		queueListing(server, conn, args);
+	} else if (NULL == args || '\0' == *args) {
+		queueReply(conn, "ERR BADCOMMAND");
+	} else if (strcasecmp(command, "USE") == 0) {
+		char * end = NULL;
+		unsigned long image = strtoul(args, &end, 10);
+		if (('\0' != *end) || (image >= server->numImages)) {
+			queueReply(conn, "ERR BADARGS");
+		} else {
+			conn->image = image;
+			queueReply(conn, "OK");
+		}
+	} else if (strcasecmp(command, "CD") == 0) {
+		FS_Directory dir = change_dir(fsi, conn->dirs[conn->image], args);
+		if (0x00000001 == dir) {
+			queueResult(conn, ERR_FILENOTFOUND);
+		} else {
+			conn->dirs[conn->image] = dir;
+			queueReply(conn, "OK");
+		}
+	} else if (strcasecmp(command, "MD") == 0) {
+		queueResult(conn, make_dir(fsi, conn->dirs[conn->image], args));
+	} else if (strcasecmp(command, "DEL") == 0) {
+		if (deleteTouchesOpenFile(server, conn, args))
+			queueReply(conn, "ERR BUSY");
+		else
+			queueResult(conn, delete_file(fsi, conn->dirs[conn->image], args));
+	} else if (strcasecmp(command, "GET") == 0) {
+		startDownload(server, conn, args);
+	} else if (strcasecmp(command, "PUT") == 0) {
+		startUpload(server, conn, args, 0);
+	} else if (strcasecmp(command, "APPEND") == 0) {
+		startUpload(server, conn, args, 1);
+	} else {
+		queueReply(conn, "ERR BADCOMMAND");
+	}
+}
+
+uint8_t processFrame(FS_Server * server, FS_ServerConn * conn) {
+	size_t available = conn->inUsed - conn->inStart;
+	if (available < sizeof(uint32_t))
+		return 0;
+	uint32_t len;
+	memcpy(&len, conn->in + conn->inStart, sizeof(uint32_t));
+	len = ntohl(len);
+	if (len > SERVER_MAX_FRAME) {
+		conn->closing = 1;
+		return 0;
+	}
+	if (available < (sizeof(uint32_t) + len))
+		return 0;
+	uint8_t * payload = conn->in + conn->inStart + sizeof(uint32_t);
+	conn->inStart += sizeof(uint32_t) + len;
+	if (NULL != conn->upload) {
+		receiveUpload(server, conn, payload, len);
+	} else {
+		char command[BUFSIZ];
+		if (len >= sizeof(command)) {
+			queueReply(conn, "ERR BADCOMMAND");
+		} else {
+			memcpy(command, payload, len);
+			command[len] = '\0';
+			runCommand(server, conn, command);
+		}
+	}
+	if (NULL == conn->upload)
+		fs_flush(server->images[conn->image]);													// mirror FAT changes once a command or upload is done
+	return 1;
+}
+
+uint8_t receiveInput(FS_ServerConn * conn) {
+	if (0 < conn->inStart) {
+		memmove(conn->in, conn->in + conn->inStart, conn->inUsed - conn->inStart);
+		conn->inUsed -= conn->inStart;
+		conn->inStart = 0;
+	}
+	if ((conn->inAlloc - conn->inUsed) < SERVER_CHUNK_BYTES) {
+		size_t alloc = conn->inUsed + SERVER_CHUNK_BYTES;
+		uint8_t * in = realloc(conn->in, alloc);
+		if (NULL == in)
+			return 0;
+		conn->in = in;
+		conn->inAlloc = alloc;
+	}
+	ssize_t received = recv(conn->fd, conn->in + conn->inUsed, conn->inAlloc - conn->inUsed, 0);
+	if (0 < received)
+		conn->inUsed += received;
+	else if ((0 == received) || ((EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno)))
+		return 0;
+	return 1;
+}
+
+uint8_t sendOutput(FS_ServerConn * conn) {
+	while (conn->outSent < conn->outUsed) {
+		ssize_t sent = send(conn->fd, conn->out + conn->outSent, conn->outUsed - conn->outSent, MSG_NOSIGNAL);
+		if (0 < sent)
+			conn->outSent += sent;
+		else if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			return 1;
+		else if (EINTR != errno)
+			return 0;
+	}
+	return 1;
+}
+
+void closeConn(FS_Server * server, FS_ServerConn * conn) {
+	epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	if (NULL != conn->prev)
+		conn->prev->next = conn->next;
+	else
+		server->conns = conn->next;
+	if (NULL != conn->next)
+		conn->next->prev = conn->prev;
+	if (NULL != conn->upload)
+		finishUpload(server, conn, 0);
+	if (NULL != conn->download) {
+		releaseFile(server, conn->image, conn->download);
+		fs_close(conn->download);
+	}
+	free(conn->uploadPath);
+	free(conn->downloadPath);
+	free(conn->dirs);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+/*
+ * Runs queued work until the connection has to wait on the socket: pending
+ * output parks it on EPOLLOUT (which also stops it reading further commands),
+ * otherwise it goes back to EPOLLIN for the next frame.
+ */
+void serviceConn(FS_Server * server, FS_ServerConn * conn) {
+	while (!conn->closing) {
+		if (!sendOutput(conn)) {
+			conn->closing = 1;
+		} else if (conn->outSent < conn->outUsed) {
+			break;
+		} else if (NULL != conn->download) {
+			continueDownload(server, conn);
+		} else if (!processFrame(server, conn)) {
+			break;
+		}
+	}
+	if (conn->closing) {
+		closeConn(server, conn);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = (conn->outSent < conn->outUsed) ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void acceptConns(FS_Server * server) {
+	int fd;
+	while (0 <= (fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+		FS_ServerConn * conn = calloc(1, sizeof(FS_ServerConn));
+		FS_Directory * dirs = calloc(server->numImages, sizeof(FS_Directory));
+		if ((NULL == conn) || (NULL == dirs)) {
+			free(conn);
+			free(dirs);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->dirs = dirs;
+		for (uint32_t i = 0; i < server->numImages; i++)
+			dirs[i] = fs_get_root(server->images[i]);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (0 != epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(dirs);
+			free(conn);
+			continue;
+		}
+		conn->next = server->conns;
+		if (NULL != server->conns)
+			server->conns->prev = conn;
+		server->conns = conn;
+	}
+}
+
+int openListener(char * socketPath) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long.\n", socketPath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+	struct stat st;
+	if ((0 == lstat(socketPath, &st)) && S_ISSOCK(st.st_mode))
+		unlink(socketPath);																		// left behind by an earlier server
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (0 > fd) {
+		perror("socket");
+		return -1;
+	}
+	if ((0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr))) || (0 != listen(fd, SERVER_BACKLOG))) {
+		perror(socketPath);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int run_server(FS_Instance ** images, uint32_t numImages, char * socketPath) {
+	FS_Server server;
+	server.images = images;
+	server.numImages = numImages;
+	server.conns = NULL;
+	server.open = calloc(numImages, sizeof(FS_OpenTable));
+	if (NULL == server.open)
+		return -1;
+	server.listenFd = openListener(socketPath);
+	if (0 > server.listenFd) {
+		free(server.open);
+		return -1;
+	}
+	server.epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;																			// NULL marks the listening socket
+	if ((0 > server.epfd) || (0 != epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.listenFd, &ev))) {
+		perror("epoll");
+		close(server.listenFd);
+		unlink(socketPath);
+		free(server.open);
+		return -1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stopServer;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (!serverStopping) {
+		int numEvents = epoll_wait(server.epfd, events, SERVER_MAX_EVENTS, -1);
+		for (int i = 0; i < numEvents; i++) {
+			FS_ServerConn * conn = events[i].data.ptr;
+			if (NULL == conn) {
+				acceptConns(&server);
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && !receiveInput(conn))
+				conn->closing = 1;
+			else if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN))
+				conn->closing = 1;
+			serviceConn(&server, conn);
+		}
+	}
+
+	while (NULL != server.conns)
+		closeConn(&server, server.conns);
+	for (uint32_t i = 0; i < numImages; i++)
+		free(server.open[i].entries);
+	free(server.open);
+	close(server.epfd);
+	close(server.listenFd);
+	unlink(socketPath);
+	return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef FAT_SERVER_H
+#define FAT_SERVER_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_FRAME (1024 * 1024)																// largest command or data frame a client may send
+#define SERVER_CHUNK_BYTES (64 * 1024)																// GET payload per data frame
+#define SERVER_RESERVE_BYTES (4 * 1024 * 1024)														// reserved ahead of PUT and APPEND data as it arrives
+
+/*
+ * Every message in either direction is a frame: a 4-byte length in network
+ * byte order followed by that many payload bytes. Commands are text frames
+ * mirroring the shell ("DIR --sort size", "CD ..", "GET NAME") plus "USE n"
+ * to pick an image and "PING". Replies are "OK[ text]" or "ERR <reason>".
+ *
+ * GET replies "OK <size>", then data frames and an empty frame.
+ * PUT and APPEND reply "OK" once the file is open; the client then sends data
+ * frames and an empty frame, and the server replies "OK <bytes written>".
+ * An upload that fails or whose client goes away is rolled back. While a
+ * file is being sent or received, DEL, PUT and APPEND on it (and GET while it
+ * is being written) reply "ERR BUSY".
+ */
+
+int run_server(FS_Instance ** images, uint32_t numImages, char * socketPath);
+
+#endif
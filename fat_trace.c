@@ -0,0 +1,255 @@
+#include <fcntl.h>
+#include <time.h>
+#include "fat_trace.h"
+
+const char * traceOpNames[TRACE_NUM_OPS] = {"CD", "GET", "PUT", "APPEND", "MD", "DEL"};
+
+uint64_t getMonotonicMicros(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Start time of a call for traceCall, or 0 when nothing is being recorded */
+uint64_t traceStart(FS_Instance * fsi) {
+	return (NULL != fsi->trace) ? getMonotonicMicros() : 0;
+}
+
+/*
+ * Appends one call to the trace as a tab separated line: operation, directory
+ * it ran in, result (the new directory for CD), payload bytes, duration in
+ * microseconds, then the path in the image and the local path, if any.
+ */
+void traceCall(FS_Instance * fsi, fs_trace_op op, FS_Directory dir, char * path, char * localPath, uint64_t result, uint64_t bytes, uint64_t started) {
+	if (NULL == fsi->trace)
+		return;
+	uint64_t elapsed = getMonotonicMicros() - started;
+	fprintf(fsi->trace, "%s\t%"PRIu32"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%s\t%s\n", traceOpNames[op], dir, result, bytes, elapsed,
+		path, (NULL != localPath) ? localPath : "");
+}
+
+void closeTrace(FS_Instance * fsi) {
+	if (NULL != fsi->trace)
+		fclose(fsi->trace);
+	fsi->trace = NULL;
+}
+
+/* Records every CD, GET, PUT, APPEND, MD and DEL on fsi to tracePath from now on, or stops when it is NULL */
+fs_result fs_set_trace(FS_Instance * fsi, char * tracePath) {
+	closeTrace(fsi);
+	if (NULL == tracePath)
+		return ERR_SUCCESS;
+	fsi->trace = fopen(tracePath, "w");
+	if (NULL == fsi->trace)
+		return ERR_FOPENFAILEDWRITE;
+	fprintf(fsi->trace, "%s\n# op\tdir\tresult\tbytes\tmicros\tpath\tlocal\n", TRACE_HEADER);
+	return ERR_SUCCESS;
+}
+
+struct FS_TraceLine_struct {
+	fs_trace_op op;
+	FS_Directory dir;
+	uint64_t result;
+	uint64_t bytes;
+	uint64_t micros;
+	char * path;
+	char * localPath;
+};
+
+typedef struct FS_TraceLine_struct FS_TraceLine;
+
+/* Splits a line written by traceCall in place; 0 if it is not one */
+uint8_t parseTraceLine(char * line, FS_TraceLine * tl) {
+	char * fields[7];
+	line[strcspn(line, "\r\n")] = '\0';
+	for (int i = 0; i < 7; i++) {
+		fields[i] = line;
+		line = strchr(line, '\t');
+		if ((NULL == line) != (6 == i))
+			return 0;
+		if (NULL != line)
+			*(line++) = '\0';
+	}
+	for (tl->op = 0; (tl->op < TRACE_NUM_OPS) && (0 != strcmp(fields[0], traceOpNames[tl->op])); tl->op++);
+	if (TRACE_NUM_OPS == tl->op)
+		return 0;
+	uint64_t values[4];
+	for (int i = 0; i < 4; i++) {
+		char * end;
+		values[i] = strtoull(fields[i + 1], &end, 10);
+		if ((end == fields[i + 1]) || ('\0' != *end))
+			return 0;
+	}
+	tl->dir = values[0];
+	tl->result = values[1];
+	tl->bytes = values[2];
+	tl->micros = values[3];
+	tl->path = fields[5];
+	tl->localPath = fields[6];
+	return ('\0' != tl->path[0]);
+}
+
+/*
+ * Directories the trace named by cluster, paired with the cluster the same CD
+ * reached during the replay. Replaying against the image the trace was
+ * recorded on gives the same clusters anyway; the map keeps a replay on track
+ * when an allocation policy or an earlier change moved a directory elsewhere.
+ */
+struct FS_DirMap_struct {
+	FS_Directory * recorded;
+	FS_Directory * replayed;
+	uint32_t num;
+	uint32_t alloc;
+};
+
+typedef struct FS_DirMap_struct FS_DirMap;
+
+FS_Directory mapReplayDir(FS_DirMap * map, FS_Directory dir) {
+	for (uint32_t i = 0; i < map->num; i++)
+		if (map->recorded[i] == dir)
+			return map->replayed[i];
+	return dir;
+}
+
+void setReplayDir(FS_DirMap * map, FS_Directory recorded, FS_Directory replayed) {
+	for (uint32_t i = 0; i < map->num; i++) {
+		if (map->recorded[i] == recorded) {
+			map->replayed[i] = replayed;
+			return;
+		}
+	}
+	if (map->num == map->alloc) {
+		uint32_t alloc = (0 == map->alloc) ? 16 : (map->alloc * 2);
+		FS_Directory * recordedGrown = realloc(map->recorded, alloc * sizeof(FS_Directory));
+		if (NULL != recordedGrown)
+			map->recorded = recordedGrown;
+		FS_Directory * replayedGrown = realloc(map->replayed, alloc * sizeof(FS_Directory));
+		if (NULL != replayedGrown)
+			map->replayed = replayedGrown;
+		if ((NULL == recordedGrown) || (NULL == replayedGrown))
+			return;																				// unmapped directories are taken as recorded
+		map->alloc = alloc;
+	}
+	map->recorded[map->num] = recorded;
+	map->replayed[map->num++] = replayed;
+}
+
+/*
+ * Runs every call in tracePath against fsi in order and times each one. The
+ * files PUT and APPEND wrote are not kept with the trace, so a scratch file of
+ * the recorded size stands in for each; GET output goes to /dev/null. Meant
+ * for an instance whose changes are thrown away afterwards, such as one on a
+ * temporary overlay.
+ */
+fs_result replay_trace(FS_Instance * fsi, char * tracePath, FS_ReplayReport * report) {
+	memset(report, 0, sizeof(FS_ReplayReport));
+	FILE * trace = fopen(tracePath, "r");
+	if (NULL == trace)
+		return ERR_FOPENFAILEDREAD;
+	char sourcePath[] = "/tmp/fatreplayXXXXXX";
+	int source = mkstemp(sourcePath);
+	int sink = open("/dev/null", O_WRONLY);
+	if ((0 > source) || (0 > sink)) {
+		if (0 <= source) {
+			close(source);
+			unlink(sourcePath);
+		}
+		if (0 <= sink)
+			close(sink);
+		fclose(trace);
+		return ERR_FOPENFAILEDWRITE;
+	}
+	char sinkPath[16];
+	snprintf(sinkPath, sizeof(sinkPath), "%s%d", GET_FD_PREFIX, sink);
+	FS_DirMap map = { NULL, NULL, 0, 0 };
+	char * line = NULL;
+	size_t allocLine = 0;
+	while (0 < getline(&line, &allocLine, trace)) {
+		FS_TraceLine tl;
+		if ('#' == line[0])
+			continue;
+		if (!parseTraceLine(line, &tl)) {
+			report->skipped++;
+			continue;
+		}
+		FS_Directory dir = mapReplayDir(&map, tl.dir);
+		if ((TRACE_PUT == tl.op) || (TRACE_APPEND == tl.op))
+			ftruncate(source, tl.bytes);
+		uint64_t result = 0;
+		uint64_t started = getMonotonicMicros();
+		switch (tl.op) {
+			case TRACE_CD:
+				result = change_dir(fsi, dir, tl.path);
+				break;
+			case TRACE_GET:
+				result = get_file(fsi, dir, tl.path, sinkPath);
+				break;
+			case TRACE_PUT:
+				result = put_file(fsi, dir, tl.path, sourcePath);
+				break;
+			case TRACE_APPEND:
+				result = append_file(fsi, dir, tl.path, sourcePath);
+				break;
+			case TRACE_MD:
+				result = make_dir(fsi, dir, tl.path);
+				break;
+			case TRACE_DEL:
+				result = delete_file(fsi, dir, tl.path);
+				break;
+			case TRACE_NUM_OPS:
+				break;
+		}
+		uint64_t elapsed = getMonotonicMicros() - started;
+		uint8_t matches = (tl.result == result);
+		if (TRACE_CD == tl.op) {
+			matches = ((0x00000001 == tl.result) == (0x00000001 == result));						// clusters may differ, finding it or not may not
+			if (matches && (0x00000001 != result))
+				setReplayDir(&map, tl.result, result);
+		}
+		FS_ReplayOp * stats = &(report->ops[tl.op]);
+		stats->calls++;
+		stats->bytes += tl.bytes;
+		stats->recordedMicros += tl.micros;
+		stats->replayMicros += elapsed;
+		if (elapsed > stats->maxMicros)
+			stats->maxMicros = elapsed;
+		if (!matches)
+			stats->mismatches++;
+	}
+	free(line);
+	free(map.recorded);
+	free(map.replayed);
+	close(sink);
+	close(source);
+	unlink(sourcePath);
+	fclose(trace);
+	return ERR_SUCCESS;
+}
+
+fs_result print_replay(FS_Instance * fsi, char * tracePath) {
+	FS_ReplayReport report;
+	fs_result result = replay_trace(fsi, tracePath, &report);
+	if (ERR_SUCCESS != result)
+		return result;
+	FS_ReplayOp total;
+	memset(&total, 0, sizeof(total));
+	printf("\n%-8s%10s%16s%14s%14s%12s%12s\n", "Op", "Calls", "Bytes", "Recorded ms", "Replay ms", "Mean us", "Max us");
+	for (int op = 0; op < TRACE_NUM_OPS; op++) {
+		FS_ReplayOp * stats = &(report.ops[op]);
+		if (0 == stats->calls)
+			continue;
+		printf("%-8s%10"PRIu64"%16"PRIu64"%14.3f%14.3f%12"PRIu64"%12"PRIu64"\n", traceOpNames[op], stats->calls, stats->bytes,
+			stats->recordedMicros / 1000.0, stats->replayMicros / 1000.0, stats->replayMicros / stats->calls, stats->maxMicros);
+		total.calls += stats->calls;
+		total.mismatches += stats->mismatches;
+		total.bytes += stats->bytes;
+		total.recordedMicros += stats->recordedMicros;
+		total.replayMicros += stats->replayMicros;
+	}
+	printf("\n%"PRIu64" call(s) replayed in %.3f s, %.3f s when recorded\n", total.calls, total.replayMicros / 1000000.0, total.recordedMicros / 1000000.0);
+	if (0 < total.mismatches)
+		printf("%"PRIu64" call(s) returned a different result than when recorded\n", total.mismatches);
+	if (0 < report.skipped)
+		printf("Skipped %"PRIu64" unreadable line(s)\n", report.skipped);
+	return ERR_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#ifndef FAT_TRACE_H
+#define FAT_TRACE_H
+
+#include <inttypes.h>
+#include "fat_fs.h"
+
+#define TRACE_HEADER "# fatshell trace 1"														// followed by the column names, then one line per call
+
+typedef enum {
+	TRACE_CD,
+	TRACE_GET,
+	TRACE_PUT,
+	TRACE_APPEND,
+	TRACE_MD,
+	TRACE_DEL,
+	TRACE_NUM_OPS
+} fs_trace_op;
+
+struct FS_ReplayOp_struct {
+	uint64_t calls;
+	uint64_t mismatches;																		// calls whose result differed from the recorded one
+	uint64_t bytes;
+	uint64_t recordedMicros;
+	uint64_t replayMicros;
+	uint64_t maxMicros;																			// slowest single replayed call
+};
+
+struct FS_ReplayReport_struct {
+	struct FS_ReplayOp_struct ops[TRACE_NUM_OPS];
+	uint64_t skipped;																			// lines that could not be parsed
+};
+
+typedef struct FS_ReplayOp_struct FS_ReplayOp;
+typedef struct FS_ReplayReport_struct FS_ReplayReport;
+
+uint64_t traceStart(FS_Instance * fsi);
+void traceCall(FS_Instance * fsi, fs_trace_op op, FS_Directory dir, char * path, char * localPath, uint64_t result, uint64_t bytes, uint64_t started);
+void closeTrace(FS_Instance * fsi);
+
+fs_result fs_set_trace(FS_Instance * fsi, char * tracePath);
+fs_result replay_trace(FS_Instance * fsi, char * tracePath, FS_ReplayReport * report);
+fs_result print_replay(FS_Instance * fsi, char * tracePath);
+
+#endif
@@ -3,13 +3,33 @@
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "fat_fs.h"
+#include "fat_check.h"
+#include "fat_server.h"
+#include "fat_mkfs.h"
+#include "fat_compact.h"
+#include "fat_du.h"
+#include "fat_names.h"
+#include "fat_trace.h"
 
 #define BUF_SIZE 256
+#define OPT_INDEX "-i"
+#define OPT_READAHEAD "-r"
+#define OPT_SERVER "-s"
+#define OPT_OVERLAY "-o"
+#define OPT_FORMAT "-m"
+#define OPT_CLUSTER "-c"
+#define OPT_FATBITS "-t"
+#define OPT_LABEL "-l"
+#define OPT_PUNCH "-p"
+#define OPT_ALLOC "-a"
+#define OPT_TRACE "-w"
+#define OPT_REPLAY "-b"
 #define CMD_INFO "INFO"
 #define CMD_DIR "DIR"
 #define CMD_CD "CD"
@@ -18,84 +38,288 @@
 #define CMD_PUT "PUT"
 #define CMD_MD "MD"
 #define CMD_DEL "DEL"
+#define CMD_APPEND "APPEND"
+#define CMD_DEFRAG "DEFRAG"
+#define CMD_FRAG "FRAG"
+#define CMD_CHECK "CHECK"
+#define CMD_FLATTEN "FLATTEN"
+#define CMD_COMPACT "COMPACT"
+#define CMD_DU "DU"
+#define CMD_FIND "FIND"
+#define CHECK_ARG_FIX "FIX"
 
 void printError(fs_result result, char * arg) {
 	switch (result) {
 		case ERR_SUCCESS:
 			break;
 		case ERR_NOFREESPACE:
-			printf("Error: Couldn't create file/directory %s, insufficient space on disk\n", arg);
+			fprintf(stderr, "Error: Couldn't create file/directory %s, insufficient space on disk\n", arg);
 			break;
 		case ERR_FILENAMEEXISTS:
-			printf("Error: Couldn't create file/directory %s, duplicate filename\n", arg);
+			fprintf(stderr, "Error: Couldn't create file/directory %s, duplicate filename\n", arg);
 			break;
 		case ERR_FILENOTFOUND:
-			printf("Error: File %s not found on disk\n", arg);
+			fprintf(stderr, "Error: File %s not found on disk\n", arg);
 			break;
 		case ERR_FOPENFAILEDREAD:
-			printf("Error: Couldn't open local file for reading\n");
+			fprintf(stderr, "Error: Couldn't open local file for reading\n");
 			break;
 		case ERR_FOPENFAILEDWRITE:
-			printf("Error: Couldn't open local file for writing\n");
+			fprintf(stderr, "Error: Couldn't open local file for writing\n");
 			break;
 		case ERR_DELETESPECIALDIR:
-			printf("Error: Cannot delete '.' or '..' entries in a directory\n");
+			fprintf(stderr, "Error: Cannot delete '.' or '..' entries in a directory\n");
 			break;
 		case ERR_MALLOCFAILED:
-			printf("Error: Failed to allocate sufficient scratchpad RAM\n");
+			fprintf(stderr, "Error: Failed to allocate sufficient scratchpad RAM\n");
 			break;
 		case ERR_ROOTDIRFULL:
-			printf("Error: Insufficient free entries available in the root directory\n");
+			fprintf(stderr, "Error: Insufficient free entries available in the root directory\n");
+			break;
+		case ERR_INVALIDGEOMETRY:
+			fprintf(stderr, "Error: No valid FAT layout for that size, cluster size and FAT type\n");
+			break;
+		case ERR_MULTIPLEMATCHES:
+			fprintf(stderr, "Error: %s matches more than one file\n", arg);
 			break;
 	}
 }
 
+/* Parses a byte count with an optional K, M, G or T suffix; 0 if invalid */
+uint64_t parseSize(char *arg) {
+	char *end = NULL;
+	unsigned long long size = strtoull(arg, &end, 10);
+	if (end == arg)
+		return 0;
+	switch (toupper((unsigned char)*end)) {
+		case 'T': size <<= 10;
+		case 'G': size <<= 10;
+		case 'M': size <<= 10;
+		case 'K': size <<= 10;
+			end++;
+		case '\0':
+			break;
+		default:
+			return 0;
+	}
+	return ('\0' == *end) ? size : 0;
+}
+
+/* Maps an allocation policy name to its fs_alloc_policy; -1 if unknown */
+int parseAllocPolicy(char *arg) {
+	if (strcasecmp(arg, "first") == 0)
+		return FS_ALLOC_FIRST_FIT;
+	if (strcasecmp(arg, "next") == 0)
+		return FS_ALLOC_NEXT_FIT;
+	if (strcasecmp(arg, "near") == 0)
+		return FS_ALLOC_NEAR_DIR;
+	return -1;
+}
+
 int main(int argc, char *argv[]) {
 	int done = 0, valid_cmd;
 	FS_Instance *fat_fs;
 	FS_Directory current_dir;
 	char buffer[BUF_SIZE];
 	char *arg1, *arg2;
+	char *image = NULL;
+	char **images = calloc(argc, sizeof(char *));
+	int num_images = 0;
+	char *socket_path = NULL;
+	char *overlay_path = NULL;
+	char *trace_path = NULL;
+	char *replay_path = NULL;
+	char replay_overlay[] = "/tmp/fatreplayXXXXXX";
+	int use_index = 0;
+	int punch_holes = 0;
+	int alloc_policy = FS_ALLOC_FIRST_FIT;
+	long read_ahead = -1;
+	FS_FormatOptions format = { 0, 0, 0, NULL };
+	int do_format = 0;
 
-	if (2 != argc) {
-		fprintf(stderr, "Usage: %s fatimage\n", argv[0]);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], OPT_INDEX) == 0)
+			use_index = 1;
+		else if (strcmp(argv[i], OPT_PUNCH) == 0)
+			punch_holes = 1;
+		else if ((strcmp(argv[i], OPT_ALLOC) == 0) && ((i + 1) < argc))
+			alloc_policy = parseAllocPolicy(argv[++i]);
+		else if ((strcmp(argv[i], OPT_READAHEAD) == 0) && ((i + 1) < argc))
+			read_ahead = strtol(argv[++i], NULL, 10);
+		else if ((strcmp(argv[i], OPT_SERVER) == 0) && ((i + 1) < argc))
+			socket_path = argv[++i];
+		else if ((strcmp(argv[i], OPT_OVERLAY) == 0) && ((i + 1) < argc))
+			overlay_path = argv[++i];
+		else if ((strcmp(argv[i], OPT_TRACE) == 0) && ((i + 1) < argc))
+			trace_path = argv[++i];
+		else if ((strcmp(argv[i], OPT_REPLAY) == 0) && ((i + 1) < argc))
+			replay_path = argv[++i];
+		else if ((strcmp(argv[i], OPT_FORMAT) == 0) && ((i + 1) < argc)) {
+			do_format = 1;
+			format.size = parseSize(argv[++i]);
+		}
+		else if ((strcmp(argv[i], OPT_CLUSTER) == 0) && ((i + 1) < argc))
+			format.bytesPerCluster = parseSize(argv[++i]);
+		else if ((strcmp(argv[i], OPT_FATBITS) == 0) && ((i + 1) < argc))
+			format.fatBits = strtol(argv[++i], NULL, 10);
+		else if ((strcmp(argv[i], OPT_LABEL) == 0) && ((i + 1) < argc))
+			format.label = argv[++i];
+		else if (NULL != images)
+			images[num_images++] = argv[i];
+	}
+	if ((0 == num_images) || (read_ahead < -1) || (alloc_policy < 0) || ((NULL == socket_path) && (1 != num_images)) || ((NULL != overlay_path) && (1 != num_images))
+			|| (do_format && ((0 == format.size) || (1 != num_images) || (NULL != socket_path) || (NULL != overlay_path)))
+			|| ((NULL != trace_path) && (1 != num_images))
+			|| ((NULL != replay_path) && ((1 != num_images) || do_format || (NULL != socket_path) || (NULL != overlay_path)))) {
+		fprintf(stderr, "Usage: %s [%s] [%s] [%s first|next|near] [%s clusters] [%s overlay] [%s trace] fatimage\n", argv[0], OPT_INDEX, OPT_PUNCH, OPT_ALLOC, OPT_READAHEAD, OPT_OVERLAY, OPT_TRACE);
+		fprintf(stderr, "       %s [%s] [%s] [%s first|next|near] [%s clusters] %s socket fatimage...\n", argv[0], OPT_INDEX, OPT_PUNCH, OPT_ALLOC, OPT_READAHEAD, OPT_SERVER);
+		fprintf(stderr, "       %s [%s] [%s first|next|near] [%s clusters] %s trace fatimage\n", argv[0], OPT_PUNCH, OPT_ALLOC, OPT_READAHEAD, OPT_REPLAY);
+		fprintf(stderr, "       %s %s size[K|M|G|T] [%s cluster bytes] [%s 12|16|32] [%s label] fatimage\n", argv[0], OPT_FORMAT, OPT_CLUSTER, OPT_FATBITS, OPT_LABEL);
+		fprintf(stderr, "  %s  keep a metadata index next to the image for faster startup\n", OPT_INDEX);
+		fprintf(stderr, "  %s  punch holes in the image file for clusters freed by DEL or truncation\n", OPT_PUNCH);
+		fprintf(stderr, "  %s  where new clusters go: lowest free, after the last one, or near the parent directory\n", OPT_ALLOC);
+		fprintf(stderr, "  %s  clusters to read ahead along a file or directory (0 disables)\n", OPT_READAHEAD);
+		fprintf(stderr, "  %s  keep the images mounted and serve clients on a Unix socket\n", OPT_SERVER);
+		fprintf(stderr, "  %s  leave fatimage untouched and keep changes in the overlay file\n", OPT_OVERLAY);
+		fprintf(stderr, "  %s  log every CD, GET, PUT, APPEND, MD and DEL with its sizes and timing to trace\n", OPT_TRACE);
+		fprintf(stderr, "  %s  replay a trace against a throwaway copy of fatimage and report the timings\n", OPT_REPLAY);
+		fprintf(stderr, "  %s  create a new, empty, sparse image of the given size and exit\n", OPT_FORMAT);
 		exit(EXIT_FAILURE);
 	}
 
-	fat_fs = fs_create_instance(argv[1]);
-	if (NULL == fat_fs) {
-		fprintf(stderr, "Invalid FAT image %s.\n", argv[1]);
+	if (do_format) {
+		fs_result result = format_image(images[0], &format);
+		if (ERR_SUCCESS != result) {
+			printError(result, images[0]);
+			exit(EXIT_FAILURE);
+		}
+		fat_fs = fs_create_instance(images[0], NULL);
+		if (NULL == fat_fs) {
+			fprintf(stderr, "Invalid FAT image %s.\n", images[0]);
+			exit(EXIT_FAILURE);
+		}
+		printf("Created %s image %s: %"PRIu64" clusters of %u bytes\n", typeNames[fat_fs->type], images[0],
+			fat_fs->countOfClusters, fat_fs->bootsect->BPB_SecPerClus * fat_fs->bootsect->BPB_BytsPerSec);
+		fs_cleanup(fat_fs);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (NULL != replay_path) {
+		int scratch = mkstemp(replay_overlay);													// the replay's changes go to an overlay nobody keeps
+		if (0 > scratch) {
+			fprintf(stderr, "Couldn't create a scratch overlay for the replay.\n");
+			exit(EXIT_FAILURE);
+		}
+		close(scratch);
+		overlay_path = replay_overlay;
+	}
+
+	FS_Instance **instances = calloc(num_images, sizeof(FS_Instance *));
+	if (NULL == instances) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(EXIT_FAILURE);
 	}
+	for (int i = 0; i < num_images; i++) {
+		instances[i] = fs_create_instance(images[i], overlay_path);
+		if (NULL != replay_path)
+			unlink(replay_overlay);																// already open, or no use anyway
+		if (NULL == instances[i]) {
+			fprintf(stderr, "Invalid FAT image %s.\n", images[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (use_index && (NULL == replay_path))													// a replay has no use for a sidecar named after its overlay
+			fs_enable_index(instances[i], 1);
+		if (0 <= read_ahead)
+			fs_set_readahead(instances[i], read_ahead);
+		if (punch_holes)
+			fs_set_punch_holes(instances[i], 1);
+		fs_set_alloc_policy(instances[i], alloc_policy);
+	}
+
+	if (NULL != trace_path) {
+		fs_result result = fs_set_trace(instances[0], trace_path);
+		if (ERR_SUCCESS != result) {
+			printError(result, trace_path);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (NULL != replay_path) {
+		fs_result result = print_replay(instances[0], replay_path);
+		printError(result, replay_path);
+		fs_cleanup(instances[0]);
+		exit((ERR_SUCCESS == result) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (NULL != socket_path) {
+		int status = run_server(instances, num_images, socket_path);
+		for (int i = 0; i < num_images; i++)
+			fs_cleanup(instances[i]);
+		exit((0 == status) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	image = images[0];
+	fat_fs = instances[0];
 	current_dir = fs_get_root(fat_fs);
-	printf("\nWelcome to FATshell!\n%s image %s was loaded successfully!\n\n", typeNames[fat_fs->type], argv[1]);
-	printf("+-------------------------------------------+\n");
-	printf("|                 Commands:                 |\n");
-	printf("+-------------------------------------------+\n");
-	printf("| EXIT: quit FATshell                       |\n");
-	printf("| INFO: display filesystem information      |\n");
-	printf("| DIR:  list contents of current directory  |\n");
-	printf("| CD:   change directory (multiple levels   |\n");
-	printf("|          supported, e.g. '../..')         |\n");
-	printf("| GET:  retrieve a file from the image      |\n");
-	printf("| PUT:  insert a file into the image        |\n");
-	printf("| MD:   create a new directory              |\n");
-	printf("| DEL:  delete a file or directory          |\n");
-	printf("+-------------------------------------------+\n");
-	printf("|                 Features:                 |\n");
-	printf("+-------------------------------------------+\n");
-	printf("|       === FAT32 formatted disks ===       |\n");
-	printf("|       === Long filename entries ===       |\n");
-	printf("+-------------------------------------------+\n");
-	printf("|                   Note:                   |\n");
-	printf("+-------------------------------------------+\n");
-	printf("|  GET, CD & DEL commands require that the  |\n");
-	printf("|  short name of the item be passed as the  |\n");
-	printf("|  argument and are case-sensitive.         |\n");
-	printf("+-------------------------------------------+\n");
+	fprintf(stderr, "\nWelcome to FATshell!\n%s image %s was loaded successfully!\n\n", typeNames[fat_fs->type], image);
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "|                 Commands:                 |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "| EXIT: quit FATshell                       |\n");
+	fprintf(stderr, "| INFO: display filesystem information      |\n");
+	fprintf(stderr, "| DIR:  list contents of current directory  |\n");
+	fprintf(stderr, "|          (or only the names matching a    |\n");
+	fprintf(stderr, "|          pattern, e.g. 'DIR *.TXT'; also  |\n");
+	fprintf(stderr, "|          --sort name|size|date, --reverse,|\n");
+	fprintf(stderr, "|          --limit n, --offset n and --raw) |\n");
+	fprintf(stderr, "| CD:   change directory (multiple levels   |\n");
+	fprintf(stderr, "|          supported, e.g. '../..')         |\n");
+	fprintf(stderr, "| GET:  retrieve a file from the image (a   |\n");
+	fprintf(stderr, "|          pattern copies every match into  |\n");
+	fprintf(stderr, "|          the given local directory; '-'   |\n");
+	fprintf(stderr, "|          or '&n' writes to standard output|\n");
+	fprintf(stderr, "|          or to descriptor n instead)      |\n");
+	fprintf(stderr, "| PUT:  insert a file into the image, or    |\n");
+	fprintf(stderr, "|          overwrite an existing one ('-'   |\n");
+	fprintf(stderr, "|          reads the rest of standard input)|\n");
+	fprintf(stderr, "| APPEND: add a local file to the end of a  |\n");
+	fprintf(stderr, "|          file in the image                |\n");
+	fprintf(stderr, "| MD:   create a new directory              |\n");
+	fprintf(stderr, "| DEL:  delete a file or directory (a       |\n");
+	fprintf(stderr, "|          pattern deletes matching files)  |\n");
+	fprintf(stderr, "| CHECK: verify the disk ('CHECK FIX' also  |\n");
+	fprintf(stderr, "|          repairs any problems found)      |\n");
+	fprintf(stderr, "| FRAG: report fragmentation of the disk    |\n");
+	fprintf(stderr, "| DEFRAG: make files contiguous (whole disk |\n");
+	fprintf(stderr, "|          or a given file/directory)       |\n");
+	fprintf(stderr, "| DU:   sizes of the current (or a given)   |\n");
+	fprintf(stderr, "|          directory and the largest ones   |\n");
+	fprintf(stderr, "|          below it (--top n, default 10)   |\n");
+	fprintf(stderr, "| FIND: search the whole disk by name (a    |\n");
+	fprintf(stderr, "|          substring or pattern; also       |\n");
+	fprintf(stderr, "|          --min-size n, --max-size n,      |\n");
+	fprintf(stderr, "|          --after and --before yyyy-mm-dd) |\n");
+	fprintf(stderr, "| COMPACT: drop deleted entries from every  |\n");
+	fprintf(stderr, "|          directory, or a given directory  |\n");
+	fprintf(stderr, "| FLATTEN: write the image, with any        |\n");
+	fprintf(stderr, "|          overlay applied, to a new file   |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "|                 Features:                 |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "|       === FAT32 formatted disks ===       |\n");
+	fprintf(stderr, "|       === Long filename entries ===       |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "|                   Note:                   |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
+	fprintf(stderr, "|  GET, CD & DEL take the short or long     |\n");
+	fprintf(stderr, "|  name of the item, in any case. GET, DEL  |\n");
+	fprintf(stderr, "|  & DIR also take patterns using *, ? and  |\n");
+	fprintf(stderr, "|  [...].                                   |\n");
+	fprintf(stderr, "+-------------------------------------------+\n");
 
+	signal(SIGPIPE, SIG_IGN);																	// a reader that goes away mid-GET fails the write, not the shell
 	while (!done) {
-		printf("> ");
+		fprintf(stderr, "> ");
 
 		if (NULL == fgets(buffer, BUF_SIZE, stdin)) {
 			done = 1;
@@ -108,14 +332,52 @@ int main(int argc, char *argv[]) {
 				done = 1;
 			else if (strncasecmp(buffer, CMD_INFO, strlen(CMD_INFO)) == 0)
 				print_info(fat_fs);
-			else if (strncasecmp(buffer, CMD_DIR, strlen(CMD_DIR)) == 0)
-				print_dir(fat_fs, current_dir);
+			else if (strncasecmp(buffer, CMD_DIR, strlen(CMD_DIR)) == 0) {
+				FS_DirOptions options = { NULL, DIR_SORT_NONE, 0, 0, 0, 0 };
+				if (parse_dir_options((NULL != arg1) ? arg1+1 : NULL, &options))
+					print_dir(fat_fs, current_dir, &options);
+				else
+					fprintf(stderr, "Usage: DIR [pattern] [%s name|size|date] [%s] [%s n] [%s n] [%s]\n", DIR_ARG_SORT, DIR_ARG_REVERSE, DIR_ARG_LIMIT, DIR_ARG_OFFSET, DIR_ARG_RAW);
+			}
+			else if (strncasecmp(buffer, CMD_CHECK, strlen(CMD_CHECK)) == 0)
+				print_check(fat_fs, (NULL != arg1) && (strcasecmp(arg1+1, CHECK_ARG_FIX) == 0));
+			else if ((strncasecmp(buffer, CMD_FLATTEN, strlen(CMD_FLATTEN)) == 0) && (NULL != arg1)) {
+				fs_result result = flatten_image(fat_fs, arg1+1);
+				printError(result, arg1+1);
+			}
+			else if (strncasecmp(buffer, CMD_FRAG, strlen(CMD_FRAG)) == 0)
+				print_frag(fat_fs);
+			else if (strncasecmp(buffer, CMD_DU, strlen(CMD_DU)) == 0) {
+				char * path;
+				uint32_t top;
+				if (parse_du_options((NULL != arg1) ? arg1+1 : NULL, &path, &top)) {
+					fs_result result = print_du(fat_fs, current_dir, path, top);
+					printError(result, (NULL != path) ? path : "");
+				} else
+					fprintf(stderr, "Usage: DU [directory] [%s n]\n", DU_ARG_TOP);
+			}
+			else if (strncasecmp(buffer, CMD_FIND, strlen(CMD_FIND)) == 0) {
+				FS_NameQuery query;
+				if (parse_find_options((NULL != arg1) ? arg1+1 : NULL, &query)) {
+					fs_result result = print_find(fat_fs, &query);
+					printError(result, "");
+				} else
+					fprintf(stderr, "Usage: FIND [name or pattern] [%s n] [%s n] [%s yyyy-mm-dd] [%s yyyy-mm-dd]\n", FIND_ARG_MIN_SIZE, FIND_ARG_MAX_SIZE, FIND_ARG_AFTER, FIND_ARG_BEFORE);
+			}
+			else if (strncasecmp(buffer, CMD_COMPACT, strlen(CMD_COMPACT)) == 0) {
+				fs_result result = print_compact(fat_fs, current_dir, (NULL != arg1) ? arg1+1 : NULL);
+				printError(result, (NULL != arg1) ? arg1+1 : "");
+			}
+			else if (strncasecmp(buffer, CMD_DEFRAG, strlen(CMD_DEFRAG)) == 0) {
+				fs_result result = defrag(fat_fs, current_dir, (NULL != arg1) ? arg1+1 : NULL);
+				printError(result, (NULL != arg1) ? arg1+1 : "");
+			}
 			else if (NULL != arg1) {
 				arg2 = strchr(arg1+1, ' ');
 				if (strncasecmp(buffer, CMD_CD, strlen(CMD_CD)) == 0) {
 					FS_Directory temp_dir = change_dir(fat_fs, current_dir, arg1+1);
 					if (temp_dir == 0x00000001)
-						printf("Directory '%s' not found\n", arg1+1);
+						fprintf(stderr, "Directory '%s' not found\n", arg1+1);
 					else
 						current_dir = temp_dir;
 				}
@@ -123,8 +385,10 @@ int main(int argc, char *argv[]) {
 					fs_result result = make_dir(fat_fs, current_dir, arg1+1);
 					printError(result, arg1+1);
 				}
-				else if (strncasecmp(buffer, CMD_DEL, strlen(CMD_DEL)) == 0)
-					current_dir = delete_file(fat_fs, current_dir, arg1+1);
+				else if (strncasecmp(buffer, CMD_DEL, strlen(CMD_DEL)) == 0) {
+					fs_result result = delete_file(fat_fs, current_dir, arg1+1);
+					printError(result, arg1+1);
+				}
 				else if (NULL != arg2) {
 					*arg2 = '\0';
 					if (strncasecmp(buffer, CMD_GET, strlen(CMD_GET)) == 0) {
@@ -133,6 +397,9 @@ int main(int argc, char *argv[]) {
 					} else if (strncasecmp(buffer, CMD_PUT, strlen(CMD_PUT)) == 0) {
 						fs_result result = put_file(fat_fs, current_dir, arg1+1, arg2+1);
 						printError(result, arg1+1);
+					} else if (strncasecmp(buffer, CMD_APPEND, strlen(CMD_APPEND)) == 0) {
+						fs_result result = append_file(fat_fs, current_dir, arg1+1, arg2+1);
+						printError(result, arg1+1);
 					} else {
 						valid_cmd = 0;
 					}
@@ -143,12 +410,15 @@ int main(int argc, char *argv[]) {
 				valid_cmd = 0;
 			}
 			if (!valid_cmd && '\0' != buffer[0]) {
-				printf("\nUnknown command %s.\n", buffer);
+				fprintf(stderr, "\nUnknown command %s.\n", buffer);
 			}
+			fs_flush(fat_fs);
 		}
 	}
 
-	printf("\nExiting...\n");
+	fprintf(stderr, "\nExiting...\n");
 	fs_cleanup(fat_fs);
+	free(instances);
+	free(images);
 	return EXIT_SUCCESS;
 }
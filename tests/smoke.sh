@@ -0,0 +1,294 @@
+#!/bin/bash
+# Smoke checks for fatshell: creates scratch images, drives the shell through
+# its commands and fails on the first unexpected result.
+# usage: tests/smoke.sh [path to fatshell]
+
+FS=$(readlink -f "${1:-./fatshell}")
+WORK=$(mktemp -d /tmp/fatsmoke.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+# runs the commands given as arguments, one per line, against an image
+shell() {
+	local img=$1
+	shift
+	printf '%s\n' "$@" EXIT | "$FS" "$img" 2>&1
+}
+
+# CHECK on img must come back clean
+checkClean() {
+	shell "$1" CHECK | grep -q "no problems found" || fail "CHECK found problems on $1"
+}
+
+# sets FAT16 entry cluster to value in every FAT copy of img
+setFAT16() {
+	local img=$1 cluster=$2 value=$3
+	local bps=$(od -An -tu2 -j11 -N2 $img) rsvd=$(od -An -tu2 -j14 -N2 $img)
+	local fats=$(od -An -tu1 -j16 -N1 $img) fatsz=$(od -An -tu2 -j22 -N2 $img)
+	local bytes=$(printf '\\x%02x\\x%02x' $((value & 255)) $((value >> 8)))
+	for ((i = 0; i < fats; i++)); do
+		printf "$bytes" | dd of=$img bs=1 seek=$((((rsvd + (i * fatsz)) * bps) + (cluster * 2))) conv=notrunc status=none
+	done
+}
+
+head -c 3000 /dev/urandom > small.bin
+head -c 200000 /dev/urandom > large.bin
+
+# mkfs, then a PUT/GET round trip through the root and a subdirectory
+for fat in "12 4M" "16 32M" "32 300M"; do
+	set -- $fat
+	img=fat$1.img
+	"$FS" -m $2 -t $1 -l SMOKE $img > /dev/null || fail "mkfs FAT$1"
+	shell $img INFO | grep -q "FAT$1" || fail "FAT$1 image not recognised"
+	shell $img "PUT SMALL.BIN small.bin" "MD SUB" "CD SUB" "PUT LARGE_FILE_NAME.BIN large.bin" "GET LARGE_FILE_NAME.BIN out$1.large" \
+		"CD .." "GET SMALL.BIN out$1.small" > /dev/null
+	cmp -s small.bin out$1.small || fail "FAT$1 round trip in the root"
+	cmp -s large.bin out$1.large || fail "FAT$1 round trip in a subdirectory"
+	checkClean $img
+done
+
+# mkfs that cannot write the whole image says so and leaves nothing behind
+(trap '' XFSZ; ulimit -f 1; "$FS" -m 32M -t 16 short.img 2>&1) | grep -q "Couldn't open local file for writing" || fail "mkfs past a size limit"
+[ ! -e short.img ] || fail "failed mkfs left an image behind"
+
+# CD, GET, PUT and DEL find long names whatever their case, and each write
+# is seen by the lookups that follow it in the same session
+shell fat16.img "MD LongDirectoryName" "CD longdirectoryname" "PUT MixedCaseFile.text small.bin" "CD .." "CD LONGDIRECTORYNAME" \
+	"GET mixedcasefile.TEXT case.small" "PUT MIXEDCASEFILE.TEXT large.bin" "GET mixedcasefile.text case.large" \
+	"DEL mixedCASEfile.TEXT" "GET MixedCaseFile.text case.gone" > /dev/null
+cmp -s small.bin case.small || fail "GET by long name in another case"
+cmp -s large.bin case.large || fail "PUT over a long name in another case"
+[ ! -e case.gone ] || fail "DEL by long name in another case"
+shell fat16.img "CD LongDirectoryName" DIR | grep -q "0 file(s)" || fail "DEL in another case left a file behind"
+checkClean fat16.img
+
+# FIND searches the whole volume by long name in any case, by size and by
+# date, and its name index follows the files written after it was built
+shell fat16.img "FIND large_file" | grep -q "/SUB/LARGE_FILE_NAME.BIN" || fail "FIND by long name"
+found=$(shell fat16.img "FIND .BIN --min-size 100000")
+echo "$found" | grep -q "1 match(es)" && echo "$found" | grep -q "/SUB/LARGE_FILE_NAME.BIN" || fail "FIND by minimum size"
+found=$(shell fat16.img "FIND .BIN --max-size 5000")
+echo "$found" | grep -q "1 match(es)" && echo "$found" | grep -q " /SMALL.BIN" || fail "FIND by maximum size"
+shell fat16.img "FIND .BIN --after $(date -d yesterday +%F)" | grep -q "2 match(es)" || fail "FIND after a date"
+shell fat16.img "FIND .BIN --before $(date -d yesterday +%F)" | grep -q "0 match(es)" || fail "FIND before a date"
+shell fat16.img "FIND newerfile" "CD LongDirectoryName" "PUT NewerFile.dat small.bin" "FIND newerfile" \
+	| grep -q "/LongDirectoryName/NewerFile.dat" || fail "FIND missed a file written after its first query"
+
+# GET leaves holes where clusters are all zeros, and -p gives the clusters
+# of deleted files back to the host filesystem
+"$FS" -m 32M -t 16 sparse.img > /dev/null || fail "mkfs for sparse files"
+head -c 1000000 /dev/zero > zero.bin
+shell sparse.img "PUT ZERO.BIN zero.bin" "GET ZERO.BIN sparse.zero" > /dev/null
+cmp -s zero.bin sparse.zero || fail "GET of a zero-filled file"
+[ $(($(stat -c '%b * %B' sparse.zero))) -lt $(stat -c %s sparse.zero) ] || fail "GET of a zero-filled file is not sparse"
+shell sparse.img "PUT LARGE.BIN large.bin" > /dev/null
+before=$(($(stat -c '%b * %B' sparse.img)))
+printf '%s\n' "DEL LARGE.BIN" EXIT | "$FS" -p sparse.img > /dev/null 2>&1
+[ $(($(stat -c '%b * %B' sparse.img))) -lt $before ] || fail "DEL with -p kept the freed clusters allocated"
+checkClean sparse.img
+
+# CHECK walks a tree of directories in parallel, then finds a lost chain
+# and a lost loop planted in the FAT and repairs both
+"$FS" -m 32M -t 16 check.img > /dev/null || fail "mkfs for CHECK"
+cmds=()
+for d in 1 2 3 4 5 6; do
+	cmds+=("MD DIR$d" "CD DIR$d" "PUT F$d.BIN small.bin" "MD SUB" "CD SUB" "PUT G$d.BIN large.bin" "CD ../..")
+done
+shell check.img "${cmds[@]}" > /dev/null
+checkClean check.img
+# the last clusters on the volume, well past anything the files use
+last=$(($(shell check.img INFO | sed -n 's/^Data clusters: //p') + 1))
+setFAT16 check.img $((last - 10)) $((last - 9))
+setFAT16 check.img $((last - 9)) 0xFFFF
+setFAT16 check.img $((last - 2)) $((last - 1))
+setFAT16 check.img $((last - 1)) $last
+setFAT16 check.img $last $((last - 2))
+report=$(shell check.img CHECK)
+echo "$report" | grep -q "Lost chain of 2 cluster(s) at cluster $((last - 10))" || fail "CHECK missed a lost chain"
+echo "$report" | grep -q "5 cluster(s) in use by no file or directory" || fail "CHECK miscounted lost clusters"
+shell check.img "CHECK FIX" > /dev/null
+checkClean check.img
+shell check.img "CD DIR4" "CD SUB" "GET G4.BIN check.large" > /dev/null
+cmp -s large.bin check.large || fail "file changed by CHECK FIX"
+
+# DU sums the CHECK tree the same way on every run, however its parallel
+# walk happens to split the directories
+first=$(shell check.img DU)
+echo "$first" | grep -q "12 file(s) in 13 director(ies): 1218000 bytes" || fail "DU totals"
+echo "$first" | grep -Eq "^ +[0-9]+ +203000 +2 +1  \./DIR4/$" || fail "DU per-directory totals"
+for i in 1 2 3 4 5; do
+	[ "$first" = "$(shell check.img DU)" ] || fail "DU differs between runs"
+done
+shell check.img "DU DIR4 --top 1" | grep -q "2 file(s) in 2 director(ies): 203000 bytes" || fail "DU of a subdirectory"
+
+# COMPACT squeezes out deleted entries, freeing the directory clusters left
+# empty, and every file still in the directory reads back afterwards
+"$FS" -m 32M -t 16 compact.img > /dev/null || fail "mkfs for COMPACT"
+cmds=("MD D" "CD D")
+for i in $(seq 10 49); do
+	cmds+=("PUT F$i.BIN small.bin")
+done
+shell compact.img "${cmds[@]}" "DEL F[1-3]*.BIN" > /dev/null
+shell compact.img "COMPACT D" | grep -q "[1-9][0-9]* cluster(s) freed" || fail "COMPACT freed no clusters"
+shell compact.img "CD D" "GET F40.BIN compact.first" "GET F49.BIN compact.last" "DIR" | grep -q "10 file(s)" || fail "COMPACT lost entries"
+cmp -s small.bin compact.first && cmp -s small.bin compact.last || fail "GET after COMPACT"
+checkClean compact.img
+
+# the -i index sidecar is written on exit, serves the next start, and is not
+# trusted once the image changed without it
+"$FS" -m 32M -t 16 index.img > /dev/null || fail "mkfs for the index"
+printf '%s\n' "MD IDX" "CD IDX" "PUT ONE.BIN small.bin" EXIT | "$FS" -i index.img > /dev/null 2>&1
+[ -s index.img.idx ] || fail "no index sidecar written"
+shell index.img "CD IDX" "PUT TWO.BIN large.bin" > /dev/null
+listing=$(printf '%s\n' "CD IDX" "DIR --raw" "GET TWO.BIN index.large" EXIT | "$FS" -i index.img 2>&1)
+echo "$listing" | grep -q "ONE.BIN" || fail "file missing when started from the index"
+echo "$listing" | grep -q "TWO.BIN" || fail "stale index hid a file"
+cmp -s large.bin index.large || fail "GET after starting from the index"
+checkClean index.img
+
+# server mode: concurrent clients round trip files, a file being written is
+# BUSY to everyone else, and uploads whose client disappears are rolled back
+if command -v python3 > /dev/null; then
+	"$FS" -m 32M -t 16 server.img > /dev/null || fail "mkfs for the server"
+	"$FS" -s server.sock server.img > /dev/null 2>&1 &
+	server=$!
+	for i in $(seq 50); do
+		[ -S server.sock ] && break
+		sleep 0.1
+	done
+	python3 - server.sock large.bin << 'CLIENT' || fail "server checks"
+import socket, struct, sys, threading, time
+path, data = sys.argv[1], open(sys.argv[2], 'rb').read()
+class Client:
+	def __init__(self):
+		self.s = socket.socket(socket.AF_UNIX)
+		self.s.connect(path)
+	def send(self, payload):
+		self.s.sendall(struct.pack('!I', len(payload)) + payload)
+	def exactly(self, n):
+		b = b''
+		while len(b) < n:
+			chunk = self.s.recv(n - len(b))
+			if not chunk:
+				sys.exit('server closed the connection')
+			b += chunk
+		return b
+	def frame(self):
+		return self.exactly(struct.unpack('!I', self.exactly(4))[0])
+	def cmd(self, command):
+		self.send(command.encode())
+		return self.frame().decode()
+	def put(self, name, payload):
+		reply = self.cmd('PUT ' + name)
+		if reply != 'OK':
+			return reply
+		for i in range(0, len(payload), 65536):
+			self.send(payload[i:i + 65536])
+		self.send(b'')
+		return self.frame().decode()
+	def get(self, name):
+		reply, payload = self.cmd('GET ' + name), b''
+		while reply.startswith('OK'):
+			chunk = self.frame()
+			if not chunk:
+				break
+			payload += chunk
+		return reply, payload
+def roundTrip(i):
+	c = Client()
+	assert c.put('T%d.BIN' % i, data) == 'OK %d' % len(data), i
+	assert c.get('T%d.BIN' % i)[1] == data, i
+threads = [threading.Thread(target=roundTrip, args=(i,)) for i in range(8)]
+[t.start() for t in threads]
+[t.join() for t in threads]
+for i in range(8):
+	assert Client().get('T%d.BIN' % i)[1] == data, i
+a, b = Client(), Client()
+assert a.cmd('APPEND T0.BIN') == 'OK'
+a.send(b'x' * 100)
+for command in ('DEL T0.BIN', 'DEL T*.BIN', 'PUT T0.BIN', 'GET T0.BIN'):
+	assert b.cmd(command) == 'ERR BUSY', command
+a.s.close()
+time.sleep(0.3)
+assert b.get('T0.BIN')[1] == data, 'aborted APPEND kept'
+c = Client()
+assert c.cmd('PUT NEW.BIN') == 'OK'
+c.send(b'y' * 1000)
+c.s.close()
+time.sleep(0.3)
+assert b.cmd('GET NEW.BIN') == 'ERR FILENOTFOUND', 'aborted PUT kept'
+CLIENT
+	kill -INT $server
+	wait $server
+	checkClean server.img
+else
+	echo "skipping server checks: no python3"
+fi
+
+# -o leaves the base image untouched, reads its own writes back, and FLATTEN
+# turns base plus overlay into a standalone image
+"$FS" -m 32M -t 16 base.img > /dev/null || fail "mkfs for the overlay"
+shell base.img "PUT BASE.BIN small.bin" > /dev/null
+before=$(cksum < base.img)
+printf '%s\n' "DEL BASE.BIN" "MD OVL" "CD OVL" "PUT OVER.BIN large.bin" "GET OVER.BIN overlay.large" "CD .." "FLATTEN flat.img" EXIT \
+	| "$FS" -o changes.ovl base.img > /dev/null 2>&1
+[ "$before" = "$(cksum < base.img)" ] || fail "writes through an overlay changed the base image"
+cmp -s large.bin overlay.large || fail "GET through an overlay"
+printf '%s\n' "CD OVL" "GET OVER.BIN reopened.large" EXIT | "$FS" -o changes.ovl base.img > /dev/null 2>&1
+cmp -s large.bin reopened.large || fail "overlay lost a file when opened again"
+shell base.img "GET BASE.BIN overlay.small" > /dev/null
+cmp -s small.bin overlay.small || fail "base image lost a file deleted in the overlay"
+shell flat.img "GET BASE.BIN flat.small" "CD OVL" "GET OVER.BIN flat.large" > /dev/null
+[ ! -e flat.small ] || fail "FLATTEN kept a file deleted in the overlay"
+cmp -s large.bin flat.large || fail "GET from a flattened image"
+checkClean flat.img
+
+# PUT and APPEND stream from standard input or a pipe of unknown length
+"$FS" -m 32M -t 16 stream.img > /dev/null || fail "mkfs for streaming"
+{ echo "PUT PIPED.BIN -"; cat large.bin; } | "$FS" stream.img > /dev/null 2>&1
+mkfifo stream.fifo
+cat small.bin > stream.fifo &
+shell stream.img "APPEND PIPED.BIN stream.fifo" "GET PIPED.BIN stream.out" > /dev/null
+wait
+cat large.bin small.bin | cmp -s - stream.out || fail "PUT from standard input and APPEND from a pipe"
+checkClean stream.img
+
+# GET writes to an open descriptor or to standard output, which carries
+# nothing but the file since prompts and messages go to standard error
+printf '%s\n' "GET PIPED.BIN &3" EXIT | "$FS" stream.img 3> stream.fd > /dev/null 2>&1
+cmp -s stream.out stream.fd || fail "GET to a descriptor"
+before=$(cksum < stream.img)
+shell stream.img "GET PIPED.BIN &3" | grep -q "Couldn't open local file for writing" || fail "GET to the image's own descriptor"
+[ "$before" = "$(cksum < stream.img)" ] || fail "GET to &3 wrote into the image"
+printf '%s\n' "GET PIPED.BIN -" EXIT | "$FS" stream.img 2> /dev/null > stream.stdout
+cmp -s stream.out stream.stdout || fail "GET to standard output"
+"$FS" stream.img <<< "GET PIPED.BIN -" 2> /dev/null | cmp -s stream.out - || fail "GET to standard output at end of input"
+"$FS" stream.img <<< "GET PIPED.* -" 2> /dev/null | cmp -s stream.out - || fail "GET of a single match to standard output"
+shell stream.img "PUT PIPED2.BIN small.bin" > /dev/null
+"$FS" stream.img <<< "GET PIPED*.BIN -" 2> stream.err > stream.stdout
+grep -q "matches more than one file" stream.err || fail "GET of several matches to standard output"
+[ ! -s stream.stdout ] || fail "GET of several matches wrote to standard output"
+
+# -w records only the commands typed, and -b replays them against the image
+# as it was before, on a throwaway overlay, with the results they had when
+# recorded and nothing left behind
+"$FS" -m 32M -t 16 trace.img > /dev/null || fail "mkfs for tracing"
+shell trace.img "MD T" "PUT OLD.BIN small.bin" > /dev/null
+cp trace.img untraced.img
+printf '%s\n' "CD T" "PUT A.BIN large.bin" "APPEND A.BIN small.bin" "GET A.BIN trace.out" "CD .." "DEFRAG T/A.BIN" "DU T" \
+	"COMPACT T" "DEL OLD.BIN" "MD T2" EXIT | "$FS" -w ops.trace trace.img > /dev/null 2>&1
+[ "$(grep -v '^#' ops.trace | cut -f1 | tr '\n' ' ')" = "CD PUT APPEND GET CD DEL MD " ] || fail "trace lines"
+before=$(cksum < untraced.img)
+ls /tmp | grep fatreplay > tmp.before
+replay=$("$FS" -i -b ops.trace untraced.img 2>&1)
+echo "$replay" | grep -q "7 call(s) replayed" || fail "replay call count"
+echo "$replay" | grep -q "different result" && fail "replay results differ from the trace"
+[ "$before" = "$(cksum < untraced.img)" ] || fail "replay changed the image"
+ls /tmp | grep fatreplay | diff -q tmp.before - > /dev/null || fail "replay left files in /tmp"
+
+echo "smoke checks passed"